@@ -25,6 +25,8 @@
 #include <texpp/lexer.h>
 #include <iostream>
 #include <sstream>
+#include <fstream>
+#include <cstdio>
 
 using namespace texpp;
 
@@ -50,11 +52,13 @@ void check_output(Token* tokens, size_t count, vector<Token::ptr> output,
     using namespace boost::lambda;
     vector<string> tokens_repr(count);
     std::transform(tokens, tokens+count,
-            tokens_repr.begin(), bind(&Token::repr, boost::lambda::_1));
+            tokens_repr.begin(),
+            boost::lambda::bind(&Token::repr, boost::lambda::_1));
 
     vector<string> output_repr(output.size());
     std::transform(output.begin(), output.end(),
-            output_repr.begin(), bind(&Token::repr, *boost::lambda::_1));
+            output_repr.begin(),
+            boost::lambda::bind(&Token::repr, *boost::lambda::_1));
 
     if(print)
         std::for_each(output_repr.begin(), output_repr.end(),
@@ -306,3 +310,62 @@ BOOST_AUTO_TEST_CASE( lexer_other )
 }
 
 
+
+BOOST_AUTO_TEST_CASE( lexer_token_size )
+{
+    BOOST_CHECK_LE(sizeof(Token), size_t(32));
+
+    shared_ptr<Lexer> lexer = create_lexer("\\abc d");
+    Token::ptr token = lexer->nextToken();
+    BOOST_CHECK_EQUAL(token->value(), "\\abc");
+    BOOST_CHECK_EQUAL(token->valueId(), Intern::id("\\abc"));
+    BOOST_CHECK_EQUAL(lexer->nextToken()->valueId(), Intern::id(' '));
+    BOOST_CHECK_EQUAL(lexer->nextToken()->valueId(), Intern::id('d'));
+
+    Token::ptr copy = token->lcopy();
+    BOOST_CHECK_EQUAL(copy->valueId(), token->valueId());
+    BOOST_CHECK_EQUAL(copy->source(), "");
+    BOOST_CHECK_EQUAL(token->source(), "\\abc");
+}
+
+BOOST_AUTO_TEST_CASE( lexer_input_source )
+{
+    // Line ending split across the block boundary
+    string input(65535, 'a');
+    input += "\r\nb\rc\n\rd";
+
+    const char* fname = "test_lexer_input_source.tex";
+    {
+    std::ofstream ofile(fname, std::ios::binary);
+    ofile << input;
+    }
+
+    vector<Token::ptr> expected = run_lexer(create_lexer(input));
+    BOOST_CHECK_EQUAL(expected.size(), size_t(65535+8));
+
+    InputSource::ptr source = InputSource::open(fname);
+    BOOST_REQUIRE(source);
+    vector<Token::ptr> output =
+            run_lexer(shared_ptr<Lexer>(new Lexer("", source)));
+    std::remove(fname);
+
+    BOOST_REQUIRE_EQUAL(expected.size(), output.size());
+    for(size_t n=0; n<output.size(); ++n)
+        BOOST_CHECK_EQUAL(expected[n]->repr(), output[n]->repr());
+
+    BOOST_CHECK(!InputSource::open("test_lexer_nonexistent.tex"));
+
+    // Interactive streams are read line by line into the same buffer
+    string lines = "\\def\\a{x}\n\\show\\a\r\n\\end\rab\n";
+    expected = run_lexer(create_lexer(lines));
+    BOOST_CHECK_EQUAL(expected.size(), size_t(14));
+
+    std::istringstream stream(lines);
+    output = run_lexer(shared_ptr<Lexer>(new Lexer("",
+                InputSource::ptr(new StreamInputSource(&stream, true)))));
+
+    BOOST_REQUIRE_EQUAL(expected.size(), output.size());
+    for(size_t n=0; n<output.size(); ++n)
+        BOOST_CHECK_EQUAL(expected[n]->repr(), output[n]->repr());
+}
+
@@ -21,12 +21,18 @@
 #include <boost/foreach.hpp>
 #include <boost/lambda/lambda.hpp>
 #include <boost/lambda/bind.hpp>
+#include <boost/weak_ptr.hpp>
 
 #include <texpp/parser.h>
 #include <texpp/logger.h>
 #include <texpp/command.h>
+#include <texpp/base/func.h>
+#include <texpp/base/dimen.h>
+#include <texpp/base/format.h>
 #include <iostream>
 #include <sstream>
+#include <cstdio>
+#include <algorithm>
 
 using namespace texpp;
 
@@ -34,7 +40,7 @@ class TestLogger: public Logger
 {
 public:
     bool log(Level, const string& message,
-                Parser&, shared_ptr<Token> token) {
+                Parser&, Token::ptr token) {
         logMessages.push_back(message);
         logPositions.push_back(
             token ? std::make_pair(token->lineNo(), token->charPos())
@@ -233,6 +239,102 @@ BOOST_AUTO_TEST_CASE( parser_symbols )
     BOOST_CHECK_EQUAL(0, parser->symbol("d", 0));
 
     BOOST_CHECK_EQUAL(7, parser->symbol("e", 0));
+
+    // Names interned after the initial symbols
+    parser->setSymbol("parser_symbols_name", 9);
+    parser->beginGroup();
+    parser->setSymbol("parser_symbols_name", 10);
+    BOOST_CHECK_EQUAL(10, parser->symbol("parser_symbols_name", 0));
+    parser->endGroup();
+    BOOST_CHECK_EQUAL(9, parser->symbol("parser_symbols_name", 0));
+    BOOST_CHECK_EQUAL(0, create_parser("")->symbol("parser_symbols_name", 0));
+}
+
+BOOST_AUTO_TEST_CASE( parser_values )
+{
+    any a(1), b(string("str")), c(double(2.5)), e;
+    BOOST_CHECK(e.empty());
+    BOOST_CHECK_EQUAL(any::EMPTY, e.tag());
+    BOOST_CHECK_EQUAL(any::INT, a.tag());
+    BOOST_CHECK_EQUAL(any::STRING, b.tag());
+    BOOST_CHECK_EQUAL(any::OTHER, c.tag());
+    BOOST_CHECK(c.type() == typeid(double));
+
+    BOOST_CHECK(any_cast<int>(&a) && *any_cast<int>(&a) == 1);
+    BOOST_CHECK(!any_cast<string>(&a));
+    BOOST_CHECK(!any_cast<int>(&c));
+    BOOST_CHECK_EQUAL(2.5, *any_cast<double>(&c));
+
+    a.swap(b);
+    BOOST_CHECK_EQUAL(string("str"), *any_cast<string>(&a));
+    BOOST_CHECK_EQUAL(1, *any_cast<int>(&b));
+
+    e = a; a = c; c = Token::list(2);
+    BOOST_CHECK_EQUAL(string("str"), *any_cast<string>(&e));
+    BOOST_CHECK_EQUAL(2.5, *any_cast<double>(&a));
+    BOOST_CHECK_EQUAL(any::TOKEN_LIST, c.tag());
+    BOOST_CHECK_EQUAL(size_t(2), any_cast<Token::list>(&c)->size());
+}
+
+BOOST_AUTO_TEST_CASE( parser_names )
+{
+    shared_ptr<Parser> parser = create_parser("\\def\\foo{x}");
+    Node::ptr document = parser->parse();
+
+    unsigned id = parser->localSymbolId("\\foo");
+    BOOST_CHECK(!Intern::isShared(id));
+    BOOST_CHECK(Intern::isShared(parser->localSymbolId("\\relax")));
+    BOOST_CHECK(parser->symbol("\\foo", Command::ptr()));
+
+    // Other parsers intern their names separately
+    shared_ptr<Parser> other = create_parser("");
+    BOOST_CHECK(other->localSymbolId("\\foo") != id);
+    BOOST_CHECK(!other->symbol("\\foo", Command::ptr()));
+
+    // Tokens made outside of the parser are looked up by name
+    Token::ptr token = Token::create(Token::TOK_CONTROL,
+                                     Token::CC_ESCAPE, "\\foo");
+    BOOST_CHECK(token->valueId() != id);
+    BOOST_CHECK(parser->symbol(token, Command::ptr()));
+
+    // Names are released with the parser and the last token using them
+    parser.reset();
+    BOOST_CHECK_EQUAL(Intern::str(id), "\\foo");
+    document.reset();
+    BOOST_CHECK(!Intern::overlay(id));
+}
+
+BOOST_AUTO_TEST_CASE( parser_registers )
+{
+    shared_ptr<Parser> parser = create_parser("");
+
+    unsigned count12 = Parser::registerId(Parser::REGISTER_COUNT, 12);
+    unsigned count32767 = Parser::registerId(Parser::REGISTER_COUNT, 32767);
+    BOOST_CHECK(Parser::isRegisterId(count12));
+    BOOST_CHECK_EQUAL(count12, Parser::symbolId("count12"));
+    BOOST_CHECK_EQUAL(count32767, Parser::symbolId("count32767"));
+    BOOST_CHECK(!Parser::isRegisterId(Parser::symbolId("count012")));
+    BOOST_CHECK(!Parser::isRegisterId(Parser::symbolId("count32768")));
+    BOOST_CHECK(!Parser::isRegisterId(Parser::symbolId("counter1")));
+    BOOST_CHECK_EQUAL(string("count12"), Parser::symbolName(count12));
+    BOOST_CHECK_EQUAL(Parser::registerId(Parser::REGISTER_BOX, 0),
+                      Parser::symbolId("box0"));
+    BOOST_CHECK_EQUAL(Parser::registerId(Parser::REGISTER_SFCODE, 46),
+                      Parser::symbolId("sfcode46"));
+
+    BOOST_CHECK_EQUAL(0, parser->symbol(count12, -1));
+    BOOST_CHECK_EQUAL(0, parser->symbol(count32767, -1));
+
+    parser->setSymbol(count12, 1);
+    parser->beginGroup();
+    parser->setSymbol("count12", 2);
+    parser->setSymbol(count32767, 3);
+    BOOST_CHECK_EQUAL(2, parser->symbol(count12, 0));
+    BOOST_CHECK_EQUAL(3, parser->symbol("count32767", 0));
+    parser->endGroup();
+
+    BOOST_CHECK_EQUAL(1, parser->symbol("count12", 0));
+    BOOST_CHECK_EQUAL(0, parser->symbol(count32767, -1));
 }
 
 BOOST_AUTO_TEST_CASE( parser_parse )
@@ -293,7 +395,7 @@ BOOST_AUTO_TEST_CASE( parser_expansion )
     if(tokens.size() == 2) {
         BOOST_CHECK_EQUAL(tokens[0]->repr(),
             Token(Token::TOK_SKIPPED, Token::CC_ESCAPE,
-                "\\macro", "\\macro12", 0, 0, 0).repr());
+                "\\macro", "\\macro12", 0, 0, 0, 8).repr());
         BOOST_CHECK_EQUAL(tokens[1]->repr(), token.repr());
     }
 
@@ -355,3 +457,345 @@ BOOST_AUTO_TEST_CASE( parser_expansion )
         BOOST_CHECK_EQUAL(tokens[0]->repr(), token.repr());
 }
 
+BOOST_AUTO_TEST_CASE( parser_expansion_modes )
+{
+    // Markers reference the span of the input covered by the
+    // expansion: linePos is its offset and charEnd is its length
+    shared_ptr<Parser> parser = create_parser("x\\macro1234");
+    parser->setSymbol("\\macro", Command::ptr(new TestMacro("\\macro")));
+
+    Token::list tokens;
+    BOOST_CHECK_EQUAL(parser->nextToken(&tokens)->value(), "x");
+    tokens.clear();
+    BOOST_CHECK_EQUAL(parser->nextToken(&tokens)->value(), "8");
+    BOOST_CHECK_EQUAL(tokens.size(), 2);
+    if(tokens.size() == 2) {
+        BOOST_CHECK_EQUAL(tokens[0]->repr(),
+            Token(Token::TOK_SKIPPED, Token::CC_ESCAPE,
+                "\\macro", "\\macro12", 1, 0, 0, 8).repr());
+    }
+
+    parser = create_parser("\\macro1234");
+    parser->setSymbol("\\macro", Command::ptr(new TestMacro("\\macro")));
+    parser->setExpansionMode(Parser::EXPANSION_SPANS);
+
+    tokens.clear();
+    BOOST_CHECK_EQUAL(parser->nextToken(&tokens)->value(), "8");
+    BOOST_CHECK_EQUAL(tokens.size(), 2);
+    if(tokens.size() == 2) {
+        BOOST_CHECK(tokens[0]->isSkipped());
+        BOOST_CHECK_EQUAL(tokens[0]->value(), "\\macro");
+        BOOST_CHECK_EQUAL(tokens[0]->source(), "\\macro12");
+        BOOST_CHECK_EQUAL(tokens[0]->lineNo(), 0);
+    }
+
+    parser = create_parser("\\macro1234");
+    parser->setSymbol("\\macro", Command::ptr(new TestMacro("\\macro")));
+    parser->setExpansionMode(Parser::EXPANSION_NONE);
+
+    tokens.clear();
+    BOOST_CHECK_EQUAL(parser->nextToken(&tokens)->value(), "8");
+    BOOST_CHECK_EQUAL(tokens.size(), 1);
+    BOOST_CHECK_EQUAL(parser->nextToken(&tokens)->value(), "9");
+    BOOST_CHECK_EQUAL(parser->nextToken(&tokens)->value(), "3");
+
+    parser = create_parser("\\iffalse a b\\relax\\else c\\fi");
+    parser->setExpansionMode(Parser::EXPANSION_SPANS);
+
+    tokens.clear();
+    BOOST_CHECK_EQUAL(parser->nextToken(&tokens)->value(), "c");
+    BOOST_CHECK_EQUAL(tokens.size(), 3);
+    if(tokens.size() == 3) {
+        BOOST_CHECK_EQUAL(tokens[0]->value(), "\\iffalse");
+        BOOST_CHECK_EQUAL(tokens[0]->source(), "\\iffalse a b\\relax\\else");
+        BOOST_CHECK(tokens[1]->isSkipped());
+    }
+
+    // Spans of nested expansions cover the whole input
+    string input = "\\catcode`\\{=1 \\catcode`\\}=2 "
+        "\\message{~ \\number\\number--25@}\n"
+        "\\expandafter \\let \\csname x\\endcsname = \\count\n"
+        "\\if\\else\\else\\fi\\if1\\fi\\fi\n";
+    parser = create_parser(input);
+    parser->setExpansionMode(Parser::EXPANSION_SPANS);
+    BOOST_CHECK_EQUAL(parser->parse()->source(), input);
+}
+
+
+BOOST_AUTO_TEST_CASE( parser_expansion_depth )
+{
+    string input;
+    for(int i = 0; i < 20000; ++i)
+        input += "\\expandafter a";
+    input += "\\number 5";
+
+    // Links of \expandafter chains are not nested
+    shared_ptr<Parser> parser = create_parser(input);
+    parser->setMaxExpansionDepth(10);
+
+    int n = 0;
+    Token::ptr token;
+    while((token = parser->nextToken()) && token->value() == "a")
+        ++n;
+    BOOST_CHECK_EQUAL(n, 20000);
+    BOOST_CHECK(token && token->value() == "5");
+    BOOST_CHECK_EQUAL(parser->expansionDepth(), 0);
+
+    shared_ptr<TestLogger> logger =
+        boost::static_pointer_cast<TestLogger>(parser->logger());
+    BOOST_CHECK_EQUAL(logger->logMessages.size(), 1); // banner only
+
+    parser = create_parser("\\number\\number\\number 5");
+    parser->setMaxExpansionDepth(2);
+    parser->nextToken();
+    BOOST_CHECK_EQUAL(parser->expansionDepth(), 0);
+
+    logger = boost::static_pointer_cast<TestLogger>(parser->logger());
+    BOOST_REQUIRE(logger->logMessages.size() > 1);
+    BOOST_CHECK_EQUAL(logger->logMessages[1],
+                "TeX capacity exceeded, sorry [expansion depth=2]");
+
+    // The overflow stops the job
+    parser = create_parser("\\catcode`\\{=1 \\catcode`\\}=2 "
+                           "\\def\\r{\\number\\r}\\r");
+    parser->setMaxExpansionDepth(100);
+    parser->parse();
+    BOOST_CHECK_EQUAL(parser->expansionDepth(), 0);
+
+    logger = boost::static_pointer_cast<TestLogger>(parser->logger());
+    BOOST_CHECK_EQUAL(std::count(logger->logMessages.begin(),
+                logger->logMessages.end(),
+                "TeX capacity exceeded, sorry [expansion depth=100]"), 1);
+
+    // Other expansions are nested up to the default limit
+    input.clear();
+    for(int i = 0; i < 3000; ++i)
+        input += "\\number";
+    input += " 5";
+    parser = create_parser(input);
+    parser->parse();
+    BOOST_CHECK_EQUAL(parser->expansionDepth(), 0);
+
+    logger = boost::static_pointer_cast<TestLogger>(parser->logger());
+    BOOST_CHECK_EQUAL(std::count(logger->logMessages.begin(),
+                logger->logMessages.end(),
+                "TeX capacity exceeded, sorry [expansion depth=2000]"), 1);
+
+    parser = create_parser("\\catcode`\\{=1 \\catcode`\\}=2 "
+                           "\\def\\r{\\number\\r}\\r");
+    parser->parse();
+    logger = boost::static_pointer_cast<TestLogger>(parser->logger());
+    BOOST_CHECK_EQUAL(std::count(logger->logMessages.begin(),
+                logger->logMessages.end(),
+                "TeX capacity exceeded, sorry [expansion depth=2000]"), 1);
+}
+
+BOOST_AUTO_TEST_CASE( parser_deep_groups )
+{
+    const int depth = 20000;
+    shared_ptr<Parser> parser = create_parser(
+        string(depth, '{') + "x" + string(depth, '}'));
+    parser->setSymbol(Parser::registerId(Parser::REGISTER_CATCODE, '{'),
+                                                int(Token::CC_BGROUP));
+    parser->setSymbol(Parser::registerId(Parser::REGISTER_CATCODE, '}'),
+                                                int(Token::CC_EGROUP));
+    Node::ptr node = parser->parse();
+
+    int n = 0;
+    while(node->child("group")) {
+        node = node->child("group");
+        ++n;
+    }
+    BOOST_CHECK_EQUAL(n, depth);
+    BOOST_CHECK(node->child("text_word"));
+    BOOST_CHECK_EQUAL(parser->groupLevel(), 0);
+}
+
+string parse_macro(const string& input, const string& name)
+{
+    shared_ptr<Parser> parser = create_parser(input);
+    parser->setSymbol(Parser::registerId(Parser::REGISTER_CATCODE, '{'),
+                                                int(Token::CC_BGROUP));
+    parser->setSymbol(Parser::registerId(Parser::REGISTER_CATCODE, '}'),
+                                                int(Token::CC_EGROUP));
+    parser->setSymbol(Parser::registerId(Parser::REGISTER_CATCODE, '#'),
+                                                int(Token::CC_PARAM));
+    parser->parse();
+    Command::ptr cmd = parser->symbol(name, Command::ptr());
+    return cmd ? cmd->texRepr(parser.get()) : string();
+}
+
+BOOST_AUTO_TEST_CASE( parser_delimited_arguments )
+{
+    // A partial match of the delimiter becomes part of the argument
+    BOOST_CHECK_EQUAL(parse_macro(
+        "\\def\\a#1xy#2\\end{[#1|#2]}\\edef\\r{\\a axxyb\\end}", "\\r"),
+        "macro:\n->[ax|b]");
+    BOOST_CHECK_EQUAL(parse_macro(
+        "\\def\\a#1aab{[#1]}\\edef\\r{\\a aaab}", "\\r"),
+        "macro:\n->[a]");
+    BOOST_CHECK_EQUAL(parse_macro(
+        "\\def\\a#1abac{[#1]}\\edef\\r{\\a ababac}", "\\r"),
+        "macro:\n->[ab]");
+
+    // Delimiters are not matched inside groups, braces are stripped
+    // only around a single group
+    BOOST_CHECK_EQUAL(parse_macro(
+        "\\def\\a#1.{[#1]}\\edef\\r{\\a{a.}.}", "\\r"),
+        "macro:\n->[a.]");
+    BOOST_CHECK_EQUAL(parse_macro(
+        "\\def\\a#1.{[#1]}\\edef\\r{\\a{a}x{b}.}", "\\r"),
+        "macro:\n->[{a}x{b}]");
+}
+
+BOOST_AUTO_TEST_CASE( parser_shared_expansion )
+{
+    shared_ptr<Parser> parser = create_parser("");
+    Token::list_ptr definition(new Token::list(1, Token::create(
+        Token::TOK_CHARACTER, Token::CC_LETTER, "a", "a", 0, 1, 0, 1)));
+    base::UserMacro macro("\\x", Token::list_ptr(new Token::list()),
+                                                            definition);
+
+    // Expansions of a macro without arguments share one token list
+    Node::ptr node1 = Node::create("macro");
+    Node::ptr node2 = Node::create("macro");
+    macro.expand(*parser, node1);
+    macro.expand(*parser, node2);
+
+    Token::list_ptr tokens = node1->value(Token::list_ptr());
+    BOOST_REQUIRE(tokens);
+    BOOST_CHECK_EQUAL(tokens, node2->value(Token::list_ptr()));
+    BOOST_REQUIRE_EQUAL(tokens->size(), 1);
+    BOOST_CHECK_EQUAL((*tokens)[0]->value(), "a");
+    BOOST_CHECK_EQUAL((*tokens)[0]->lineNo(), 0);
+    BOOST_CHECK_EQUAL((*definition)[0]->lineNo(), 1);
+}
+
+BOOST_AUTO_TEST_CASE( parser_format )
+{
+    shared_ptr<Parser> parser = create_parser(
+        "\\catcode`\\{=1 \\catcode`\\}=2 \\catcode`\\#=6 "
+        "\\def\\a#1.{[#1]}\\let\\b=\\relax \\let\\c=x \\chardef\\d=65 "
+        "\\countdef\\e=7 \\e=12 \\dimen3=2pt \\toksdef\\f=2 \\f={xy}");
+    parser->parse();
+
+    std::stringstream format;
+    BOOST_REQUIRE(parser->dumpFormat(format));
+
+    shared_ptr<Parser> loaded = create_parser("\\d");
+    BOOST_REQUIRE(loaded->loadFormat(format));
+
+    const char* names[] = { "\\a", "\\c", "\\d", "\\e", "\\f" };
+    BOOST_FOREACH(const char* name, names) {
+        Command::ptr cmd = loaded->symbol(name, Command::ptr());
+        BOOST_REQUIRE(cmd);
+        BOOST_CHECK_EQUAL(cmd->texRepr(loaded.get()),
+            parser->symbol(name, Command::ptr())->texRepr(parser.get()));
+    }
+
+    // Primitives are shared
+    BOOST_CHECK_EQUAL(loaded->symbol("\\b", Command::ptr()),
+                      Parser::primitive("\\relax"));
+    BOOST_CHECK_EQUAL(parser->symbol("\\relax", Command::ptr()),
+                      Parser::primitive("\\relax"));
+    BOOST_CHECK_EQUAL(Parser::primitiveName(Parser::primitive("\\relax")),
+                      "\\relax");
+
+    BOOST_CHECK_EQUAL(loaded->symbol("count7", int(0)), 12);
+    BOOST_CHECK_EQUAL(loaded->symbol("dimen3", base::Dimen(0)).value, 131072);
+    BOOST_CHECK_EQUAL(loaded->symbol("catcode123", int(0)), 1);
+    BOOST_CHECK_EQUAL(loaded->peekToken()->value(), "\\d");
+
+    // Values describing the job are not dumped
+    parser = create_parser("\\let\\a=\\relax\n\n\n\\relax");
+    parser->parse();
+    std::stringstream job;
+    BOOST_REQUIRE(parser->dumpFormat(job));
+    BOOST_CHECK_EQUAL(base::FormatImage::create(job.str())->size(), 1);
+
+    loaded = create_parser("\\relax");
+    BOOST_REQUIRE(loaded->loadFormat(job));
+    loaded->parse();
+    parser = create_parser("\\relax");
+    parser->parse();
+    BOOST_CHECK_EQUAL(loaded->symbol("inputlineno", int(-1)),
+                      parser->symbol("inputlineno", int(-1)));
+
+    // Errors
+    std::stringstream bad("TEXPPFMT");
+    BOOST_CHECK(!create_parser("")->loadFormat(bad));
+
+    // Formats with damaged values are rejected when loaded
+    string damaged = job.str();
+    size_t pos = damaged.find("\\relax");
+    BOOST_REQUIRE(pos != string::npos);
+    damaged[pos + 1] = 'Z';
+    BOOST_CHECK(!base::FormatImage::create(damaged));
+    std::stringstream damagedIn(damaged);
+    BOOST_CHECK(!create_parser("")->loadFormat(damagedIn));
+
+    parser = create_parser("");
+    parser->beginGroup();
+    std::stringstream out;
+    BOOST_CHECK(!parser->dumpFormat(out));
+}
+
+BOOST_AUTO_TEST_CASE( parser_format_image )
+{
+    shared_ptr<Parser> parser = create_parser(
+        "\\catcode`\\{=1 \\catcode`\\}=2 \\def\\a{x}\\def\\b{y}");
+    parser->parse();
+
+    const string fileName = "test_parser_format.fmt";
+    BOOST_REQUIRE(parser->dumpFormat(fileName));
+
+    shared_ptr<Parser> parser1 = create_parser("");
+    shared_ptr<Parser> parser2 = create_parser("");
+    BOOST_REQUIRE(parser1->loadFormat(fileName));
+    BOOST_REQUIRE(parser2->loadFormat(fileName));
+    std::remove(fileName.c_str());
+
+    // Values of the format are shared by the parsers
+    Command::ptr a = parser1->symbol("\\a", Command::ptr());
+    BOOST_REQUIRE(a);
+    BOOST_CHECK_EQUAL(a, parser2->symbol("\\a", Command::ptr()));
+
+    // Changes are local to the parser
+    parser1->setSymbol("\\b", Parser::primitive("\\relax"));
+    BOOST_CHECK_EQUAL(parser1->symbol("\\b", Command::ptr()),
+                      Parser::primitive("\\relax"));
+    BOOST_CHECK_EQUAL(parser2->symbol("\\b", Command::ptr())->texRepr(),
+                      "macro:\n->y");
+
+    parser2->beginGroup();
+    parser2->setSymbol("\\a", Command::ptr());
+    BOOST_CHECK(!parser2->symbol("\\a", Command::ptr()));
+    parser2->endGroup();
+    BOOST_CHECK_EQUAL(parser2->symbol("\\a", Command::ptr()), a);
+
+    // A format replaced at once with the same size is not confused
+    // with the previous one
+    parser = create_parser(
+        "\\catcode`\\{=1 \\catcode`\\}=2 \\def\\a{z}\\def\\b{y}");
+    parser->parse();
+    BOOST_REQUIRE(parser->dumpFormat(fileName));
+    base::FormatImage::ptr image = base::FormatImage::open(fileName);
+    BOOST_REQUIRE(image);
+    BOOST_CHECK_EQUAL(base::FormatImage::open(fileName), image);
+    shared_ptr<Parser> parser3 = create_parser("");
+    BOOST_REQUIRE(parser3->loadFormat(image));
+    std::remove(fileName.c_str());
+    BOOST_CHECK_EQUAL(parser3->symbol("\\a", Command::ptr())->texRepr(),
+                      "macro:\n->z");
+
+    // Images are released with the last parser using them once
+    // another image is opened
+    weak_ptr<base::FormatImage> released = image;
+    image.reset();
+    parser3.reset();
+    BOOST_CHECK(!released.expired());
+    BOOST_REQUIRE(parser->dumpFormat(fileName));
+    BOOST_REQUIRE(base::FormatImage::open(fileName));
+    std::remove(fileName.c_str());
+    BOOST_CHECK(released.expired());
+}
@@ -17,7 +17,6 @@
 */
 
 #include <iostream>
-#include <fstream>
 #include <string>
 
 #include <texpp/parser.h>
@@ -26,36 +25,31 @@
 int main(int argc, char** argv)
 {
     std::string fileName;
-    std::istream *file;
+    texpp::InputSource::ptr source;
     bool interactive;
 
     if(argc >= 2) {
         interactive = false;
         fileName = argv[1];
-        file = new std::ifstream(argv[1], std::fstream::in);
-        if(file->fail()) {
+        source = texpp::InputSource::open(fileName);
+        if(!source) {
             std::cerr << "Can not open file " << argv[1] << std::endl;
-            delete file;
             return 255;
         }
     } else {
         interactive = true;
-        file = &std::cin;
+        source = texpp::InputSource::ptr(
+                    new texpp::StreamInputSource(&std::cin, true));
     }
 
-    texpp::Parser parser(fileName, file, "", interactive, false,
+    texpp::Parser parser(fileName, source, "", interactive, false,
                     texpp::Logger::ptr(new texpp::ConsoleLogger));
     texpp::Node::ptr document = parser.parse();
 
-    if(file == &std::cin) {
+    if(interactive) {
         std::cout << "Parsed document: " << std::endl;
         std::cout << document->treeRepr();
     }
-    
-    if(file != &std::cin) {
-        static_cast<std::ifstream*>(file)->close();
-        delete file;
-    }
 
     return 0;
 }
@@ -0,0 +1,208 @@
+/*  This file is part of texpp library.
+    Copyright (C) 2009 Vladimir Kuznetsov <ks.vladimir@gmail.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef __TEXPP_ANY_H
+#define __TEXPP_ANY_H
+
+#include <string>
+#include <vector>
+#include <typeinfo>
+#include <new>
+#include <algorithm>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/type_traits/alignment_of.hpp>
+
+namespace texpp {
+
+class Token;
+class Command;
+
+namespace base {
+    struct Dimen;
+    struct Glue;
+    struct Box;
+    struct ParshapeInfo;
+    struct FontInfo;
+} // namespace base
+
+// Tagged value used for symbol and node values. The types listed
+// in Tag are recognized by comparing tags only, values that fit in
+// the inline storage (ints, dimens, glues, pointers, token lists)
+// are stored without heap allocation. Values of any other type are
+// still accepted and are identified by their type_info.
+class any
+{
+public:
+    enum Tag { EMPTY, INT, BOOL, STRING, DIMEN, GLUE, TOKEN, TOKEN_LIST,
+               COMMAND, FONT_INFO, BOX, PARSHAPE, OTHER };
+
+    any(): m_ops(0) {}
+    any(const any& other): m_ops(other.m_ops) {
+        if(m_ops) m_ops->copy(other.m_storage, m_storage);
+    }
+    template<typename T> any(const T& value): m_ops(&Ops<T>::table) {
+        Holder<T>::create(m_storage, value);
+    }
+    ~any() { if(m_ops) m_ops->destroy(m_storage); }
+
+    any& operator=(const any& other) {
+        any(other).swap(*this); return *this;
+    }
+    template<typename T> any& operator=(const T& value) {
+        any(value).swap(*this); return *this;
+    }
+
+    any& swap(any& other);
+
+    bool empty() const { return !m_ops; }
+    Tag tag() const { return m_ops ? Tag(m_ops->tag) : EMPTY; }
+    const std::type_info& type() const {
+        return m_ops ? m_ops->type() : typeid(void);
+    }
+
+    template<typename T> bool is() const;
+
+    template<typename T> T* ptr() { return Holder<T>::get(m_storage); }
+    template<typename T> const T* ptr() const {
+        return Holder<T>::get(const_cast<Storage&>(m_storage));
+    }
+
+protected:
+    union Storage {
+        void*   pointer;
+        char    buffer[3*sizeof(void*)];
+        double  align;
+    };
+
+    struct OpsTable {
+        int tag;
+        const std::type_info& (*type)();
+        void (*copy)(const Storage& from, Storage& to);
+        void (*move)(Storage& from, Storage& to);
+        void (*destroy)(Storage& storage);
+    };
+
+    template<typename T, bool Inline = (sizeof(T) <= sizeof(Storage) &&
+        boost::alignment_of<T>::value <= boost::alignment_of<Storage>::value)>
+    struct Holder;
+
+    template<typename T> struct Ops {
+        static const std::type_info& type() { return typeid(T); }
+        static void copy(const Storage& from, Storage& to) {
+            Holder<T>::create(to, *Holder<T>::get(
+                        const_cast<Storage&>(from)));
+        }
+        static void move(Storage& from, Storage& to) {
+            Holder<T>::move(from, to);
+        }
+        static void destroy(Storage& storage) {
+            Holder<T>::destroy(storage);
+        }
+        static const OpsTable table;
+    };
+
+    const OpsTable* m_ops;
+    Storage         m_storage;
+};
+
+template<typename T> struct any_tag { static const int value = any::OTHER; };
+
+#define __TEXPP_ANY_TAG(T, t) \
+    template<> struct any_tag< T > { static const int value = any::t; }
+
+__TEXPP_ANY_TAG(int, INT);
+__TEXPP_ANY_TAG(bool, BOOL);
+__TEXPP_ANY_TAG(std::string, STRING);
+__TEXPP_ANY_TAG(base::Dimen, DIMEN);
+__TEXPP_ANY_TAG(base::Glue, GLUE);
+__TEXPP_ANY_TAG(boost::intrusive_ptr<Token>, TOKEN);
+__TEXPP_ANY_TAG(std::vector< boost::intrusive_ptr<Token> >, TOKEN_LIST);
+__TEXPP_ANY_TAG(boost::shared_ptr<Command>, COMMAND);
+__TEXPP_ANY_TAG(boost::shared_ptr<base::FontInfo>, FONT_INFO);
+__TEXPP_ANY_TAG(base::Box, BOX);
+__TEXPP_ANY_TAG(base::ParshapeInfo, PARSHAPE);
+
+#undef __TEXPP_ANY_TAG
+
+template<typename T>
+struct any::Holder<T, true>
+{
+    static T* get(Storage& s) { return reinterpret_cast<T*>(s.buffer); }
+    static void create(Storage& s, const T& v) { new (s.buffer) T(v); }
+    static void move(Storage& from, Storage& to) {
+        create(to, *get(from)); destroy(from);
+    }
+    static void destroy(Storage& s) { get(s)->~T(); }
+};
+
+template<typename T>
+struct any::Holder<T, false>
+{
+    static T* get(Storage& s) { return static_cast<T*>(s.pointer); }
+    static void create(Storage& s, const T& v) { s.pointer = new T(v); }
+    static void move(Storage& from, Storage& to) { to.pointer = from.pointer; }
+    static void destroy(Storage& s) { delete get(s); }
+};
+
+template<typename T>
+const any::OpsTable any::Ops<T>::table = {
+    any_tag<T>::value, &any::Ops<T>::type, &any::Ops<T>::copy,
+    &any::Ops<T>::move, &any::Ops<T>::destroy
+};
+
+inline any& any::swap(any& other)
+{
+    Storage tmp;
+    if(m_ops) m_ops->move(m_storage, tmp);
+    if(other.m_ops) other.m_ops->move(other.m_storage, m_storage);
+    if(m_ops) m_ops->move(tmp, other.m_storage);
+    std::swap(m_ops, other.m_ops);
+    return *this;
+}
+
+template<typename T>
+inline bool any::is() const
+{
+    if(any_tag<T>::value != OTHER)
+        return m_ops && m_ops->tag == any_tag<T>::value;
+    return m_ops && m_ops->type() == typeid(T);
+}
+
+template<typename T>
+inline T* any_cast(any* value)
+{
+    return value && value->is<T>() ? value->ptr<T>() : 0;
+}
+
+template<typename T>
+inline const T* any_cast(const any* value)
+{
+    return value && value->is<T>() ? value->ptr<T>() : 0;
+}
+
+template<typename T>
+inline T* unsafe_any_cast(any* value) { return value->ptr<T>(); }
+
+template<typename T>
+inline const T* unsafe_any_cast(const any* value) { return value->ptr<T>(); }
+
+} // namespace texpp
+
+#endif
@@ -123,8 +123,8 @@ void initSymbols(Parser& parser)
     __TEXPP_SET_COMMAND("relax", Relax);
     parser.setSymbol("relax", parser.symbolAny("\\relax"));
 
-    __TEXPP_SET_COMMAND("uppercase", Changecase, "uccode");
-    __TEXPP_SET_COMMAND("lowercase", Changecase, "lccode");
+    __TEXPP_SET_COMMAND("uppercase", Changecase, Parser::REGISTER_UCCODE);
+    __TEXPP_SET_COMMAND("lowercase", Changecase, Parser::REGISTER_LCCODE);
 
     __TEXPP_SET_COMMAND("let", Let);
     __TEXPP_SET_COMMAND("futurelet", Futurelet);
@@ -169,8 +169,11 @@ void initSymbols(Parser& parser)
     __TEXPP_SET_COMMAND("vbox", BoxSpec, Parser::RVERTICAL, false);
     __TEXPP_SET_COMMAND("vtop", BoxSpec, Parser::RVERTICAL, true);
 
-    __TEXPP_SET_COMMAND("box", Register<BoxVariable>, Box());
-    __TEXPP_SET_COMMAND("copy", Register<BoxVariable>, Box());
+    __TEXPP_SET_COMMAND("box", Register<BoxVariable>, Box(),
+                                            Parser::REGISTER_BOX);
+    __TEXPP_SET_COMMAND("copy", Register<BoxVariable>, Box(),
+                                            Parser::REGISTER_BOX);
+    parser.setRegisterDefault(Parser::REGISTER_BOX, Box());
     __TEXPP_SET_COMMAND("vsplit", Vsplit);
     __TEXPP_SET_COMMAND("lastbox", Lastbox);
 
@@ -192,31 +195,37 @@ void initSymbols(Parser& parser)
 
     __TEXPP_SET_COMMAND("fontdimen", FontDimen);
 
-    __TEXPP_SET_COMMAND("catcode", CharcodeVariable, int(0), 0, 15);
-    __TEXPP_SET_COMMAND("lccode", CharcodeVariable, int(0), 0, 255);
-    __TEXPP_SET_COMMAND("uccode", CharcodeVariable, int(0), 0, 255);
-    __TEXPP_SET_COMMAND("sfcode", CharcodeVariable, int(0), 0, 32767);
-    __TEXPP_SET_COMMAND("mathcode", CharcodeVariable, int(0), 0, 32768);
-    __TEXPP_SET_COMMAND("delcode", CharcodeVariable, int(0),
+    #define __TEXPP_SET_CHARCODE(name, type, min, max) \
+        __TEXPP_SET_COMMAND(name, CharcodeVariable, int(0), \
+                                Parser::type, min, max); \
+        parser.setRegisterDefault(Parser::type, int(0))
+
+    __TEXPP_SET_CHARCODE("catcode", REGISTER_CATCODE, 0, 15);
+    __TEXPP_SET_CHARCODE("lccode", REGISTER_LCCODE, 0, 255);
+    __TEXPP_SET_CHARCODE("uccode", REGISTER_UCCODE, 0, 255);
+    __TEXPP_SET_CHARCODE("sfcode", REGISTER_SFCODE, 0, 32767);
+    __TEXPP_SET_CHARCODE("mathcode", REGISTER_MATHCODE, 0, 32768);
+    __TEXPP_SET_CHARCODE("delcode", REGISTER_DELCODE,
                                         TEXPP_INT_MIN, 16777215);
 
-    #define __TEXPP_SET_REGISTER(name, T, v) \
-        __TEXPP_SET_COMMAND(name, Register<T>, v); \
+    #define __TEXPP_SET_REGISTER(name, T, v, type) \
+        __TEXPP_SET_COMMAND(name, Register<T>, v, Parser::type); \
+        parser.setRegisterDefault(Parser::type, v); \
         parser.setSymbol("\\" name "def", \
             Command::ptr(new RegisterDef<Register<T> >("\\" name "def", \
                 static_pointer_cast<Register<T> >( \
                     parser.symbol("\\" name, Command::ptr())))))
 
-    __TEXPP_SET_REGISTER("count", IntegerVariable, int(0));
+    __TEXPP_SET_REGISTER("count", IntegerVariable, int(0), REGISTER_COUNT);
 
-    __TEXPP_SET_REGISTER("dimen", DimenVariable, Dimen(0));
-    __TEXPP_SET_REGISTER("ht", BoxDimen, Dimen(0));
-    __TEXPP_SET_REGISTER("wd", BoxDimen, Dimen(0));
-    __TEXPP_SET_REGISTER("dp", BoxDimen, Dimen(0));
+    __TEXPP_SET_REGISTER("dimen", DimenVariable, Dimen(0), REGISTER_DIMEN);
+    __TEXPP_SET_REGISTER("ht", BoxDimen, Dimen(0), REGISTER_HT);
+    __TEXPP_SET_REGISTER("wd", BoxDimen, Dimen(0), REGISTER_WD);
+    __TEXPP_SET_REGISTER("dp", BoxDimen, Dimen(0), REGISTER_DP);
 
-    __TEXPP_SET_REGISTER("skip", GlueVariable, Glue(0,0));
-    __TEXPP_SET_REGISTER("muskip", MuGlueVariable, Glue(1,0));
-    __TEXPP_SET_REGISTER("toks", ToksVariable, Token::list());
+    __TEXPP_SET_REGISTER("skip", GlueVariable, Glue(0,0), REGISTER_SKIP);
+    __TEXPP_SET_REGISTER("muskip", MuGlueVariable, Glue(1,0), REGISTER_MUSKIP);
+    __TEXPP_SET_REGISTER("toks", ToksVariable, Token::list(), REGISTER_TOKS);
 
     #define __TEXPP_SET_CHAR(name, T) \
         __TEXPP_SET_COMMAND(name, T); \
@@ -539,14 +548,17 @@ void initSymbols(Parser& parser)
     parser.setSymbol("mag", int(1000));
     parser.setSymbol("maxdeadcycles", int(25));
 
+    parser.setSymbol("hangafter", int(1));
+}
+
+void initDateTime(Parser& parser)
+{
     std::time_t t; std::time(&t);
     std::tm* time = std::localtime(&t);
     parser.setSymbol("year", int(1900+time->tm_year));
     parser.setSymbol("month", int(1+time->tm_mon));
     parser.setSymbol("day", int(time->tm_mday));
     parser.setSymbol("time", int(time->tm_hour*60 + time->tm_min));
-
-    parser.setSymbol("hangafter", int(1));
 }
 
 } // namespace base
@@ -27,8 +27,12 @@ class Parser;
 
 namespace base {
 
+// Sets the primitive commands and the initial code tables
 void initSymbols(Parser& parser);
 
+// Sets \year, \month, \day and \time to the current time
+void initDateTime(Parser& parser);
+
 } // namespace base
 } // namespace texpp
 
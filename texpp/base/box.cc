@@ -28,8 +28,8 @@ bool BoxVariable::invokeOperation(Parser& parser,
 {
     // TODO: box should not derive from Variable!
     if(op == ASSIGN || op == GET) {
-        string name = parseName(parser, node);
-        Box box = parser.symbol(name, Box());
+        unsigned id = parseName(parser, node);
+        Box box = parser.symbol(id, Box());
         node->setValue(box);
         return true;
     }
@@ -50,25 +50,24 @@ bool Lastbox::invokeOperation(Parser& parser,
     return BoxVariable::invokeOperation(parser, node, op, global);
 }
 
-string Vsplit::parseName(Parser& parser, shared_ptr<Node> node)
+unsigned Vsplit::parseName(Parser& parser, shared_ptr<Node> node)
 {
-    string s = Register<BoxVariable>::parseName(parser, node);
+    unsigned id = Register<BoxVariable>::parseName(parser, node);
     static vector<string> kw_to(1, "to");
     Node::ptr to = parser.parseKeyword(kw_to);
     if(!to) {
         parser.logger()->log(Logger::ERROR,
             "Missing `to' inserted",
             parser, parser.lastToken());
-        to = Node::ptr(new Node("error_missing_to"));
+        to = Node::create("error_missing_to");
         to->setValue(string("to"));
     }
     node->appendChild("to", to);
     node->appendChild("dimen", parser.parseDimen());
-    //parser.setSymbolDefault(s, m_initValue);
-    return s;
+    return id;
 }
 
-string Setbox::parseName(Parser& parser, shared_ptr<Node> node)
+unsigned Setbox::parseName(Parser& parser, shared_ptr<Node> node)
 {
     shared_ptr<Node> number = parser.parseNumber();
     node->appendChild("variable_number", number);
@@ -81,17 +80,14 @@ string Setbox::parseName(Parser& parser, shared_ptr<Node> node)
         n = 0;
     }
 
-    string s = this->name().substr(1) + boost::lexical_cast<string>(n);
-    if(s.substr(0, 6) == "setbox")
-        parser.setSymbolDefault(s.substr(3), m_initValue);
-    return s;
+    return Parser::registerId(Parser::REGISTER_BOX, n);
 }
 
 bool Setbox::invokeOperation(Parser& parser,
                 shared_ptr<Node> node, Operation op, bool global)
 {
     if(op == ASSIGN) {
-        string name = parseName(parser, node);
+        unsigned id = parseName(parser, node);
 
         node->appendChild("equals", parser.parseOptionalEquals());
         node->appendChild("filler", parser.parseFiller(true));
@@ -102,16 +98,14 @@ bool Setbox::invokeOperation(Parser& parser,
             parser.logger()->log(Logger::ERROR,
                 "A <box> was supposed to be here",
                 parser, parser.lastToken());
-            rvalue = Node::ptr(new Node("error_missing_box"));
+            rvalue = Node::create("error_missing_box");
             rvalue->setValue(Box());
         }
 
         node->appendChild("rvalue", rvalue);
         node->setValue(rvalue->valueAny());
 
-        if(name.substr(0, 6) == "setbox")
-            name = name.substr(3);
-        parser.setSymbol(name, rvalue->valueAny(), global);
+        parser.setSymbol(id, rvalue->valueAny(), global);
         return true;
     }
     return false;
@@ -121,7 +115,7 @@ bool BoxSpec::invokeOperation(Parser& parser,
                 shared_ptr<Node> node, Operation op, bool)
 {
     if(op == ASSIGN || op == GET) {
-        string name = parseName(parser, node);
+        parseName(parser, node);
 
         static vector<string> kw_spec;
         if(kw_spec.empty()) {
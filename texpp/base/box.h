@@ -74,9 +74,9 @@ class Vsplit: public Register<BoxVariable>
 public:
     Vsplit(const string& name,
         const any& initValue = any(Box()))
-        : Register<BoxVariable>(name, initValue) {}
+        : Register<BoxVariable>(name, initValue, Parser::REGISTER_BOX) {}
 
-    string parseName(Parser& parser, shared_ptr<Node> node);
+    unsigned parseName(Parser& parser, shared_ptr<Node> node);
 };
 
 class Setbox: public Variable
@@ -86,7 +86,7 @@ public:
         const any& initValue = any(Box()))
         : Variable(name, initValue) {}
 
-    string parseName(Parser& parser, shared_ptr<Node> node);
+    unsigned parseName(Parser& parser, shared_ptr<Node> node);
     bool invokeOperation(Parser& parser,
                 shared_ptr<Node> node, Operation op, bool global);
 };
@@ -70,7 +70,7 @@ bool Delimiter::invoke(Parser& parser, shared_ptr<Node> node)
     return true;
 }
 
-bool Char::createDef(Parser& parser, shared_ptr<Token> token,
+bool Char::createDef(Parser& parser, Token::ptr token,
                             int num, bool global)
 {
     if(num < 0 || num > 255) {
@@ -86,7 +86,7 @@ bool Char::createDef(Parser& parser, shared_ptr<Token> token,
     return true;
 }
 
-bool MathChar::createDef(Parser& parser, shared_ptr<Token> token,
+bool MathChar::createDef(Parser& parser, Token::ptr token,
                             int num, bool global)
 {
     if(num < 0 || num > 32767) {
@@ -111,7 +111,7 @@ bool CharDef::invokeOperation(Parser&,
         return true;
     } else if(op == EXPAND) {
         node->setValue(boost::lexical_cast<string>(
-            m_initValue.type() == typeid(int) ? 
+            m_initValue.is<int>() ? 
             *unsafe_any_cast<int>(&m_initValue) : 0));
         return true;
     }
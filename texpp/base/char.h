@@ -31,7 +31,7 @@ class Char: public Command
 public:
     explicit Char(const string& name): Command(name) {}
     bool invoke(Parser& parser, shared_ptr<Node> node);
-    bool createDef(Parser& parser, shared_ptr<Token> token,
+    bool createDef(Parser& parser, Token::ptr token,
                         int num, bool global);
 };
 
@@ -40,7 +40,7 @@ class MathChar: public Command
 public:
     explicit MathChar(const string& name): Command(name) {}
     bool invoke(Parser& parser, shared_ptr<Node> node);
-    bool createDef(Parser& parser, shared_ptr<Token> token,
+    bool createDef(Parser& parser, Token::ptr token,
                         int num, bool global);
 };
 
@@ -29,6 +29,16 @@
 namespace texpp {
 namespace base {
 
+namespace {
+Box boxRegister(Parser& parser, Node::ptr number)
+{
+    int n = number->value(int(0));
+    if(n < 0 || n >= Parser::REGISTERS_NUMBER)
+        return Box();
+    return parser.symbol(Parser::registerId(Parser::REGISTER_BOX, n), Box());
+}
+} // namespace
+
 bool Iftrue::evaluate(Parser&, shared_ptr<Node> node)
 {
     node->setValue(true);
@@ -47,7 +57,7 @@ bool Ifnum::evaluate(Parser& parser, shared_ptr<Node> node)
     node->appendChild("number1", number1);
 
     char relchar;
-    Node::ptr relation(new Node("relation"));
+    Node::ptr relation = Node::create("relation");
     node->appendChild("relation", relation);
 
     Token::ptr token = parser.peekToken();
@@ -85,7 +95,7 @@ bool Ifdim::evaluate(Parser& parser, shared_ptr<Node> node)
     node->appendChild("dimen1", dimen1);
 
     char relchar;
-    Node::ptr relation(new Node("relation"));
+    Node::ptr relation = Node::create("relation");
     node->appendChild("relation", relation);
 
     Token::ptr token = parser.peekToken();
@@ -196,7 +206,7 @@ bool Ifx::evaluate(Parser& parser, shared_ptr<Node> node)
     bool res = false;
     if(token1->isCharacter() && token2->isCharacter()) {
         res = token1->catCode() == token2->catCode() &&
-              token1->value() == token2->value();
+              token1->valueId() == token2->valueId();
 
     } else if(token1->isControl() && token2->isControl()) {
         Command::ptr cmd1 = parser.symbol(token1, Command::ptr());
@@ -227,7 +237,7 @@ bool Ifx::evaluate(Parser& parser, shared_ptr<Node> node)
                     Token::ptr tok2 = um2->params()[i];
                     if(tok1->type() != tok2->type() ||
                             tok1->catCode() != tok2->catCode() ||
-                            tok1->value() != tok2->value())
+                            tok1->valueId() != tok2->valueId())
                         res = false;
                 }
                 for(size_t i=0; res && i<um1->definition().size(); ++i) {
@@ -235,7 +245,7 @@ bool Ifx::evaluate(Parser& parser, shared_ptr<Node> node)
                     Token::ptr tok2 = um2->definition()[i];
                     if(tok1->type() != tok2->type() ||
                             tok1->catCode() != tok2->catCode() ||
-                            tok1->value() != tok2->value())
+                            tok1->valueId() != tok2->valueId())
                         res = false;
                 }
             }
@@ -251,8 +261,7 @@ bool Ifvoid::evaluate(Parser& parser, shared_ptr<Node> node)
     Node::ptr number = parser.parseNumber();
     node->appendChild("number", number);
 
-    string s = "box" + boost::lexical_cast<string>(number->value(int(0)));
-    node->setValue(bool(!parser.symbol(s, Box()).value));
+    node->setValue(bool(!boxRegister(parser, number).value));
     return true;
 }
 
@@ -261,8 +270,7 @@ bool Ifhbox::evaluate(Parser& parser, shared_ptr<Node> node)
     Node::ptr number = parser.parseNumber();
     node->appendChild("number", number);
 
-    string s = "box" + boost::lexical_cast<string>(number->value(int(0)));
-    Box box = parser.symbol(s, Box());
+    Box box = boxRegister(parser, number);
     node->setValue(bool(box.value && box.mode == Parser::RHORIZONTAL));
     return true;
 }
@@ -272,8 +280,7 @@ bool Ifvbox::evaluate(Parser& parser, shared_ptr<Node> node)
     Node::ptr number = parser.parseNumber();
     node->appendChild("number", number);
 
-    string s = "box" + boost::lexical_cast<string>(number->value(int(0)));
-    Box box = parser.symbol(s, Box());
+    Box box = boxRegister(parser, number);
     node->setValue(bool(box.value && box.mode == Parser::RVERTICAL));
     return true;
 }
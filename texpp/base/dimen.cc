@@ -29,18 +29,18 @@ bool InternalDimen::invokeOperation(Parser& parser,
                 shared_ptr<Node> node, Operation op, bool global)
 {
     if(op == ASSIGN) {
-        string name = parseName(parser, node);
+        unsigned id = parseName(parser, node);
 
         node->appendChild("equals", parser.parseOptionalEquals());
         Node::ptr rvalue = parser.parseDimen();
         node->appendChild("rvalue", rvalue);
 
         node->setValue(rvalue->valueAny());
-        parser.setSymbol(name, rvalue->valueAny(), global);
+        parser.setSymbol(id, rvalue->valueAny(), global);
         return true;
     } else if(op == EXPAND) {
-        string name = parseName(parser, node);
-        Dimen val = parser.symbol(name, Dimen(0));
+        unsigned id = parseName(parser, node);
+        Dimen val = parser.symbol(id, Dimen(0));
         node->setValue(dimenToString(val));
         return true;
     } else {
@@ -53,29 +53,29 @@ bool DimenVariable::invokeOperation(Parser& parser,
 {
     static vector<string> kw_by(1, "by");
     if(op == ADVANCE) {
-        string name = parseName(parser, node);
+        unsigned id = parseName(parser, node);
         
         node->appendChild("by", parser.parseOptionalKeyword(kw_by));
 
         Node::ptr rvalue = parser.parseDimen();
         node->appendChild("rvalue", rvalue);
 
-        Dimen v = parser.symbol(name, Dimen(0));
+        Dimen v = parser.symbol(id, Dimen(0));
         v.value += rvalue->value(Dimen(0)).value;
 
         node->setValue(v);
-        parser.setSymbol(name, v, global);
+        parser.setSymbol(id, v, global);
         return true;
 
     } else if(op == MULTIPLY || op == DIVIDE) {
-        string name = parseName(parser, node);
+        unsigned id = parseName(parser, node);
 
         node->appendChild("by", parser.parseOptionalKeyword(kw_by));
 
         Node::ptr rvalue = parser.parseNumber();
         node->appendChild("rvalue", rvalue);
 
-        Dimen v = parser.symbol(name, Dimen(0));
+        Dimen v = parser.symbol(id, Dimen(0));
         int rv = rvalue->value(int(0));
         bool overflow = false;
 
@@ -93,7 +93,7 @@ bool DimenVariable::invokeOperation(Parser& parser,
                 parser, parser.lastToken());
         } else {
             node->setValue(v);
-            parser.setSymbol(name, v, global);
+            parser.setSymbol(id, v, global);
         }
         return true;
     }
@@ -143,23 +143,23 @@ bool SpecialDimen::invokeOperation(Parser& parser,
                 shared_ptr<Node> node, Operation op, bool global)
 {
     if(op == ASSIGN) {
-        string name = parseName(parser, node);
+        unsigned id = parseName(parser, node);
 
         node->appendChild("equals", parser.parseOptionalEquals());
         Node::ptr rvalue = parser.parseDimen();
         node->appendChild("rvalue", rvalue);
 
         node->setValue(rvalue->valueAny());
-        parser.setSymbol(name, rvalue->valueAny(), true); // global
+        parser.setSymbol(id, rvalue->valueAny(), true); // global
         return true;
     } else if(op == GET) {
-        string name = parseName(parser, node);
-        const any& ret = parser.symbolAny(name);
+        unsigned id = parseName(parser, node);
+        const any& ret = parser.symbolAny(id);
         node->setValue(ret.empty() ? m_initValue : ret);
         return true;
     } else if(op == EXPAND) {
-        string name = parseName(parser, node);
-        Dimen val = parser.symbol(name, Dimen(0));
+        unsigned id = parseName(parser, node);
+        Dimen val = parser.symbol(id, Dimen(0));
         node->setValue(dimenToString(val));
         return true;
     } else {
@@ -167,29 +167,11 @@ bool SpecialDimen::invokeOperation(Parser& parser,
     }
 }
 
-string BoxDimen::parseName(Parser& parser, shared_ptr<Node> node)
-{
-    Node::ptr number = parser.parseNumber();
-    node->appendChild("variable_number", number);
-    int n = number->value(int(0));
-
-    if(n < 0 || n > 255) {
-        parser.logger()->log(Logger::ERROR,
-            "Bad register code (" + boost::lexical_cast<string>(n) + ")",
-            parser, parser.lastToken());
-        n = 0;
-    }
-
-    string s = name().substr(1) + boost::lexical_cast<string>(n);
-    parser.setSymbolDefault(s, m_initValue);
-    return s;
-}
-
 bool BoxDimen::invokeOperation(Parser& parser,
                 shared_ptr<Node> node, Operation op, bool global)
 {
     if(op == ASSIGN) {
-        string name = parseName(parser, node);
+        parseName(parser, node);
 
         node->appendChild("equals", parser.parseOptionalEquals());
         Node::ptr rvalue = parser.parseDimen();
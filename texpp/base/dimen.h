@@ -78,7 +78,6 @@ public:
         const any& initValue = any())
         : InternalDimen(name, initValue) {}
 
-    string parseName(Parser& parser, shared_ptr<Node> node);
     bool invokeOperation(Parser& parser,
                 shared_ptr<Node> node, Operation op, bool global);
 };
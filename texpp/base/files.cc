@@ -53,9 +53,9 @@ bool Openin::invoke(Parser& parser, shared_ptr<Node> node)
     //std::cout << "name: '" << fnameNode->value(string()) << "'\n";
     //std::cout << "fullname: '" << fullname << "'\n";
 
-    shared_ptr<std::istream> istream(new std::ifstream(fullname.c_str()));
-    if(!istream->fail()) {
-        shared_ptr<Lexer> lexer(new Lexer(fullname, istream));
+    InputSource::ptr source = InputSource::open(fullname);
+    if(source) {
+        shared_ptr<Lexer> lexer(new Lexer(fullname, source));
         parser.setSymbol("read" + boost::lexical_cast<string>(stream),
                                     InFile(lexer), true);
     } else {
@@ -101,12 +101,12 @@ bool Read::invokeWithPrefixes(Parser& parser, shared_ptr<Node> node,
         parser.logger()->log(Logger::ERROR,
                 "Missing `to' inserted",
                 parser, parser.lastToken());
-        to = Node::ptr(new Node("keyword"));
+        to = Node::create("keyword");
     }
 
     node->appendChild("to", to);
 
-    Node::ptr spaces(new Node("optional_spaces"));
+    Node::ptr spaces = Node::create("optional_spaces");
     while(parser.peekToken(false) &&
             parser.peekToken(false)->isCharacterCat(Token::CC_SPACE)) {
         parser.nextToken(&spaces->tokens(), false);
@@ -150,10 +150,7 @@ bool Read::invokeWithPrefixes(Parser& parser, shared_ptr<Node> node,
     }
 
     // prepare the lexer
-    lexer->setEndlinechar(parser.lexer()->endlinechar());
-    for(int n=0; n<256; ++n) {
-        lexer->setCatcode(n, parser.lexer()->catcode(n));
-    }
+    lexer->copyCodes(*parser.lexer());
 
     // read the tokens
     Token::list_ptr tokens(new Token::list());
@@ -357,7 +354,7 @@ bool Write::invokeWithPrefixes(Parser& parser,
     node->appendChild("number", number);
     int stream = number->value(int(0));
 
-    if(parser.symbol("tracingmacros", int(0)) >= 2) {
+    if(parser.tracingmacros() >= 2) {
         // read the tokens without expanding to show them in the trace
         Node::ptr text = parser.parseGeneralText(false);
         Token::list_ptr tokens =
@@ -92,7 +92,9 @@ public:
 class Write: public Command
 {
 public:
-    explicit Write(const string& name): Command(name) {}
+    explicit Write(const string& name): Command(name) {
+        m_flags |= EXPANDS_TEXT;
+    }
     bool invoke(Parser& parser, shared_ptr<Node> node);
     bool invokeWithPrefixes(Parser&, shared_ptr<Node>,
                                 std::set<string>& prefixes);
@@ -101,7 +103,9 @@ public:
 class Message: public Command
 {
 public:
-    explicit Message(const string& name): Command(name) {}
+    explicit Message(const string& name): Command(name) {
+        m_flags |= EXPANDS_TEXT;
+    }
     bool invoke(Parser& parser, shared_ptr<Node> node);
 };
 
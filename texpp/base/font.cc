@@ -65,8 +65,8 @@ bool Font::invokeOperation(Parser& parser,
                 shared_ptr<Node> node, Operation op, bool global)
 {
     if(op == EXPAND) {
-        string name = parseName(parser, node);
-        FontInfo::ptr fontInfo = parser.symbol(name, defaultFontInfo);
+        unsigned id = parseName(parser, node);
+        FontInfo::ptr fontInfo = parser.symbol(id, defaultFontInfo);
 
         string str = fontInfo->selector;
         string escape = parser.escapestr();
@@ -79,7 +79,7 @@ bool Font::invokeOperation(Parser& parser,
         return true;
 
     } else if(op == ASSIGN) {
-        string name = parseName(parser, node);
+        parseName(parser, node);
 
         Node::ptr lvalue = parser.parseControlSequence(false);
         Token::ptr ltoken = lvalue->value(Token::ptr());
@@ -145,8 +145,8 @@ bool Font::invokeOperation(Parser& parser,
         return true;
 
     } else if(op == GET) {
-        string name = parseName(parser, node);
-        const any& ret = parser.symbolAny(name);
+        unsigned id = parseName(parser, node);
+        const any& ret = parser.symbolAny(id);
         node->setValue(ret.empty() ? m_initValue : ret);
         return true;
     }
@@ -157,8 +157,8 @@ bool FontFamily::invokeOperation(Parser& parser,
                 shared_ptr<Node> node, Operation op, bool global)
 {
     if(op == EXPAND) {
-        string name = parseName(parser, node);
-        FontInfo::ptr fontInfo = parser.symbol(name, defaultFontInfo);
+        unsigned id = parseName(parser, node);
+        FontInfo::ptr fontInfo = parser.symbol(id, defaultFontInfo);
 
         string str = fontInfo->selector;
         string escape = parser.escapestr();
@@ -171,7 +171,7 @@ bool FontFamily::invokeOperation(Parser& parser,
         return true;
 
     } else if(op == ASSIGN) {
-        string name = parseName(parser, node);
+        unsigned id = parseName(parser, node);
 
         node->appendChild("equals", parser.parseOptionalEquals());
 
@@ -181,26 +181,26 @@ bool FontFamily::invokeOperation(Parser& parser,
             parser.logger()->log(Logger::ERROR,
                 "Missing font identifier",
                 parser, parser.lastToken());
-            rvalue = Node::ptr(new Node("error_missing_font"));
+            rvalue = Node::create("error_missing_font");
             rvalue->setValue(defaultFontInfo);
         }
 
         node->appendChild("rvalue", rvalue);
         node->setValue(rvalue->valueAny());
-        parser.setSymbol(name, rvalue->valueAny(), global);
+        parser.setSymbol(id, rvalue->valueAny(), global);
 
         return true;
 
     } else if(op == GET) {
-        string name = parseName(parser, node);
-        const any& ret = parser.symbolAny(name);
+        unsigned id = parseName(parser, node);
+        const any& ret = parser.symbolAny(id);
         node->setValue(ret.empty() ? m_initValue : ret);
         return true;
     }
     return false;
 }
 
-string FontFamily::parseName(Parser& parser, shared_ptr<Node> node)
+unsigned FontFamily::parseName(Parser& parser, shared_ptr<Node> node)
 {
     shared_ptr<Node> number = parser.parseNumber();
     node->appendChild("family_number", number);
@@ -213,12 +213,13 @@ string FontFamily::parseName(Parser& parser, shared_ptr<Node> node)
         n = 0;
     }
 
-    string s = this->name().substr(1) + boost::lexical_cast<string>(n);
-    parser.setSymbolDefault(s, m_initValue);
-    return s;
+    unsigned id = Intern::id(
+            this->name().substr(1) + boost::lexical_cast<string>(n));
+    parser.setSymbolDefault(id, m_initValue);
+    return id;
 }
 
-string FontChar::parseName(Parser& parser, shared_ptr<Node> node)
+unsigned FontChar::parseName(Parser& parser, shared_ptr<Node> node)
 {
     Node::ptr font =
         Variable::tryParseVariableValue<base::FontVariable>(parser);
@@ -226,17 +227,18 @@ string FontChar::parseName(Parser& parser, shared_ptr<Node> node)
         parser.logger()->log(Logger::ERROR,
             "Missing font identifier",
             parser, parser.lastToken());
-        font = Node::ptr(new Node("error_missing_font"));
+        font = Node::create("error_missing_font");
         font->setValue(defaultFontInfo);
     }
     node->appendChild("variable_font", font);
 
-    string s = name().substr(1) + font->value(defaultFontInfo)->selector;
-    parser.setSymbolDefault(s, m_initValue);
-    return s;
+    unsigned id = Intern::id(
+            name().substr(1) + font->value(defaultFontInfo)->selector);
+    parser.setSymbolDefault(id, m_initValue);
+    return id;
 }
 
-string FontDimen::parseName(Parser& parser, shared_ptr<Node> node)
+unsigned FontDimen::parseName(Parser& parser, shared_ptr<Node> node)
 {
     Node::ptr number = parser.parseNumber();
     node->appendChild("variable_number", number);
@@ -248,7 +250,7 @@ string FontDimen::parseName(Parser& parser, shared_ptr<Node> node)
         parser.logger()->log(Logger::ERROR,
             "Missing font identifier",
             parser, parser.lastToken());
-        font = Node::ptr(new Node("error_missing_font"));
+        font = Node::create("error_missing_font");
         font->setValue(defaultFontInfo);
     }
     node->appendChild("variable_font", font);
@@ -269,25 +271,25 @@ string FontDimen::parseName(Parser& parser, shared_ptr<Node> node)
         n = 0;
     }
 
-    string s = name().substr(1) + boost::lexical_cast<string>(n)
-                            + fontInfo->selector;
-    parser.setSymbolDefault(s, m_initValue);
-    return s;
+    unsigned id = Intern::id(name().substr(1) +
+            boost::lexical_cast<string>(n) + fontInfo->selector);
+    parser.setSymbolDefault(id, m_initValue);
+    return id;
 }
 
 bool FontDimen::invokeOperation(Parser& parser,
                 shared_ptr<Node> node, Operation op, bool global)
 {
     if(op == ASSIGN) {
-        string name = parseName(parser, node);
+        unsigned id = parseName(parser, node);
 
         node->appendChild("equals", parser.parseOptionalEquals());
         Node::ptr rvalue = parser.parseDimen();
         node->appendChild("rvalue", rvalue);
 
         node->setValue(rvalue->valueAny());
-        if(name.substr(0, 11) != "fontdimen0\\")
-            parser.setSymbol(name, rvalue->valueAny(), true); // global
+        if(Intern::str(id).substr(0, 11) != "fontdimen0\\")
+            parser.setSymbol(id, rvalue->valueAny(), true); // global
         return true;
     } else {
         return SpecialDimen::invokeOperation(parser, node, op, global);
@@ -302,7 +304,7 @@ bool FontnameMacro::expand(Parser& parser, shared_ptr<Node> node)
         parser.logger()->log(Logger::ERROR,
             "Missing font identifier",
             parser, parser.lastToken());
-        font = Node::ptr(new Node("error_missing_font"));
+        font = Node::create("error_missing_font");
         font->setValue(defaultFontInfo);
     }
     node->appendChild("font", font);
@@ -93,7 +93,7 @@ public:
 
     bool invokeOperation(Parser& parser,
                 shared_ptr<Node> node, Operation op, bool global);
-    string parseName(Parser& parser, shared_ptr<Node> node);
+    unsigned parseName(Parser& parser, shared_ptr<Node> node);
 };
 
 class FontChar: public SpecialInteger
@@ -102,7 +102,7 @@ public:
     FontChar(const string& name, const any& initValue = any(0))
         : SpecialInteger(name, initValue) {}
 
-    string parseName(Parser& parser, shared_ptr<Node> node);
+    unsigned parseName(Parser& parser, shared_ptr<Node> node);
 };
 
 class FontDimen: public SpecialDimen
@@ -113,7 +113,7 @@ public:
 
     bool invokeOperation(Parser& parser,
                 shared_ptr<Node> node, Operation op, bool global);
-    string parseName(Parser& parser, shared_ptr<Node> node);
+    unsigned parseName(Parser& parser, shared_ptr<Node> node);
 };
 
 class FontnameMacro: public Macro
@@ -0,0 +1,709 @@
+/*  This file is part of texpp library.
+    Copyright (C) 2009 Vladimir Kuznetsov <ks.vladimir@gmail.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <texpp/base/format.h>
+
+#include <texpp/base/func.h>
+#include <texpp/base/variable.h>
+#include <texpp/base/integer.h>
+#include <texpp/base/dimen.h>
+#include <texpp/base/glue.h>
+#include <texpp/base/toks.h>
+#include <texpp/base/font.h>
+#include <texpp/base/char.h>
+#include <texpp/base/parshape.h>
+#include <texpp/base/box.h>
+
+#include <texpp/parser.h>
+
+#include <boost/cstdint.hpp>
+#include <boost/foreach.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/weak_ptr.hpp>
+#include <sys/stat.h>
+#include <typeinfo>
+#include <cstring>
+
+namespace texpp {
+namespace base {
+
+namespace {
+
+const char FORMAT_MAGIC[8] = { 'T', 'E', 'X', 'P', 'P', 'F', 'M', 'T' };
+
+// Written in the native byte order, formats are not portable
+const int FORMAT_BYTE_ORDER = 0x01020304;
+
+enum CommandKind { CMD_NONE, CMD_PRIMITIVE, CMD_USER_MACRO, CMD_TOKEN,
+                   CMD_CHARDEF, CMD_FONT_SELECTOR, CMD_REGISTER };
+
+enum { FONT_NONE, FONT_DEFAULT, FONT_CUSTOM };
+
+enum { TOKEN_NONE = 0xff };
+
+// Files are replaced by renaming (see Parser::dumpFormat), so a new
+// version of a file is a new inode. The inode of a cached image can't
+// be reused while the image keeps its file mapped
+bool isSameFile(const struct stat& st1, const struct stat& st2)
+{
+    return st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino &&
+           st1.st_size == st2.st_size &&
+           st1.st_mtim.tv_sec == st2.st_mtim.tv_sec &&
+           st1.st_mtim.tv_nsec == st2.st_mtim.tv_nsec;
+}
+
+} // namespace
+
+////////// FormatWriter
+
+void FormatWriter::writeInt(int value)
+{
+    boost::int32_t v = value;
+    m_value.write(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+void FormatWriter::writeByte(int value)
+{
+    m_value.put(char(value));
+}
+
+void FormatWriter::writeString(const string& value)
+{
+    writeInt(int(value.size()));
+    m_value.write(value.data(), value.size());
+}
+
+void FormatWriter::writeToken(const Token::ptr& token)
+{
+    if(!token) {
+        writeByte(TOKEN_NONE);
+        return;
+    }
+    writeByte(token->type());
+    writeByte(token->catCode());
+    writeString(token->value());
+}
+
+void FormatWriter::writeTokens(const Token::list& tokens)
+{
+    writeInt(int(tokens.size()));
+    BOOST_FOREACH(const Token::ptr& token, tokens)
+        writeToken(token);
+}
+
+template<class Var>
+bool FormatWriter::writeRegister(const Command::ptr& command)
+{
+    if(typeid(*command) != typeid(Register<Var>))
+        return false;
+
+    const Register<Var>& reg = static_cast<const Register<Var>&>(*command);
+    writeByte(CMD_REGISTER);
+    writeString(reg.name());
+    writeInt(reg.type());
+    writeInt(reg.number());
+    return writeValue(reg.initValue());
+}
+
+bool FormatWriter::writeCommand(const Command::ptr& command)
+{
+    if(!command) {
+        writeByte(CMD_NONE);
+        return true;
+    }
+
+    string primitive = Parser::primitiveName(command);
+    if(!primitive.empty()) {
+        writeByte(CMD_PRIMITIVE);
+        writeString(primitive);
+        return true;
+    }
+
+    const std::type_info& type = typeid(*command);
+    if(type == typeid(UserMacro)) {
+        const UserMacro& macro = static_cast<const UserMacro&>(*command);
+        writeByte(CMD_USER_MACRO);
+        writeString(macro.name());
+        writeTokens(macro.params());
+        writeTokens(macro.definition());
+        writeByte(macro.outerAttr());
+        writeByte(macro.longAttr());
+        return true;
+
+    } else if(type == typeid(TokenCommand)) {
+        writeByte(CMD_TOKEN);
+        writeString(command->name());
+        writeToken(static_cast<const TokenCommand&>(*command).token());
+        return true;
+
+    } else if(type == typeid(CharDef)) {
+        const CharDef& chardef = static_cast<const CharDef&>(*command);
+        writeByte(CMD_CHARDEF);
+        writeString(chardef.name());
+        return writeValue(chardef.initValue());
+
+    } else if(type == typeid(FontSelector)) {
+        const FontSelector& font = static_cast<const FontSelector&>(*command);
+        writeByte(CMD_FONT_SELECTOR);
+        writeString(font.name());
+        return writeValue(font.initValue());
+    }
+
+    return writeRegister<IntegerVariable>(command) ||
+           writeRegister<DimenVariable>(command) ||
+           writeRegister<BoxDimen>(command) ||
+           writeRegister<GlueVariable>(command) ||
+           writeRegister<MuGlueVariable>(command) ||
+           writeRegister<ToksVariable>(command);
+}
+
+bool FormatWriter::writeValue(const any& value)
+{
+    writeByte(value.tag());
+    switch(value.tag()) {
+        case any::EMPTY:
+            return true;
+
+        case any::INT:
+            writeInt(*unsafe_any_cast<int>(&value));
+            return true;
+
+        case any::BOOL:
+            writeByte(*unsafe_any_cast<bool>(&value));
+            return true;
+
+        case any::STRING:
+            writeString(*unsafe_any_cast<string>(&value));
+            return true;
+
+        case any::DIMEN:
+            writeInt(unsafe_any_cast<Dimen>(&value)->value);
+            return true;
+
+        case any::GLUE: {
+            const Glue& glue = *unsafe_any_cast<Glue>(&value);
+            writeByte(glue.mu);
+            writeInt(glue.width.value);
+            writeInt(glue.stretch.value);
+            writeInt(glue.stretchOrder);
+            writeInt(glue.shrink.value);
+            writeInt(glue.shrinkOrder);
+            return true;
+        }
+
+        case any::TOKEN:
+            writeToken(*unsafe_any_cast<Token::ptr>(&value));
+            return true;
+
+        case any::TOKEN_LIST:
+            writeTokens(*unsafe_any_cast<Token::list>(&value));
+            return true;
+
+        case any::COMMAND:
+            return writeCommand(*unsafe_any_cast<Command::ptr>(&value));
+
+        case any::FONT_INFO: {
+            const FontInfo::ptr& font = *unsafe_any_cast<FontInfo::ptr>(&value);
+            if(!font) {
+                writeByte(FONT_NONE);
+            } else if(font == defaultFontInfo) {
+                writeByte(FONT_DEFAULT);
+            } else {
+                writeByte(FONT_CUSTOM);
+                writeString(font->selector);
+                writeString(font->file);
+                writeInt(font->at.value);
+            }
+            return true;
+        }
+
+        case any::BOX: {
+            const Box& box = *unsafe_any_cast<Box>(&value);
+            writeInt(box.mode);
+            writeByte(box.top);
+            writeInt(box.width.value);
+            writeInt(box.height.value);
+            writeInt(box.skip.value);
+            writeByte(bool(box.value));
+            if(box.value) writeTokens(*box.value);
+            return true;
+        }
+
+        case any::PARSHAPE: {
+            const ParshapeInfo& info = *unsafe_any_cast<ParshapeInfo>(&value);
+            writeInt(int(info.parshape.size()));
+            for(size_t i = 0; i < info.parshape.size(); ++i) {
+                writeInt(info.parshape[i].first);
+                writeInt(info.parshape[i].second);
+            }
+            return true;
+        }
+
+        default:
+            return false;
+    }
+}
+
+bool FormatWriter::addSymbol(const string& name, const any& value)
+{
+    m_value.str(string());
+    if(!writeValue(value))
+        return false;
+    string data = m_value.str();
+
+    m_value.str(string());
+    writeString(name);
+    writeInt(int(data.size()));
+    m_symbols << m_value.str() << data;
+    ++m_count;
+    return true;
+}
+
+bool FormatWriter::write(int interaction)
+{
+    m_value.str(string());
+    m_value.write(FORMAT_MAGIC, sizeof(FORMAT_MAGIC));
+    writeInt(FORMAT_VERSION);
+    writeInt(FORMAT_BYTE_ORDER);
+    writeInt(interaction);
+    writeInt(int(m_count));
+
+    m_out << m_value.str() << m_symbols.str();
+    return m_out.good();
+}
+
+////////// FormatReader
+
+int FormatReader::readInt()
+{
+    boost::int32_t v = 0;
+    if(m_end - m_pos < std::ptrdiff_t(sizeof(v))) {
+        m_error = true;
+        return 0;
+    }
+    std::memcpy(&v, m_pos, sizeof(v));
+    m_pos += sizeof(v);
+    return v;
+}
+
+int FormatReader::readByte()
+{
+    if(m_pos >= m_end) {
+        m_error = true;
+        return 0;
+    }
+    return (unsigned char) *m_pos++;
+}
+
+string FormatReader::readString()
+{
+    int size = readInt();
+    if(size < 0 || m_end - m_pos < size) {
+        m_error = true;
+        return string();
+    }
+    string value(m_pos, size);
+    m_pos += size;
+    return value;
+}
+
+Token::ptr FormatReader::readToken()
+{
+    int type = readByte();
+    if(type == TOKEN_NONE)
+        return Token::ptr();
+
+    int catCode = readByte();
+    string value = readString();
+    if(type > Token::TOK_CONTROL || catCode > Token::CC_NONE) {
+        m_error = true;
+        return Token::ptr();
+    }
+
+    return Token::create(Token::Type(type), Token::CatCode(catCode), value);
+}
+
+void FormatReader::readTokens(Token::list& tokens)
+{
+    int size = readInt();
+    if(size < 0 || m_end - m_pos < size) {
+        m_error = true;
+        return;
+    }
+    tokens.reserve(size);
+    for(int i = 0; i < size && !m_error; ++i)
+        tokens.push_back(readToken());
+}
+
+Command::ptr FormatReader::readCommand()
+{
+    int kind = readByte();
+    if(kind == CMD_NONE)
+        return Command::ptr();
+
+    string name = readString();
+    switch(kind) {
+        case CMD_PRIMITIVE: {
+            Command::ptr primitive = Parser::primitive(name);
+            if(!primitive) m_error = true;
+            return primitive;
+        }
+
+        case CMD_USER_MACRO: {
+            Token::list_ptr params(new Token::list);
+            Token::list_ptr definition(new Token::list);
+            readTokens(*params);
+            readTokens(*definition);
+            bool outerAttr = readByte();
+            bool longAttr = readByte();
+            if(m_error) return Command::ptr();
+            return Command::ptr(new UserMacro(name, params, definition,
+                                              outerAttr, longAttr));
+        }
+
+        case CMD_TOKEN:
+            return Command::ptr(new TokenCommand(readToken()));
+
+        case CMD_CHARDEF:
+            return Command::ptr(new CharDef(name, readValue()));
+
+        case CMD_FONT_SELECTOR:
+            return Command::ptr(new FontSelector(name, readValue()));
+
+        case CMD_REGISTER: {
+            Parser::RegisterType type = Parser::RegisterType(readInt());
+            int number = readInt();
+            any initValue = readValue();
+            switch(type) {
+                case Parser::REGISTER_COUNT:
+                    return Command::ptr(new Register<IntegerVariable>(
+                                        name, initValue, type, number));
+                case Parser::REGISTER_DIMEN:
+                    return Command::ptr(new Register<DimenVariable>(
+                                        name, initValue, type, number));
+                case Parser::REGISTER_WD:
+                case Parser::REGISTER_HT:
+                case Parser::REGISTER_DP:
+                    return Command::ptr(new Register<BoxDimen>(
+                                        name, initValue, type, number));
+                case Parser::REGISTER_SKIP:
+                    return Command::ptr(new Register<GlueVariable>(
+                                        name, initValue, type, number));
+                case Parser::REGISTER_MUSKIP:
+                    return Command::ptr(new Register<MuGlueVariable>(
+                                        name, initValue, type, number));
+                case Parser::REGISTER_TOKS:
+                    return Command::ptr(new Register<ToksVariable>(
+                                        name, initValue, type, number));
+                default:
+                    m_error = true;
+                    return Command::ptr();
+            }
+        }
+
+        default:
+            m_error = true;
+            return Command::ptr();
+    }
+}
+
+any FormatReader::readValue()
+{
+    int tag = readByte();
+    switch(tag) {
+        case any::EMPTY:
+            return any();
+
+        case any::INT:
+            return any(readInt());
+
+        case any::BOOL:
+            return any(bool(readByte()));
+
+        case any::STRING:
+            return any(readString());
+
+        case any::DIMEN:
+            return any(Dimen(readInt()));
+
+        case any::GLUE: {
+            Glue glue;
+            glue.mu = readByte();
+            glue.width.value = readInt();
+            glue.stretch.value = readInt();
+            glue.stretchOrder = readInt();
+            glue.shrink.value = readInt();
+            glue.shrinkOrder = readInt();
+            return any(glue);
+        }
+
+        case any::TOKEN:
+            return any(readToken());
+
+        case any::TOKEN_LIST: {
+            Token::list tokens;
+            readTokens(tokens);
+            return any(tokens);
+        }
+
+        case any::COMMAND:
+            return any(readCommand());
+
+        case any::FONT_INFO:
+            switch(readByte()) {
+                case FONT_NONE:
+                    return any(FontInfo::ptr());
+                case FONT_DEFAULT:
+                    return any(defaultFontInfo);
+                case FONT_CUSTOM: {
+                    FontInfo::ptr font(new FontInfo);
+                    font->selector = readString();
+                    font->file = readString();
+                    font->at.value = readInt();
+                    return any(font);
+                }
+                default:
+                    m_error = true;
+                    return any();
+            }
+
+        case any::BOX: {
+            Box box;
+            box.mode = Parser::Mode(readInt());
+            box.top = readByte();
+            box.width.value = readInt();
+            box.height.value = readInt();
+            box.skip.value = readInt();
+            if(readByte()) {
+                box.value = Token::list_ptr(new Token::list);
+                readTokens(*box.value);
+            }
+            return any(box);
+        }
+
+        case any::PARSHAPE: {
+            ParshapeInfo info;
+            int size = readInt();
+            if(size < 0 || m_end - m_pos < size) {
+                m_error = true;
+                return any();
+            }
+            for(int i = 0; i < size; ++i) {
+                int first = readInt();
+                info.parshape.push_back(std::make_pair(first, readInt()));
+            }
+            return any(info);
+        }
+
+        default:
+            m_error = true;
+            return any();
+    }
+}
+
+bool FormatReader::readHeader(int& interaction, size_t& count)
+{
+    if(m_end - m_pos < std::ptrdiff_t(sizeof(FORMAT_MAGIC)) ||
+            std::memcmp(m_pos, FORMAT_MAGIC, sizeof(FORMAT_MAGIC)) != 0)
+        return false;
+    m_pos += sizeof(FORMAT_MAGIC);
+
+    if(readInt() != FORMAT_VERSION || readInt() != FORMAT_BYTE_ORDER)
+        return false;
+
+    interaction = readInt();
+    int n = readInt();
+    if(n < 0) return false;
+    count = n;
+    return !m_error;
+}
+
+bool FormatReader::readRecord(string& name,
+                              const char*& value, size_t& size)
+{
+    name = readString();
+    int n = readInt();
+    if(m_error || n < 0 || m_end - m_pos < n)
+        return false;
+
+    value = m_pos;
+    size = n;
+    m_pos += n;
+    return true;
+}
+
+bool FormatReader::readValue(any& value)
+{
+    value = readValue();
+    return !m_error && m_pos == m_end;
+}
+
+////////// FormatImage
+
+FormatImage::ptr FormatImage::create(const string& data)
+{
+    FormatImage::ptr image(new FormatImage);
+    image->m_data = data;
+    if(!image->index(image->m_data.data(), image->m_data.size()))
+        return FormatImage::ptr();
+    return image;
+}
+
+FormatImage::ptr FormatImage::open(const string& fileName)
+{
+    using namespace boost::interprocess;
+
+    // Opened images are reused while they are in use and the file
+    // is not replaced; entries of released images are dropped. The
+    // last opened image is kept for parsers created one by one
+    typedef std::pair<weak_ptr<FormatImage>, struct stat> Cached;
+    typedef unordered_map<string, Cached> Cache;
+    static Cache cache;
+    static FormatImage::ptr lastImage;
+
+    for(Cache::iterator it = cache.begin(); it != cache.end(); ) {
+        if(it->second.first.expired()) it = cache.erase(it);
+        else ++it;
+    }
+
+    struct stat st;
+    if(::stat(fileName.c_str(), &st) != 0) {
+        cache.erase(fileName);
+        return FormatImage::ptr();
+    }
+
+    Cache::iterator it = cache.find(fileName);
+    if(it != cache.end() && isSameFile(it->second.second, st)) {
+        FormatImage::ptr image = it->second.first.lock();
+        if(image) return lastImage = image;
+    }
+
+    FormatImage::ptr image(new FormatImage);
+    try {
+        file_mapping file(fileName.c_str(), read_only);
+
+        // The file may have been replaced since it was checked
+        if(::fstat(file.get_mapping_handle().handle, &st) != 0)
+            image.reset();
+
+        if(image) {
+            shared_ptr<mapped_region> region(
+                        new mapped_region(file, read_only));
+            image->m_region = region;
+            if(!image->index(static_cast<const char*>(
+                            region->get_address()), region->get_size()))
+                image.reset();
+        }
+    } catch(const interprocess_exception&) {
+        image.reset();
+    }
+
+    if(image) cache[fileName] = Cached(weak_ptr<FormatImage>(image), st);
+    else cache.erase(fileName);
+    lastImage = image;
+    return image;
+}
+
+bool FormatImage::index(const char* data, size_t size)
+{
+    m_names = InternOverlay::create();
+    InternScope scope(m_names.get());
+
+    FormatReader reader(data, size);
+    size_t count = 0;
+    if(!reader.readHeader(m_interaction, count))
+        return false;
+
+    m_symbols.resize(count);
+    for(size_t n = 0; n < count; ++n) {
+        string name;
+        Symbol& symbol = m_symbols[n];
+        if(!reader.readRecord(name, symbol.data, symbol.size) ||
+                symbol.size == 0)
+            return false;
+        symbol.id = Parser::symbolId(name);
+
+        // Damaged values make the whole format unusable
+        FormatReader valueReader(symbol.data, symbol.size);
+        if(!valueReader.readValue(symbol.value))
+            return false;
+    }
+    return true;
+}
+
+bool FormatImage::isScalar(size_t n) const
+{
+    switch(*m_symbols[n].data) {
+        case any::EMPTY: case any::INT: case any::BOOL:
+        case any::DIMEN: case any::GLUE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool isSameValue(const any& value1, const any& value2)
+{
+    if(value1.tag() != value2.tag())
+        return false;
+
+    switch(value1.tag()) {
+        case any::EMPTY:
+            return true;
+        case any::INT:
+            return *unsafe_any_cast<int>(&value1) ==
+                   *unsafe_any_cast<int>(&value2);
+        case any::BOOL:
+            return *unsafe_any_cast<bool>(&value1) ==
+                   *unsafe_any_cast<bool>(&value2);
+        case any::STRING:
+            return *unsafe_any_cast<string>(&value1) ==
+                   *unsafe_any_cast<string>(&value2);
+        case any::DIMEN:
+            return unsafe_any_cast<Dimen>(&value1)->value ==
+                   unsafe_any_cast<Dimen>(&value2)->value;
+        case any::GLUE: {
+            const Glue& g1 = *unsafe_any_cast<Glue>(&value1);
+            const Glue& g2 = *unsafe_any_cast<Glue>(&value2);
+            return g1.mu == g2.mu && g1.width.value == g2.width.value &&
+                   g1.stretch.value == g2.stretch.value &&
+                   g1.stretchOrder == g2.stretchOrder &&
+                   g1.shrink.value == g2.shrink.value &&
+                   g1.shrinkOrder == g2.shrinkOrder;
+        }
+        case any::TOKEN_LIST:
+            return unsafe_any_cast<Token::list>(&value1)->empty() &&
+                   unsafe_any_cast<Token::list>(&value2)->empty();
+        case any::COMMAND:
+            return *unsafe_any_cast<Command::ptr>(&value1) ==
+                   *unsafe_any_cast<Command::ptr>(&value2);
+        case any::FONT_INFO:
+            return *unsafe_any_cast<FontInfo::ptr>(&value1) ==
+                   *unsafe_any_cast<FontInfo::ptr>(&value2);
+        case any::PARSHAPE:
+            return unsafe_any_cast<ParshapeInfo>(&value1)->parshape ==
+                   unsafe_any_cast<ParshapeInfo>(&value2)->parshape;
+        default:
+            return false;
+    }
+}
+
+} // namespace base
+} // namespace texpp
+
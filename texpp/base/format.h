@@ -0,0 +1,147 @@
+/*  This file is part of texpp library.
+    Copyright (C) 2009 Vladimir Kuznetsov <ks.vladimir@gmail.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef __TEXPP_BASE_FORMAT_H
+#define __TEXPP_BASE_FORMAT_H
+
+#include <texpp/common.h>
+#include <texpp/token.h>
+#include <texpp/command.h>
+
+#include <iostream>
+#include <sstream>
+
+namespace texpp {
+namespace base {
+
+// Binary encoding of format files (see Parser::dumpFormat). A format
+// file is a header followed by symbol records, each record is a symbol
+// name and the size and the encoding of its value. Primitive commands
+// are stored by name, defined commands are stored by their contents
+enum { FORMAT_VERSION = 1 };
+
+class FormatWriter
+{
+public:
+    explicit FormatWriter(std::ostream& out): m_out(out), m_count(0) {}
+
+    // Returns false if the value can not be stored
+    bool addSymbol(const string& name, const any& value);
+    bool write(int interaction);
+
+protected:
+    void writeInt(int value);
+    void writeByte(int value);
+    void writeString(const string& value);
+    void writeToken(const Token::ptr& token);
+    void writeTokens(const Token::list& tokens);
+    bool writeValue(const any& value);
+    bool writeCommand(const Command::ptr& command);
+
+    template<class Var> bool writeRegister(const Command::ptr& command);
+
+    std::ostream&       m_out;
+    std::ostringstream  m_symbols;
+    std::ostringstream  m_value;
+    size_t              m_count;
+};
+
+class FormatReader
+{
+public:
+    FormatReader(const char* data, size_t size)
+        : m_pos(data), m_end(data + size), m_error(false) {}
+
+    bool readHeader(int& interaction, size_t& count);
+
+    // Reads the name of the next symbol and skips its value
+    bool readRecord(string& name, const char*& value, size_t& size);
+
+    // Decodes a value, the reader should span exactly one value
+    bool readValue(any& value);
+
+protected:
+    int readInt();
+    int readByte();
+    string readString();
+    Token::ptr readToken();
+    void readTokens(Token::list& tokens);
+    any readValue();
+    Command::ptr readCommand();
+
+    const char* m_pos;
+    const char* m_end;
+    bool        m_error;
+};
+
+// A format file loaded into memory. Files are mapped read-only, and an
+// opened image is reused by all parsers of the process while any of
+// them holds it. All values are decoded when the image is loaded, so
+// damaged formats are rejected at once; the decoded values are shared
+// by the parsers of one process only, other processes share the pages
+// of the file but decode their own copy (parsers keep their own
+// definitions in their symbol tables)
+class FormatImage
+{
+public:
+    typedef shared_ptr<FormatImage> ptr;
+
+    // Returns an empty pointer if the file can not be read or decoded
+    static FormatImage::ptr open(const string& fileName);
+    static FormatImage::ptr create(const string& data);
+
+    int interaction() const { return m_interaction; }
+
+    // Names of the format which are not in the shared base
+    const InternOverlay::ptr& names() const { return m_names; }
+
+    size_t size() const { return m_symbols.size(); }
+    unsigned symbolId(size_t n) const { return m_symbols[n].id; }
+
+    // Small values which are cheaper to copy than to decode later
+    bool isScalar(size_t n) const;
+
+    const any& value(size_t n) const { return m_symbols[n].value; }
+
+protected:
+    FormatImage(): m_interaction(0) {}
+    bool index(const char* data, size_t size);
+
+    struct Symbol {
+        unsigned        id;
+        const char*     data;
+        size_t          size;
+        any             value;
+    };
+
+    shared_ptr<void>    m_region;
+    string              m_data;
+    InternOverlay::ptr  m_names;
+    int                 m_interaction;
+    vector<Symbol>      m_symbols;
+};
+
+// Values are compared to skip the symbols that keep their initial
+// value, commands and fonts are compared by identity
+bool isSameValue(const any& value1, const any& value2);
+
+} // namespace base
+} // namespace texpp
+
+#endif
+
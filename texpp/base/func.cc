@@ -77,7 +77,7 @@ bool Let::invokeWithPrefixes(Parser& parser, shared_ptr<Node> node,
     Node::ptr lvalue = parser.parseControlSequence(false);
     node->appendChild("lvalue", lvalue);
 
-    Node::ptr equals(new Node("optional_equals"));
+    Node::ptr equals = Node::create("optional_equals");
     node->appendChild("equals", equals);
 
     while(parser.helperIsImplicitCharacter(Token::CC_SPACE, false))
@@ -160,7 +160,7 @@ bool Def::invokeWithPrefixes(Parser& parser, shared_ptr<Node> node,
     node->appendChild("lvalue", lvalue);
     Token::ptr ltoken = lvalue->value(Token::ptr());
 
-    Node::ptr paramsNode(new Node("params"));
+    Node::ptr paramsNode = Node::create("params");
     node->appendChild("params", paramsNode);
 
     bool lbrace = false;
@@ -214,7 +214,7 @@ bool Def::invokeWithPrefixes(Parser& parser, shared_ptr<Node> node,
 
     paramsNode->setValue(params);
 
-    Node::ptr left_brace(new Node("left_brace"));
+    Node::ptr left_brace = Node::create("left_brace");
     node->appendChild("left_brace", left_brace);
 
     if(parser.peekToken(false) && 
@@ -257,7 +257,7 @@ bool Def::invokeWithPrefixes(Parser& parser, shared_ptr<Node> node,
 
     node->appendChild("definition", definition);
 
-    Node::ptr right_brace(new Node("right_brace"));
+    Node::ptr right_brace = Node::create("right_brace");
     node->appendChild("right_brace", right_brace);
     if(parser.peekToken(false) &&
             parser.peekToken(false)->isCharacterCat(Token::CC_EGROUP)) {
@@ -300,10 +300,85 @@ string UserMacro::texRepr(Parser* parser) const
     return texRepr(parser, true, 0);
 }
 
+void UserMacro::compile()
+{
+    int paramNum = 0;
+    size_t size = m_params->size();
+    m_failure.resize(size);
+    for(size_t i = 0; i < size; ++i) {
+        MatchOp op = { false, i, i+1 };
+        if((*m_params)[i]->isCharacterCat(Token::CC_PARAM)) {
+            // The argument is delimited by all tokens up to the next
+            // parameter, a partial match must be able to fall back
+            // like in TeX, hence the failure function
+            op.argument = true;
+            op.begin = op.end = i+2; ++paramNum;
+            while(op.end < size &&
+                    !(*m_params)[op.end]->isCharacterCat(Token::CC_PARAM))
+                ++op.end;
+
+            size_t k = 0;
+            for(size_t j = op.begin+1; j < op.end; ++j) {
+                while(k > 0 &&
+                        !(*m_params)[j]->isSame(*(*m_params)[op.begin+k]))
+                    k = m_failure[op.begin+k-1];
+                if((*m_params)[j]->isSame(*(*m_params)[op.begin+k]))
+                    ++k;
+                m_failure[j] = k;
+            }
+            i = op.end - 1;
+        }
+        m_matcher.push_back(op);
+    }
+
+    size = m_definition->size();
+    for(size_t i = 0; i < size; ++i) {
+        const Token::ptr& token = (*m_definition)[i];
+        if(token->isCharacterCat(Token::CC_PARAM)) {
+            if(++i >= size) break;
+            const Token::ptr& ntoken = (*m_definition)[i];
+            if(ntoken->isCharacter() &&
+                    !ntoken->isCharacterCat(Token::CC_PARAM)) {
+                char ch = ntoken->value()[0];
+                if(isdigit(ch) && ch != '0' && ch - '0' <= paramNum) {
+                    TemplateOp op = { ch - '0' - 1, 0, 0 };
+                    m_template.push_back(op);
+                }
+                continue;
+            } else if(!ntoken->isCharacter()) {
+                continue;
+            }
+        }
+
+        // literal token (or the second # of ##)
+        if(!m_template.empty() && m_template.back().param < 0 &&
+                m_template.back().end == i) {
+            ++m_template.back().end;
+        } else {
+            TemplateOp op = { -1, i, i+1 };
+            m_template.push_back(op);
+        }
+    }
+
+    // Without arguments the expansion does not depend on the input,
+    // it is built once and shared by all expansions
+    if(paramNum == 0) {
+        m_expansion.reset(new Token::list());
+        m_expansion->reserve(m_definition->size());
+        BOOST_FOREACH(const TemplateOp& op, m_template) {
+            for(size_t i = op.begin; i < op.end; ++i) {
+                const Token::ptr& token = (*m_definition)[i];
+                m_expansion->push_back(
+                        token->lineNo() ? token->lcopy() : token);
+            }
+        }
+    }
+}
+
 bool UserMacro::expand(Parser& parser, shared_ptr<Node> node)
 {
     // TODO: implement \long and \outer
-    if(parser.symbol("tracingmacros", int(0)) > 0) {
+    if(parser.tracingmacros() > 0) {
         Token::ptr t = node->child("control_sequence")->value(Token::ptr());
         string str(1, '\n');
         str += //Token::texReprControl(name(), &parser, true) +
@@ -319,38 +394,68 @@ bool UserMacro::expand(Parser& parser, shared_ptr<Node> node)
     Token::list_ptr params[9];
     size_t paramNum = 0;
 
-    Token::list::iterator end = m_params->end();
-    for(Token::list::iterator it = m_params->begin(); it < end; ++it) {
-        if((*it)->isCharacterCat(Token::CC_PARAM)) {
-            child = Node::ptr(new Node("arg"));
+    BOOST_FOREACH(const MatchOp& op, m_matcher) {
+        if(op.argument) {
+            child = Node::create("arg");
             node->appendChild("arg" +
                 boost::lexical_cast<string>(paramNum+1), child);
 
             Token::list_ptr tokens(new Token::list());
             child->setValue(tokens);
 
-            Token::ptr etoken;
-            ++it;
-            if(it+1 < end && !(*(it+1))->isCharacterCat(Token::CC_PARAM))
-                etoken = *(it+1);
-
-            if(!etoken) {
+            bool delimited = op.end > op.begin;
+            if(!delimited) {
                 while(parser.peekToken(false) &&
                         parser.helperIsImplicitCharacter(
                             Token::CC_SPACE, false))
                     parser.nextToken(&child->tokens());
             }
 
+            // Tokens matching a prefix of the delimiter, with the source
+            // tokens read for each of them. When the match fails they
+            // are moved to the argument except for the longest suffix
+            // that still matches a prefix of the delimiter
+            Token::list match;
+            Token::list matchSource;
+            vector<size_t> matchPos;
 
             int level = 0;
+            size_t items = 0; // top-level tokens and groups
             Token::ptr token;
             while(token = parser.peekToken(false)) {
-                if(level == 0 && etoken &&
-                        token->type() == etoken->type() &&
-                        token->catCode() == etoken->catCode() &&
-                        token->value() == etoken->value()) {
-                    break;
-                } else if(token->isCharacterCat(Token::CC_BGROUP)) {
+                if(level == 0 && delimited) {
+                    size_t k = match.size();
+                    while(k > 0 &&
+                            !token->isSame(*(*m_params)[op.begin+k]))
+                        k = m_failure[op.begin+k-1];
+
+                    if(k < match.size()) {
+                        size_t n = match.size() - k;
+                        size_t s = n < matchPos.size() ?
+                                        matchPos[n] : matchSource.size();
+                        tokens->insert(tokens->end(),
+                                match.begin(), match.begin()+n);
+                        child->tokens().insert(child->tokens().end(),
+                                matchSource.begin(), matchSource.begin()+s);
+                        match.erase(match.begin(), match.begin()+n);
+                        matchSource.erase(matchSource.begin(),
+                                          matchSource.begin()+s);
+                        matchPos.erase(matchPos.begin(), matchPos.begin()+n);
+                        BOOST_FOREACH(size_t& pos, matchPos) pos -= s;
+                        items += n;
+                    }
+
+                    if(token->isSame(*(*m_params)[op.begin+k])) {
+                        matchPos.push_back(matchSource.size());
+                        match.push_back(parser.nextToken(&matchSource, false));
+                        if(match.size() == op.end - op.begin)
+                            break;
+                        continue;
+                    }
+                }
+
+                if(level == 0) ++items;
+                if(token->isCharacterCat(Token::CC_BGROUP)) {
                     tokens->push_back(
                         parser.nextToken(&child->tokens(), false));
                     ++level;
@@ -358,7 +463,7 @@ bool UserMacro::expand(Parser& parser, shared_ptr<Node> node)
                     tokens->push_back(
                         parser.nextToken(&child->tokens(), false));
                     --level;
-                    if(level == 0 && !etoken) break;
+                    if(level == 0 && !delimited) break;
                     if(level < 0) {
                         parser.logger()->log(Logger::ERROR,
                             "Argument of " + Command::texRepr(&parser) +
@@ -368,11 +473,22 @@ bool UserMacro::expand(Parser& parser, shared_ptr<Node> node)
                 } else {
                     tokens->push_back(
                         parser.nextToken(&child->tokens(), false));
-                    if(level == 0 && !etoken) break;
+                    if(level == 0 && !delimited) break;
                 }
             }
 
-            if(tokens->size() >= 2 &&
+            if(match.size() < op.end - op.begin) {
+                // The input ended before the delimiter
+                tokens->insert(tokens->end(), match.begin(), match.end());
+                child->tokens().insert(child->tokens().end(),
+                            matchSource.begin(), matchSource.end());
+                items += match.size();
+                matchSource.clear();
+            }
+
+            // Braces around an argument that is a single group
+            // are stripped
+            if(items == 1 && tokens->size() >= 2 &&
                     tokens->front()->isCharacterCat(Token::CC_BGROUP) &&
                     tokens->back()->isCharacterCat(Token::CC_EGROUP)) {
                 std::copy(tokens->begin()+1, tokens->end(),
@@ -384,18 +500,21 @@ bool UserMacro::expand(Parser& parser, shared_ptr<Node> node)
             child->setValue(tokens);
             child.reset();
 
+            if(!matchSource.empty()) {
+                child = Node::create("arg_skip");
+                node->appendChild("arg_skip", child);
+                child->tokens().swap(matchSource);
+            }
+
         } else {
             Token::ptr ntoken = parser.peekToken(false);
             if(!child) {
-                child = Node::ptr(new Node("arg_skip"));
+                child = Node::create("arg_skip");
                 node->appendChild("arg_skip", child);
             }
             parser.nextToken(&child->tokens(), false);
 
-            if(!ntoken ||
-                    ntoken->type() != (*it)->type() ||
-                    ntoken->catCode() != (*it)->catCode() ||
-                    ntoken->value() != (*it)->value()) {
+            if(!ntoken || !ntoken->isSame(*(*m_params)[op.begin])) {
                 parser.logger()->log(Logger::ERROR,
                     "Use of " + Command::texRepr(&parser) +
                     " doesn't match its definition",
@@ -405,7 +524,7 @@ bool UserMacro::expand(Parser& parser, shared_ptr<Node> node)
         }
     }
 
-    if(parser.symbol("tracingmacros", int(0)) > 0) {
+    if(parser.tracingmacros() > 0) {
         for(size_t n = 0; n < paramNum; ++n) {
             string str("#");
             str += boost::lexical_cast<string>(n+1);
@@ -417,25 +536,24 @@ bool UserMacro::expand(Parser& parser, shared_ptr<Node> node)
         }
     }
 
+    if(m_expansion) {
+        node->setValue(m_expansion);
+        return true;
+    }
+
     Token::list_ptr result(new Token::list());
     result->reserve(m_definition->size());
 
-    end = m_definition->end();
-    for(Token::list::iterator it = m_definition->begin();
-                                            it < end; ++it) {
-        if((*it)->isCharacterCat(Token::CC_PARAM)) {
-            if(++it >= end) break;
-            if((*it)->isCharacterCat(Token::CC_PARAM)) {
-                result->push_back((*it)->lineNo() ? (*it)->lcopy() : *it);
-            } else if((*it)->isCharacter()) {
-                char ch = (*it)->value()[0];
-                if(!isdigit(ch) || ch == '0' || !params[ch-'0'-1]) continue;
-                BOOST_FOREACH(Token::ptr token, *params[ch-'0'-1]) {
-                    result->push_back(token->lineNo() ? token->lcopy() : token);
-                }
+    BOOST_FOREACH(const TemplateOp& op, m_template) {
+        if(op.param < 0) {
+            for(size_t i = op.begin; i < op.end; ++i) {
+                const Token::ptr& token = (*m_definition)[i];
+                result->push_back(token->lineNo() ? token->lcopy() : token);
             }
         } else {
-            result->push_back((*it)->lineNo() ? (*it)->lcopy() : *it);
+            BOOST_FOREACH(const Token::ptr& token, *params[op.param]) {
+                result->push_back(token->lineNo() ? token->lcopy() : token);
+            }
         }
     }
 
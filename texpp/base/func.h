@@ -33,7 +33,9 @@ namespace base {
 class Prefix: public Command
 {
 public:
-    explicit Prefix(const string& name): Command(name) {}
+    explicit Prefix(const string& name): Command(name) {
+        m_flags |= PREFIX;
+    }
     bool invoke(Parser&, shared_ptr<Node>) { return false; }
     bool invokeWithPrefixes(Parser&, shared_ptr<Node>,
                                 std::set<string>& prefixes);
@@ -48,7 +50,9 @@ public:
 class Assignment: public Command
 {
 public:
-    explicit Assignment(const string& name = string()): Command(name) {}
+    explicit Assignment(const string& name = string()): Command(name) {
+        m_flags |= ASSIGNMENT;
+    }
     bool invoke(Parser& parser, shared_ptr<Node> node);
 
 protected:
@@ -116,7 +120,9 @@ class Def: public Assignment
 public:
     explicit Def(const string& name,
                     bool global = false, bool expand = false)
-        : Assignment(name), m_global(global), m_expand(expand) {}
+        : Assignment(name), m_global(global), m_expand(expand) {
+        if(expand) m_flags |= EXPANDS_TEXT;
+    }
     bool invokeWithPrefixes(Parser& parser, shared_ptr<Node> node,
                                 std::set<string>& prefixes);
 
@@ -135,10 +141,13 @@ public:
         Token::list_ptr params, Token::list_ptr definition,
         bool outerAttr = false, bool longAttr = false)
         : Macro(name), m_params(params), m_definition(definition),
-          m_outerAttr(outerAttr), m_longAttr(longAttr) {}
+          m_outerAttr(outerAttr), m_longAttr(longAttr) {
+        m_flags |= USER_MACRO;
+        compile();
+    }
 
-    Token::list params() { return *m_params; }
-    Token::list definition() { return *m_definition; }
+    const Token::list& params() const { return *m_params; }
+    const Token::list& definition() const { return *m_definition; }
     bool outerAttr() const { return m_outerAttr; }
     bool longAttr() const { return m_longAttr; }
 
@@ -148,10 +157,36 @@ public:
     bool expand(Parser& parser, shared_ptr<Node> node);
 
 protected:
+    void compile();
+
+    // The parameter text is compiled into a sequence of literal tokens
+    // and arguments, the replacement text into literal spans and
+    // argument references, so that expand() does not rescan them
+    struct MatchOp {
+        bool    argument;
+        size_t  begin;      // the literal token or the delimiter of the
+        size_t  end;        // argument in m_params (empty if none)
+    };
+
+    struct TemplateOp {
+        int     param;      // argument number or -1 for literal tokens
+        size_t  begin;      // literal tokens of m_definition
+        size_t  end;
+    };
+
     Token::list_ptr m_params;
     Token::list_ptr m_definition;
     bool m_outerAttr;
     bool m_longAttr;
+
+    vector<MatchOp>     m_matcher;
+    vector<TemplateOp>  m_template;
+
+    // KMP failure function of the delimiters, indexed as m_params
+    vector<size_t>      m_failure;
+
+    // The expansion of a macro without arguments
+    Token::list_ptr     m_expansion;
 };
 
 } // namespace base
@@ -31,18 +31,18 @@ bool invokeGlueOperation(Variable& var, Parser& parser,
         shared_ptr<Node> node, Variable::Operation op, bool global, bool mu)
 {
     if(op == Variable::ASSIGN) {
-        string name = var.parseName(parser, node);
+        unsigned id = var.parseName(parser, node);
 
         node->appendChild("equals", parser.parseOptionalEquals());
         Node::ptr rvalue = parser.parseGlue(mu);
         node->appendChild("rvalue", rvalue);
 
         node->setValue(rvalue->valueAny());
-        parser.setSymbol(name, rvalue->valueAny(), global);
+        parser.setSymbol(id, rvalue->valueAny(), global);
         return true;
     } else if(op == Variable::EXPAND) {
-        string name = var.parseName(parser, node);
-        Glue val = parser.symbol(name, Glue(mu,0));
+        unsigned id = var.parseName(parser, node);
+        Glue val = parser.symbol(id, Glue(mu,0));
         node->setValue(InternalGlue::glueToString(val));
         return true;
     } else {
@@ -55,14 +55,14 @@ bool invokeGlueVarOperation(Variable& var, Parser& parser,
 {
     static vector<string> kw_by(1, "by");
     if(op == Variable::ADVANCE) {
-        string name = var.parseName(parser, node);
+        unsigned id = var.parseName(parser, node);
         
         node->appendChild("by", parser.parseOptionalKeyword(kw_by));
 
         Node::ptr rvalue = parser.parseGlue(mu);
         node->appendChild("rvalue", rvalue);
 
-        Glue v = parser.symbol(name, Glue(mu,0));
+        Glue v = parser.symbol(id, Glue(mu,0));
         Glue rv = rvalue->value(Glue(mu,0));
 
         v.width.value += rv.width.value;
@@ -84,18 +84,18 @@ bool invokeGlueVarOperation(Variable& var, Parser& parser,
         }
 
         node->setValue(v);
-        parser.setSymbol(name, v, global);
+        parser.setSymbol(id, v, global);
         return true;
 
     } else if(op == Variable::MULTIPLY || op == Variable::DIVIDE) {
-        string name = var.parseName(parser, node);
+        unsigned id = var.parseName(parser, node);
 
         node->appendChild("by", parser.parseOptionalKeyword(kw_by));
 
         Node::ptr rvalue = parser.parseNumber();
         node->appendChild("rvalue", rvalue);
 
-        Glue v = parser.symbol(name, Glue(mu,0));
+        Glue v = parser.symbol(id, Glue(mu,0));
         int rv = rvalue->value(int(0));
         bool overflow = false;
 
@@ -127,7 +127,7 @@ bool invokeGlueVarOperation(Variable& var, Parser& parser,
                 parser, parser.lastToken());
         } else {
             node->setValue(v);
-            parser.setSymbol(name, v, global);
+            parser.setSymbol(id, v, global);
         }
         return true;
     }
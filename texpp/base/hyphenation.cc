@@ -27,7 +27,7 @@ bool Hyphenation::invokeOperation(Parser& parser,
                         shared_ptr<Node> node, Operation op, bool)
 {
     if(op == ASSIGN) {
-        string name = parseName(parser, node);
+        parseName(parser, node);
 
         Node::ptr internal = parser.parseGeneralText(true);
         //Token::list_ptr tokens = internal->child("balanced_text")
@@ -38,9 +38,9 @@ bool Hyphenation::invokeOperation(Parser& parser,
 
         /*
         if(tokens) {
-            Token::list h = parser.symbol(name, Token::list());
+            Token::list h = parser.symbol(id, Token::list());
             std::copy(tokens->begin(), tokens->end(), std::back_inserter(h));
-            parser.setSymbol(name, h, true); // global
+            parser.setSymbol(id, h, true); // global
         }*/
         return true;
     }
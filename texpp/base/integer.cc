@@ -30,18 +30,18 @@ bool InternalInteger::invokeOperation(Parser& parser,
                 shared_ptr<Node> node, Operation op, bool global)
 {
     if(op == ASSIGN) {
-        string name = parseName(parser, node);
+        unsigned id = parseName(parser, node);
 
         node->appendChild("equals", parser.parseOptionalEquals());
         Node::ptr rvalue = parser.parseNumber();
         node->appendChild("rvalue", rvalue);
 
         node->setValue(rvalue->valueAny());
-        parser.setSymbol(name, rvalue->valueAny(), global);
+        parser.setSymbol(id, rvalue->valueAny(), global);
         return true;
     } else if(op == Variable::EXPAND) {
-        string name = parseName(parser, node);
-        int val = parser.symbol(name, int(0));
+        unsigned id = parseName(parser, node);
+        int val = parser.symbol(id, int(0));
         node->setValue(boost::lexical_cast<string>(val));
         return true;
     } else {
@@ -53,7 +53,7 @@ bool IntegerVariable::invokeOperation(Parser& parser,
                 shared_ptr<Node> node, Operation op, bool global)
 {
     if(op == ADVANCE || op == MULTIPLY || op == DIVIDE) {
-        string name = parseName(parser, node);
+        unsigned id = parseName(parser, node);
 
         static vector<string> kw_by(1, "by");
         node->appendChild("by", parser.parseOptionalKeyword(kw_by));
@@ -61,7 +61,7 @@ bool IntegerVariable::invokeOperation(Parser& parser,
         Node::ptr rvalue = parser.parseNumber();
         node->appendChild("rvalue", rvalue);
 
-        int v = parser.symbol(name, int(0));
+        int v = parser.symbol(id, int(0));
         int rv = rvalue->value(int(0));
         bool overflow = false;
 
@@ -81,7 +81,7 @@ bool IntegerVariable::invokeOperation(Parser& parser,
                 parser, parser.lastToken());
         } else {
             node->setValue(v);
-            parser.setSymbol(name, v, global);
+            parser.setSymbol(id, v, global);
         }
         return true;
     }
@@ -89,7 +89,7 @@ bool IntegerVariable::invokeOperation(Parser& parser,
     return InternalInteger::invokeOperation(parser, node, op, global);
 }
 
-string CharcodeVariable::parseName(Parser& parser, shared_ptr<Node> node)
+unsigned CharcodeVariable::parseName(Parser& parser, shared_ptr<Node> node)
 {
     Node::ptr number = parser.parseNumber();
     node->appendChild("variable_number", number);
@@ -102,16 +102,14 @@ string CharcodeVariable::parseName(Parser& parser, shared_ptr<Node> node)
         n = 0;
     }
 
-    string s = name().substr(1) + boost::lexical_cast<string>(n);
-    parser.setSymbolDefault(s, m_initValue);
-    return s;
+    return Parser::registerId(m_table, n);
 }
 
 bool CharcodeVariable::invokeOperation(Parser& parser,
                 shared_ptr<Node> node, Operation op, bool global)
 {
     if(op == ASSIGN) {
-        string name = parseName(parser, node);
+        unsigned id = parseName(parser, node);
 
         node->appendChild("equals", parser.parseOptionalEquals());
         Node::ptr rvalue = parser.parseNumber();
@@ -129,7 +127,7 @@ bool CharcodeVariable::invokeOperation(Parser& parser,
         }
 
         node->setValue(n);
-        parser.setSymbol(name, n, global);
+        parser.setSymbol(id, n, global);
         return true;
     } else {
         return InternalInteger::invokeOperation(parser, node, op, global);
@@ -140,23 +138,23 @@ bool SpecialInteger::invokeOperation(Parser& parser,
                 shared_ptr<Node> node, Operation op, bool global)
 {
     if(op == ASSIGN) {
-        string name = parseName(parser, node);
+        unsigned id = parseName(parser, node);
 
         node->appendChild("equals", parser.parseOptionalEquals());
         Node::ptr rvalue = parser.parseNumber();
         node->appendChild("rvalue", rvalue);
 
         node->setValue(rvalue->valueAny());
-        parser.setSymbol(name, rvalue->valueAny(), true); // global
+        parser.setSymbol(id, rvalue->valueAny(), true); // global
         return true;
     } else if(op == GET) {
-        string name = parseName(parser, node);
-        const any& ret = parser.symbolAny(name);
+        unsigned id = parseName(parser, node);
+        const any& ret = parser.symbolAny(id);
         node->setValue(ret.empty() ? m_initValue : ret);
         return true;
     } else if(op == EXPAND) {
-        string name = parseName(parser, node);
-        int val = parser.symbol(name, int(0));
+        unsigned id = parseName(parser, node);
+        int val = parser.symbol(id, int(0));
         node->setValue(boost::lexical_cast<string>(val));
         return true;
     } else {
@@ -179,6 +177,23 @@ bool Spacefactor::invokeOperation(Parser& parser,
         return true;
     }
 
+    // The space factor is kept by the parser itself
+    if(op == ASSIGN) {
+        node->appendChild("equals", parser.parseOptionalEquals());
+        Node::ptr rvalue = parser.parseNumber();
+        node->appendChild("rvalue", rvalue);
+
+        node->setValue(rvalue->valueAny());
+        parser.setSpacefactor(rvalue->value(int(0)));
+        return true;
+    } else if(op == GET) {
+        node->setValue(parser.spacefactor());
+        return true;
+    } else if(op == EXPAND) {
+        node->setValue(boost::lexical_cast<string>(parser.spacefactor()));
+        return true;
+    }
+
     return SpecialInteger::invokeOperation(parser, node, op, global);
 }
 
@@ -50,18 +50,21 @@ public:
 class CharcodeVariable: public InternalInteger
 {
 public:
-    CharcodeVariable(const string& name,
-        const any& initValue = any(), int min=0, int max=0)
-        : InternalInteger(name, initValue), m_min(min), m_max(max) {}
+    CharcodeVariable(const string& name, const any& initValue,
+        Parser::RegisterType table, int min=0, int max=0)
+        : InternalInteger(name, initValue),
+          m_table(table), m_min(min), m_max(max) {}
 
-    string parseName(Parser& parser, shared_ptr<Node> node);
+    unsigned parseName(Parser& parser, shared_ptr<Node> node);
     bool invokeOperation(Parser& parser,
                 shared_ptr<Node> node, Operation op, bool global);
 
+    Parser::RegisterType table() const { return m_table; }
     int min() const { return m_min; }
     int max() const { return m_max; }
 
 protected:
+    Parser::RegisterType m_table;
     int m_min;
     int m_max;
 };
@@ -67,15 +67,13 @@ bool Changecase::invoke(Parser& parser, shared_ptr<Node> node)
             Token::ptr newToken = token->lcopy();
 
             if(token->isCharacter()) {
-                int newCode = parser.symbol(m_table +
-                        boost::lexical_cast<string>(int(token->value()[0])),
-                        int(0));
+                int newCode = parser.symbol(Parser::registerId(m_table,
+                        (unsigned char) token->value()[0]), int(0));
                 if(newCode > 0 && newCode <= 255)
                     newToken->setValue(string(1, char(newCode)));
             } else if(token->isControl() && token->value().substr(0,1)=="`"){
-                int newCode = parser.symbol(m_table +
-                        boost::lexical_cast<string>(int(token->value()[1])),
-                        int(0));
+                int newCode = parser.symbol(Parser::registerId(m_table,
+                        (unsigned char) token->value()[1]), int(0));
                 if(newCode > 0 && newCode <= 255)
                     newToken->setValue("`" + string(1, char(newCode)));
             }
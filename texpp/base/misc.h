@@ -64,12 +64,12 @@ public:
 class Changecase: public Command
 {
 public:
-    explicit Changecase(const string& name, const string& table)
+    explicit Changecase(const string& name, Parser::RegisterType table)
         : Command(name), m_table(table) {}
     bool invoke(Parser& parser, shared_ptr<Node> node);
 
 protected:
-    string m_table;
+    Parser::RegisterType m_table;
 };
 
 class SetInteraction: public Command
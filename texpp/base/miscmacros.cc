@@ -82,7 +82,7 @@ bool StringMacro::expand(Parser& parser, shared_ptr<Node> node)
 
 bool CsnameMacro::expand(Parser& parser, shared_ptr<Node> node)
 {
-    Node::ptr child(new Node("args"));
+    Node::ptr child = Node::create("args");
     node->appendChild("args", child);
 
     string name(1, '\\');
@@ -130,27 +130,8 @@ bool ExpandafterMacro::expand(Parser& parser, shared_ptr<Node> node)
     Node::ptr child2 = parser.parseToken(false); // expand
     node->appendChild("token2", child2);
 
-    Token::list tokens;
-    Token::ptr token1 = child1->value(Token::ptr());
-    if(token1) {
-        tokens.push_back(token1->lcopy());
-    }
-
-    Token::ptr token2 = child2->value(Token::ptr());
-    if(token2) {
-        Node::ptr enode = parser.rawExpandToken(token2->lcopy());
-        if(enode) {
-            Token::list_ptr newTokens = enode->value(Token::list_ptr());
-            assert(newTokens && !newTokens->empty());
-            tokens.insert(tokens.end(),
-                    newTokens->begin(), newTokens->end());
-        } else {
-            tokens.push_back(token2->lcopy());
-        }
-    }
-
-    parser.pushBack(&tokens);
-
+    // The parser expands token2 and pushes back both tokens when it
+    // sees the EXPAND_AFTER flag, which keeps chains non-recursive
     return true;
 }
 
@@ -63,7 +63,9 @@ public:
 class ExpandafterMacro: public Macro
 {
 public:
-    explicit ExpandafterMacro(const string& name): Macro(name) {}
+    explicit ExpandafterMacro(const string& name): Macro(name) {
+        m_flags |= EXPAND_AFTER;
+    }
     bool expand(Parser& parser, shared_ptr<Node> node);
 };
 
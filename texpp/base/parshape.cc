@@ -29,7 +29,7 @@ bool Parshape::invokeOperation(Parser& parser,
                         shared_ptr<Node> node, Operation op, bool global)
 {
     if(op == ASSIGN) {
-        string name = parseName(parser, node);
+        unsigned id = parseName(parser, node);
 
         node->appendChild("equals", parser.parseOptionalEquals());
 
@@ -50,18 +50,18 @@ bool Parshape::invokeOperation(Parser& parser,
         }
 
         node->setValue(info);
-        parser.setSymbol(name, info, global);
+        parser.setSymbol(id, info, global);
         return true;
 
     } else if(op == GET) {
-        string name = parseName(parser, node);
-        ParshapeInfo info = parser.symbol(name, ParshapeInfo());
+        unsigned id = parseName(parser, node);
+        ParshapeInfo info = parser.symbol(id, ParshapeInfo());
         node->setValue(info.parshape.size());
         return true;
 
     } else if(op == EXPAND) {
-        string name = parseName(parser, node);
-        ParshapeInfo info = parser.symbol(name, ParshapeInfo());
+        unsigned id = parseName(parser, node);
+        ParshapeInfo info = parser.symbol(id, ParshapeInfo());
         node->setValue(boost::lexical_cast<string>(info.parshape.size()));
         return true;
 
@@ -52,7 +52,7 @@ bool parseMeaning(Parser& parser, shared_ptr<Node> node, bool show)
         else str += "undefined";
 
         // XXX: the following line
-        if(!show && dynamic_pointer_cast<base::UserMacro>(c))
+        if(!show && c && c->hasFlags(Command::USER_MACRO))
             boost::algorithm::erase_all(str, "\n");
     }
 
@@ -82,10 +82,7 @@ bool parseThe(Parser& parser, shared_ptr<Node> node, bool show)
             (*toks_copy)[n] = toks[n]->lcopy();
             if(!show) {
                 Command::ptr c = parser.prevCommand();
-                if(dynamic_pointer_cast<base::Write>(c) ||
-                        dynamic_pointer_cast<base::Message>(c) ||
-                        (dynamic_pointer_cast<base::Def>(c) &&
-                         static_pointer_cast<base::Def>(c)->expand())) {
+                if(c && c->hasFlags(Command::EXPANDS_TEXT)) {
                     parser.addNoexpand((*toks_copy)[n]);
                 }
             }
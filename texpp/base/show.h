@@ -49,7 +49,9 @@ public:
 class TheMacro: public Macro
 {
 public:
-    explicit TheMacro(const string& name): Macro(name) {}
+    explicit TheMacro(const string& name): Macro(name) {
+        m_flags |= THE;
+    }
     bool expand(Parser& parser, shared_ptr<Node> node);
 };
 
@@ -30,7 +30,7 @@ bool InternalToks::invokeOperation(Parser& parser,
                 shared_ptr<Node> node, Operation op, bool global)
 {
     if(op == ASSIGN) {
-        string name = parseName(parser, node);
+        unsigned id = parseName(parser, node);
 
         node->appendChild("equals", parser.parseOptionalEquals());
 
@@ -45,12 +45,12 @@ bool InternalToks::invokeOperation(Parser& parser,
             node->setValue(tokens ? *tokens : Token::list());
         }
         node->appendChild("rvalue", internal);
-        parser.setSymbol(name, node->valueAny(), global);
+        parser.setSymbol(id, node->valueAny(), global);
         return true;
 
     } else if(op == EXPAND) {
-        string name = parseName(parser, node);
-        Token::list toks = parser.symbol(name, Token::list());
+        unsigned id = parseName(parser, node);
+        Token::list toks = parser.symbol(id, Token::list());
         node->setValue(toksToString(parser, toks));
         return true;
 
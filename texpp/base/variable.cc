@@ -26,17 +26,17 @@
 namespace texpp {
 namespace base {
 
-string Variable::parseName(Parser&, shared_ptr<Node>)
+unsigned Variable::parseName(Parser&, shared_ptr<Node>)
 {
-    return name().substr(1);
+    return m_symbolId;
 }
 
 bool Variable::invokeOperation(Parser& parser,
                 shared_ptr<Node> node, Operation op, bool)
 {
     if(op == GET) {
-        string name = parseName(parser, node);
-        const any& ret = parser.symbolAny(name);
+        unsigned id = parseName(parser, node);
+        const any& ret = parser.symbolAny(id);
         node->setValue(ret.empty() ? m_initValue : ret);
         return true;
     }
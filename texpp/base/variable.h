@@ -35,11 +35,14 @@ public:
     enum Operation { GET, ASSIGN, ADVANCE, MULTIPLY, DIVIDE, EXPAND };
 
     Variable(const string& name, const any& initValue = any())
-        : Assignment(name), m_initValue(initValue) {}
+        : Assignment(name), m_initValue(initValue),
+          m_symbolId(name.empty() ? unsigned(Intern::EMPTY)
+                                  : Parser::symbolId(name.substr(1))) {}
 
     const any& initValue() const { return m_initValue; }
 
-    virtual string parseName(Parser& parser, shared_ptr<Node> node);
+    // Returns the id of the symbol holding the value of the variable
+    virtual unsigned parseName(Parser& parser, shared_ptr<Node> node);
     virtual bool invokeOperation(Parser& parser,
                 shared_ptr<Node> node, Operation op, bool global);
 
@@ -51,6 +54,7 @@ public:
 
 protected:
     any m_initValue;
+    unsigned m_symbolId;
 };
 
 class ArithmeticCommand: public Assignment
@@ -71,12 +75,20 @@ template<class Var>
 class Register: public Var
 {
 public:
-    Register(const string& name, const any& initValue)
-        : Var(name, initValue) {}
+    Register(const string& name, const any& initValue,
+                Parser::RegisterType type, int number = -1)
+        : Var(name, initValue), m_type(type), m_number(number) {}
+
+    Parser::RegisterType type() const { return m_type; }
+    int number() const { return m_number; }
 
-    string parseName(Parser& parser, shared_ptr<Node> node);
-    bool createDef(Parser& parser, shared_ptr<Token> token,
+    unsigned parseName(Parser& parser, shared_ptr<Node> node);
+    bool createDef(Parser& parser, Token::ptr token,
                             int num, bool global);
+
+protected:
+    Parser::RegisterType m_type;
+    int m_number; // fixed register number for \countdef and friends
 };
 
 template<class Var>
@@ -96,7 +108,7 @@ Node::ptr Variable::tryParseVariableValue(Parser& parser)
     shared_ptr<Var> var = parser.symbolCommand<Var>(parser.peekToken());
     if(!var) return Node::ptr();
 
-    Node::ptr node(new Node("variable"));
+    Node::ptr node = Node::create("variable");
     node->appendChild("control_token", parser.parseToken());
     if(var->invokeOperation(parser, node, base::Variable::GET, false))
         return node;
@@ -106,8 +118,11 @@ Node::ptr Variable::tryParseVariableValue(Parser& parser)
 }
 
 template<class Var>
-string Register<Var>::parseName(Parser& parser, shared_ptr<Node> node)
+unsigned Register<Var>::parseName(Parser& parser, shared_ptr<Node> node)
 {
+    if(m_number >= 0)
+        return Parser::registerId(m_type, m_number);
+
     shared_ptr<Node> number = parser.parseNumber();
     node->appendChild("variable_number", number);
     int n = number->value(int(0));
@@ -119,9 +134,7 @@ string Register<Var>::parseName(Parser& parser, shared_ptr<Node> node)
         n = 0;
     }
 
-    string s = this->name().substr(1) + boost::lexical_cast<string>(n);
-    parser.setSymbolDefault(s, this->m_initValue);
-    return s;
+    return Parser::registerId(m_type, n);
 }
 
 template<class Var>
@@ -136,9 +149,8 @@ bool Register<Var>::createDef(Parser& parser, Token::ptr token,
     }
 
     string iname = this->name() + boost::lexical_cast<string>(num);
-    parser.setSymbol(token,
-        Command::ptr(new Var(iname, this->initValue())), global);
-    parser.setSymbolDefault(iname.substr(1), this->initValue());
+    parser.setSymbol(token, Command::ptr(new Register<Var>(
+                iname, this->initValue(), m_type, num)), global);
     return true;
 }
 
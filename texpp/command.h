@@ -20,13 +20,13 @@
 #define __TEXPP_COMMAND_H
 
 #include <texpp/common.h>
+#include <texpp/token.h>
 
 #include <set>
 #include <boost/lexical_cast.hpp>
 
 namespace texpp {
 
-class Token;
 class Node;
 class Parser;
 
@@ -35,11 +35,36 @@ class Command
 public:
     typedef shared_ptr<Command> ptr;
 
-    Command(const string& name = string()): m_name(name) {}
+    // Properties used by the parser to dispatch commands without RTTI.
+    // They are set by the constructors of the corresponding classes
+    enum Flags {
+        EXPANDABLE          = 0x0001,
+        CONDITIONAL_BEGIN   = 0x0002,
+        CONDITIONAL_OR      = 0x0004,
+        CONDITIONAL_ELSE    = 0x0008,
+        CONDITIONAL_END     = 0x0010,
+        GROUP_BEGIN         = 0x0020,
+        GROUP_END           = 0x0040,
+        PREFIX              = 0x0080,
+        ASSIGNMENT          = 0x0100,
+        USER_MACRO          = 0x0200,
+        THE                 = 0x0400,
+        EXPANDS_TEXT        = 0x0800, // \write, \message, \edef, \xdef
+        TOKEN_COMMAND       = 0x1000,
+        EXPAND_AFTER        = 0x2000, // \expandafter
+
+        CONDITIONAL = CONDITIONAL_BEGIN | CONDITIONAL_OR |
+                      CONDITIONAL_ELSE | CONDITIONAL_END
+    };
+
+    Command(const string& name = string()): m_name(name), m_flags(0) {}
     virtual ~Command() {}
 
     const string& name() const { return m_name; }
 
+    unsigned flags() const { return m_flags; }
+    bool hasFlags(unsigned flags) const { return (m_flags & flags) != 0; }
+
     virtual string repr() const;
     virtual string texRepr(Parser* parser = NULL) const;
 
@@ -51,6 +76,7 @@ public:
 
 protected:
     string m_name;
+    unsigned m_flags;
 };
 
 class TokenCommand: public Command
@@ -58,16 +84,18 @@ class TokenCommand: public Command
 public:
     typedef shared_ptr<TokenCommand> ptr;
 
-    TokenCommand(shared_ptr<Token> token)
-        : Command("token_command"), m_token(token) {}
+    TokenCommand(Token::ptr token)
+        : Command("token_command"), m_token(token) {
+        m_flags |= TOKEN_COMMAND;
+    }
 
-    const shared_ptr<Token>& token() const { return m_token; }
+    const Token::ptr& token() const { return m_token; }
 
     string texRepr(Parser* parser = NULL) const;
     bool invoke(Parser& parser, shared_ptr<Node> node);
 
 protected:
-    shared_ptr<Token> m_token;
+    Token::ptr m_token;
 };
 
 class Macro: public Command
@@ -75,21 +103,24 @@ class Macro: public Command
 public:
     typedef shared_ptr<Macro> ptr;
 
-    Macro(const string& name = string()): Command(name) {}
+    Macro(const string& name = string()): Command(name) {
+        m_flags |= EXPANDABLE;
+    }
 
     bool invokeWithPrefixes(Parser&, shared_ptr<Node>,
                                 std::set<string>&) { return true; }
     virtual bool expand(Parser&, shared_ptr<Node>) { return false; }
 
-    static shared_ptr<vector<shared_ptr<Token> > >
-                        stringToTokens(const string& str);
+    static Token::list_ptr stringToTokens(const string& str);
 };
 
 class ConditionalBegin: public Macro
 {
 public:
     typedef shared_ptr<ConditionalBegin> ptr;
-    ConditionalBegin(const string& name = string()): Macro(name) {}
+    ConditionalBegin(const string& name = string()): Macro(name) {
+        m_flags |= CONDITIONAL_BEGIN;
+    }
     virtual bool evaluate(Parser&, shared_ptr<Node>) { return true; }
 };
 
@@ -97,33 +128,43 @@ class ConditionalOr: public Macro
 {
 public:
     typedef shared_ptr<ConditionalOr> ptr;
-    ConditionalOr(const string& name = string()): Macro(name) {}
+    ConditionalOr(const string& name = string()): Macro(name) {
+        m_flags |= CONDITIONAL_OR;
+    }
 };
 
 class ConditionalElse: public Macro
 {
 public:
     typedef shared_ptr<ConditionalElse> ptr;
-    ConditionalElse(const string& name = string()): Macro(name) {}
+    ConditionalElse(const string& name = string()): Macro(name) {
+        m_flags |= CONDITIONAL_ELSE;
+    }
 };
 
 class ConditionalEnd: public Macro
 {
 public:
     typedef shared_ptr<ConditionalEnd> ptr;
-    ConditionalEnd(const string& name = string()): Macro(name) {}
+    ConditionalEnd(const string& name = string()): Macro(name) {
+        m_flags |= CONDITIONAL_END;
+    }
 };
 
 class Begingroup: public Command
 {
 public:
-    Begingroup(const string& name = string()): Command(name) {}
+    Begingroup(const string& name = string()): Command(name) {
+        m_flags |= GROUP_BEGIN;
+    }
 };
 
 class Endgroup: public Command
 {
 public:
-    Endgroup(const string& name = string()): Command(name) {}
+    Endgroup(const string& name = string()): Command(name) {
+        m_flags |= GROUP_END;
+    }
 };
 
 } // namespace texpp
@@ -28,8 +28,6 @@
 #include <cassert>
 #include <exception>
 
-#include <boost/any.hpp>
-
 namespace texpp {
 
 pair<int,bool> safeMultiply(int v1, int v2, int max)
@@ -71,48 +69,46 @@ string reprString(const string& s)
     return r.str();
 }
 
-string reprAny(const boost::any& value)
+string reprAny(const any& value)
 {
-    using boost::unsafe_any_cast;
-
     std::ostringstream r;
 
     if(value.empty()) {
         r << "None";
 
-    } else if(value.type() == typeid(int)) {
+    } else if(value.is<int>()) {
         r << *unsafe_any_cast<int>(&value);
 
-    } else if(value.type() == typeid(short)) {
+    } else if(value.is<short>()) {
         r << *unsafe_any_cast<short>(&value);
 
-    } else if(value.type() == typeid(long)) {
+    } else if(value.is<long>()) {
         r << *unsafe_any_cast<long>(&value);
 
-    } else if(value.type() == typeid(string)) {
+    } else if(value.is<string>()) {
         r << reprString(*unsafe_any_cast<string>(&value));
 
-    } else if(value.type() == typeid(pair<int,int>)) {
+    } else if(value.is<pair<int,int> >()) {
         pair<int,int> v = *unsafe_any_cast<pair<int,int> >(&value);
         r << "(" << v.first << ", " << v.second << ")";
 
-    } else if(value.type() == typeid(base::Dimen)) {
+    } else if(value.is<base::Dimen>()) {
         r << base::InternalDimen::dimenToString(
                 *unsafe_any_cast<base::Dimen>(&value));
 
-    } else if(value.type() == typeid(base::Glue)) {
+    } else if(value.is<base::Glue>()) {
         r << base::InternalGlue::glueToString(
                 *unsafe_any_cast<base::Glue>(&value));
 
-    } else if(value.type() == typeid(Token::ptr)) {
+    } else if(value.is<Token::ptr>()) {
         Token::ptr tok = (*unsafe_any_cast<Token::ptr>(&value));
         r << (tok ? tok->texRepr() : "null");
 
-    } else if(value.type() == typeid(Command::ptr)) {
+    } else if(value.is<Command::ptr>()) {
         Command::ptr cmd = (*unsafe_any_cast<Command::ptr>(&value));
         r << (cmd ? cmd->texRepr() : "null");
 
-    } else if(value.type() == typeid(Token::list_ptr)) {
+    } else if(value.is<Token::list_ptr>()) {
         r << "TokenList("
           << (*unsafe_any_cast<Token::list_ptr>(&value))->size()
           << " tokens)";
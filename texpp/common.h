@@ -26,10 +26,11 @@
 
 //#include <tr1/memory>
 #include <boost/shared_ptr.hpp>
-#include <boost/any.hpp>
 
 #include <tr1/unordered_map>
 
+#include <texpp/any.h>
+
 #ifndef WINDOWS
 #define PATH_SEP '/'
 #else
@@ -54,10 +55,6 @@ namespace texpp {
     using boost::dynamic_pointer_cast;
     using boost::static_pointer_cast;
 
-    using boost::any;
-    using boost::any_cast;
-    using boost::unsafe_any_cast;
-
     pair<int,bool> safeMultiply(int v1, int v2, int max);
     pair<int,bool> safeDivide(int v1, int v2);
 
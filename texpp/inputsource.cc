@@ -0,0 +1,329 @@
+/*  This file is part of texpp library.
+    Copyright (C) 2009 Vladimir Kuznetsov <ks.vladimir@gmail.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <texpp/inputsource.h>
+
+#include <cstring>
+#include <algorithm>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+
+namespace texpp {
+
+InputSource::InputSource()
+    : m_data(NULL), m_size(0), m_pos(0), m_lf(string::npos)
+{
+}
+
+void InputSource::setData(const char* data, size_t size)
+{
+    Chunk chunk = { 0, size, data };
+    m_chunks.assign(1, chunk);
+
+    m_data = data;
+    m_size = size;
+    m_pos = 0;
+    m_lf = string::npos;
+}
+
+char* InputSource::reserveBuffer(size_t size)
+{
+    size_t left = m_size - m_pos;
+    if(!m_buffers.empty() && m_data == &m_buffers.back()[0] &&
+            m_size + size <= m_buffers.back().size()) {
+        return &m_buffers.back()[m_size];
+    }
+
+    // Move the rest of current line to a new chunk. Already read
+    // lines stays in the old one.
+    size_t offset = 0;
+    if(!m_chunks.empty()) {
+        m_chunks.back().size = m_pos;
+        offset = m_chunks.back().offset + m_pos;
+    }
+
+    m_buffers.push_back(vector<char>(std::max(left + size,
+                                        size_t(BLOCK_SIZE))));
+    char* data = &m_buffers.back()[0];
+    if(left)
+        std::memcpy(data, m_data + m_pos, left);
+
+    Chunk chunk = { offset, left, data };
+    m_chunks.push_back(chunk);
+
+    m_data = data;
+    m_size = left;
+    m_pos = 0;
+    m_lf = string::npos;
+
+    return data + left;
+}
+
+void InputSource::commitBuffer(size_t size)
+{
+    m_size += size;
+    m_chunks.back().size = m_size;
+    m_lf = string::npos;
+}
+
+string InputSource::text(size_t offset, size_t size) const
+{
+    size_t lo = 0, hi = m_chunks.size();
+    while(lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if(m_chunks[mid].offset <= offset) lo = mid + 1;
+        else hi = mid;
+    }
+    if(lo == 0)
+        return string();
+
+    // Chunks are contiguous, a text spanning several lines
+    // may continue in the following chunks
+    string str;
+    for(size_t n = lo-1; n < m_chunks.size() && size > 0; ++n) {
+        const Chunk& chunk = m_chunks[n];
+        size_t pos = offset - chunk.offset;
+        if(pos >= chunk.size)
+            break;
+
+        size_t len = std::min(size, chunk.size - pos);
+        if(str.empty() && len == size)
+            return string(chunk.data + pos, len);
+
+        str.append(chunk.data + pos, len);
+        offset += len;
+        size -= len;
+    }
+    return str;
+}
+
+bool InputSource::nextLine(const char** line, size_t* size)
+{
+    // Scan line until '\n' or '\r' or '\r\n'
+    while(true) {
+        const char* begin = m_data + m_pos;
+        const char* end = m_data + m_size;
+
+        // Position of the next '\n' is cached in order to keep
+        // the scanning linear for files with '\r' line endings
+        if(m_lf == string::npos || m_lf < m_pos) {
+            const char* lf = static_cast<const char*>(
+                                std::memchr(begin, '\n', end - begin));
+            m_lf = lf ? lf - m_data : m_size;
+        }
+
+        const char* stop = m_data + m_lf;
+        const char* cr = static_cast<const char*>(
+                                std::memchr(begin, '\r', stop - begin));
+
+        const char* lineEnd;
+        if(cr) {
+            if(cr+1 < end) {
+                lineEnd = cr[1] == '\n' ? cr+2 : cr+1;
+            } else if(interactive() || !fill()) {
+                lineEnd = cr+1;
+            } else {
+                continue;
+            }
+        } else if(stop < end) {
+            lineEnd = stop+1;
+        } else if(!fill()) {
+            // Check EOF
+            if(begin == end)
+                return false;
+            lineEnd = end;
+        } else {
+            continue;
+        }
+
+        *line = begin;
+        *size = lineEnd - begin;
+        m_pos = lineEnd - m_data;
+        return true;
+    }
+}
+
+InputSource::ptr InputSource::open(const string& fileName)
+{
+    int fd = ::open(fileName.c_str(), O_RDONLY);
+    if(fd < 0)
+        return InputSource::ptr();
+    return InputSource::ptr(new FileInputSource(fd));
+}
+
+StreamInputSource::StreamInputSource(std::istream* stream, bool interactive)
+    : m_streamShared(), m_stream(stream), m_interactive(interactive)
+{
+}
+
+StreamInputSource::StreamInputSource(shared_ptr<std::istream> stream,
+                                        bool interactive)
+    : m_streamShared(stream), m_stream(stream.get()),
+      m_interactive(interactive)
+{
+}
+
+bool StreamInputSource::fill()
+{
+    if(!m_stream->good())
+        return false;
+
+    if(m_interactive) {
+        // Do not wait for more data than one line
+        string line;
+        while(true) {
+            char c = m_stream->get();
+            if(!m_stream->good()) // TODO: handle errors
+                break;
+
+            line.push_back(c);
+            if(c == '\n') {
+                break;
+            } else if(c == '\r') {
+                if(m_stream->peek() == '\n')
+                    line.push_back(char(m_stream->get()));
+                break;
+            }
+        }
+
+        if(line.empty())
+            return false;
+
+        std::memcpy(reserveBuffer(line.size()), line.data(), line.size());
+        commitBuffer(line.size());
+        return true;
+    }
+
+    char* buf = reserveBuffer(BLOCK_SIZE);
+    m_stream->read(buf, BLOCK_SIZE);
+    commitBuffer(m_stream->gcount());
+    return m_stream->gcount() > 0;
+}
+
+FileInputSource::FileInputSource(int fd)
+    : m_fd(fd), m_map(NULL), m_mapSize(0)
+{
+    struct stat st;
+    if(fstat(m_fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+        if(map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            m_map = map;
+            m_mapSize = st.st_size;
+            setData(static_cast<const char*>(m_map), m_mapSize);
+        }
+    }
+}
+
+FileInputSource::~FileInputSource()
+{
+    if(m_map)
+        munmap(m_map, m_mapSize);
+    ::close(m_fd);
+}
+
+bool FileInputSource::fill()
+{
+    if(m_map)
+        return false;
+
+    char* buf = reserveBuffer(BLOCK_SIZE);
+    while(true) {
+        ssize_t len = ::read(m_fd, buf, BLOCK_SIZE);
+        if(len > 0) {
+            commitBuffer(len);
+            return true;
+        } else if(len < 0 && (errno == EAGAIN || errno == EINTR)) {
+            continue;
+        }
+        return false;
+    }
+}
+
+vector<SourceFile*> SourceFile::s_files;
+vector<unsigned> SourceFile::s_freeIds;
+unordered_map<string*, unsigned> SourceFile::s_names;
+string SourceFile::EMPTY_STRING;
+
+unsigned SourceFile::insert(SourceFile* file)
+{
+    // id 0 is reserved for tokens without a file
+    if(s_files.empty())
+        s_files.push_back(NULL);
+
+    unsigned id;
+    if(!s_freeIds.empty()) {
+        id = s_freeIds.back();
+        s_freeIds.pop_back();
+        s_files[id] = file;
+    } else {
+        id = s_files.size();
+        s_files.push_back(file);
+    }
+    return id;
+}
+
+void SourceFile::release(unsigned id)
+{
+    SourceFile* file = s_files[id];
+    if(file->m_kind == NAME)
+        s_names.erase(file->m_name.get());
+
+    s_files[id] = NULL;
+    s_freeIds.push_back(id);
+    delete file;
+}
+
+unsigned SourceFile::create(shared_ptr<string> name, InputSource::ptr input)
+{
+    SourceFile* file = new SourceFile(FILE, name);
+    file->m_input = input;
+    return insert(file);
+}
+
+unsigned SourceFile::create(shared_ptr<string> name, const string& text)
+{
+    if(text.empty())
+        return named(name);
+
+    SourceFile* file = new SourceFile(TEXT, name);
+    file->m_text = text;
+    return insert(file);
+}
+
+unsigned SourceFile::named(shared_ptr<string> name)
+{
+    if(!name)
+        return 0;
+
+    unordered_map<string*, unsigned>::iterator it = s_names.find(name.get());
+    if(it != s_names.end())
+        return it->second;
+
+    unsigned id = insert(new SourceFile(NAME, name));
+    s_names.insert(std::make_pair(name.get(), id));
+    return id;
+}
+
+} // namespace texpp
+
@@ -0,0 +1,170 @@
+/*  This file is part of texpp library.
+    Copyright (C) 2009 Vladimir Kuznetsov <ks.vladimir@gmail.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef __TEXPP_INPUTSOURCE_H
+#define __TEXPP_INPUTSOURCE_H
+
+#include <texpp/common.h>
+
+#include <istream>
+#include <deque>
+
+namespace texpp {
+
+class InputSource
+{
+public:
+    typedef shared_ptr<InputSource> ptr;
+
+    InputSource();
+    virtual ~InputSource() {}
+
+    // Returns next physical line together with its terminator
+    // ('\n', '\r' or "\r\n"). The text of all returned lines is
+    // retained until the source is destroyed.
+    bool nextLine(const char** line, size_t* size);
+
+    // Returns already read text starting at given offset from the
+    // beginning of the input.
+    string text(size_t offset, size_t size) const;
+
+    // Returns true if lines should be requested one by one
+    // (i.e. the source is an interactive terminal)
+    virtual bool interactive() const { return false; }
+
+    // Opens a file: regular files are memory-mapped, everything
+    // else (pipes, devices) is read by large blocks.
+    // Returns empty pointer if the file can not be opened.
+    static InputSource::ptr open(const string& fileName);
+
+protected:
+    // Makes more data available after m_pos, possibly moving the
+    // rest of current line to a new chunk. Returns false on the end
+    // of input.
+    virtual bool fill() { return false; }
+
+    void setData(const char* data, size_t size);
+    char* reserveBuffer(size_t size);
+    void commitBuffer(size_t size);
+
+    enum { BLOCK_SIZE = 65536 };
+
+    struct Chunk {
+        size_t offset;
+        size_t size;
+        const char* data;
+    };
+
+    // The last chunk is the one being read
+    vector<Chunk> m_chunks;
+    std::deque< vector<char> > m_buffers;
+
+    const char* m_data;
+    size_t      m_size;
+    size_t      m_pos;
+    size_t      m_lf;
+};
+
+class StreamInputSource: public InputSource
+{
+public:
+    StreamInputSource(std::istream* stream, bool interactive = false);
+    StreamInputSource(shared_ptr<std::istream> stream,
+                        bool interactive = false);
+
+    bool interactive() const { return m_interactive; }
+
+protected:
+    bool fill();
+
+    shared_ptr<std::istream> m_streamShared;
+    std::istream* m_stream;
+    bool m_interactive;
+};
+
+class FileInputSource: public InputSource
+{
+public:
+    FileInputSource(int fd);
+    ~FileInputSource();
+
+protected:
+    bool fill();
+
+    int     m_fd;
+    void*   m_map;
+    size_t  m_mapSize;
+};
+
+// Registry of texts referenced by tokens. A token stores the id of
+// its SourceFile together with its position in the line instead of
+// a copy of its source. Entries are reference counted by tokens.
+class SourceFile
+{
+public:
+    enum Kind {
+        NAME,       // file name only, source is always empty
+        FILE,       // source is a span of the retained input
+        TEXT        // source is an explicit string
+    };
+
+    Kind kind() const { return m_kind; }
+
+    const string& name() const {
+        return m_name ? *m_name : EMPTY_STRING;
+    }
+    shared_ptr<string> namePtr() const { return m_name; }
+
+    const InputSource::ptr& input() const { return m_input; }
+    const string& text() const { return m_text; }
+
+    static unsigned create(shared_ptr<string> name, InputSource::ptr input);
+    static unsigned create(shared_ptr<string> name, const string& text);
+    static unsigned named(shared_ptr<string> name);
+
+    static const SourceFile& get(unsigned id) { return *s_files[id]; }
+
+    static void ref(unsigned id) { ++s_files[id]->m_refCount; }
+    static void unref(unsigned id) {
+        if(--s_files[id]->m_refCount == 0) release(id);
+    }
+
+protected:
+    SourceFile(Kind kind, shared_ptr<string> name)
+        : m_kind(kind), m_refCount(0), m_name(name) {}
+
+    static unsigned insert(SourceFile* file);
+    static void release(unsigned id);
+
+    Kind                m_kind;
+    unsigned            m_refCount;
+    shared_ptr<string>  m_name;
+    InputSource::ptr    m_input;
+    string              m_text;
+
+    static vector<SourceFile*> s_files;
+    static vector<unsigned> s_freeIds;
+    static unordered_map<string*, unsigned> s_names;
+
+    static string EMPTY_STRING;
+};
+
+} // namespace texpp
+
+#endif
+
@@ -0,0 +1,196 @@
+/*  This file is part of texpp library.
+    Copyright (C) 2009 Vladimir Kuznetsov <ks.vladimir@gmail.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <texpp/intern.h>
+
+#include <boost/foreach.hpp>
+#include <new>
+
+namespace texpp {
+
+bool Intern::s_frozen = false;
+InternOverlay* Intern::s_current = NULL;
+
+namespace {
+
+typedef unordered_map<string, unsigned> InternMap;
+
+InternMap& internMap()
+{
+    static InternMap map;
+    return map;
+}
+
+vector<const string*>* createTable()
+{
+    // Keys of the map are never moved
+    InternMap& map = internMap();
+    vector<const string*>* strings = new vector<const string*>();
+    strings->reserve(1024);
+    for(unsigned n = 0; n < 256; ++n) {
+        strings->push_back(&map.insert(
+                std::make_pair(string(1, char(n)), n)).first->first);
+    }
+    strings->push_back(&map.insert(
+            std::make_pair(string(), unsigned(Intern::EMPTY))).first->first);
+    return strings;
+}
+
+vector<unsigned>& freeSlots()
+{
+    static vector<unsigned>* slots = new vector<unsigned>();
+    return *slots;
+}
+
+// Keeps names interned outside of parsers
+InternOverlay* sharedOverlay()
+{
+    static InternOverlay::ptr* overlay =
+                new InternOverlay::ptr(InternOverlay::create());
+    return overlay->get();
+}
+
+} // namespace
+
+vector<const string*>& Intern::table()
+{
+    static vector<const string*>* strings = createTable();
+    return *strings;
+}
+
+Intern::SlotTable& Intern::slots()
+{
+    // Tokens may outlive static objects
+    static SlotTable* slots = new SlotTable();
+    return *slots;
+}
+
+void Intern::freeze()
+{
+    table();
+    s_frozen = true;
+}
+
+unsigned Intern::lookup(const string& str)
+{
+    vector<const string*>& strings = table();
+    InternMap& map = internMap();
+
+    InternMap::const_iterator it = map.find(str);
+    if(it != map.end())
+        return it->second;
+
+    if(s_frozen)
+        return (s_current ? s_current : sharedOverlay())->id(str);
+
+    unsigned id = strings.size();
+    strings.push_back(&map.insert(std::make_pair(str, id)).first->first);
+    return id;
+}
+
+const string& Intern::overlayStr(unsigned id)
+{
+    const SlotTable::value_type& slot =
+                slots()[(id - OVERLAY_FIRST_ID) >> SLOT_BITS];
+    unsigned n = (slot.second << SLOT_BITS) |
+                 (id & (InternOverlay::chunkSize() - 1));
+    return *slot.first->m_strings[n];
+}
+
+unsigned Intern::allocSlot(InternOverlay* overlay, unsigned chunk)
+{
+    SlotTable& table = slots();
+    vector<unsigned>& freeIds = freeSlots();
+
+    unsigned slot;
+    if(!freeIds.empty()) {
+        slot = freeIds.back();
+        freeIds.pop_back();
+    } else if(table.size() < SLOTS_NUMBER) {
+        slot = table.size();
+        table.push_back(SlotTable::value_type());
+    } else {
+        throw std::bad_alloc();
+    }
+
+    table[slot] = std::make_pair(overlay, chunk);
+    return OVERLAY_FIRST_ID + (slot << SLOT_BITS);
+}
+
+void Intern::releaseSlot(unsigned slot)
+{
+    slots()[slot] = SlotTable::value_type();
+    freeSlots().push_back(slot);
+}
+
+////////// InternOverlay
+
+InternOverlay::ptr InternOverlay::create()
+{
+    InternOverlay::ptr overlay(new InternOverlay);
+    overlay->m_firstId = Intern::allocSlot(overlay.get(), 0);
+    overlay->m_chunks.push_back(overlay->m_firstId);
+    return overlay;
+}
+
+InternOverlay::~InternOverlay()
+{
+    BOOST_FOREACH(unsigned id, m_chunks)
+        Intern::releaseSlot((id - Intern::OVERLAY_FIRST_ID)
+                                        >> Intern::SLOT_BITS);
+}
+
+bool InternOverlay::find(const string& str, unsigned& id) const
+{
+    for(size_t n = m_parents.size(); n-- > 0;)
+        if(m_parents[n]->find(str, id)) return true;
+
+    Intern::InternMap::const_iterator it = m_map.find(str);
+    if(it == m_map.end())
+        return false;
+    id = it->second;
+    return true;
+}
+
+unsigned InternOverlay::id(const string& str)
+{
+    unsigned id;
+    if(find(str, id))
+        return id;
+
+    unsigned n = m_strings.size();
+    if((n >> Intern::SLOT_BITS) == m_chunks.size())
+        m_chunks.push_back(Intern::allocSlot(this, m_chunks.size()));
+
+    id = m_chunks[n >> Intern::SLOT_BITS] | (n & (chunkSize() - 1));
+    m_strings.push_back(&m_map.insert(std::make_pair(str, id)).first->first);
+    return id;
+}
+
+bool InternOverlay::containsOverlay(unsigned id) const
+{
+    const InternOverlay* overlay = Intern::overlay(id);
+    if(overlay == this)
+        return true;
+    BOOST_FOREACH(const InternOverlay::ptr& parent, m_parents)
+        if(parent->containsOverlay(id)) return true;
+    return false;
+}
+
+} // namespace texpp
+
@@ -0,0 +1,162 @@
+/*  This file is part of texpp library.
+    Copyright (C) 2009 Vladimir Kuznetsov <ks.vladimir@gmail.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef __TEXPP_INTERN_H
+#define __TEXPP_INTERN_H
+
+#include <texpp/common.h>
+
+#include <boost/intrusive_ptr.hpp>
+
+namespace texpp {
+
+class InternOverlay;
+void intrusive_ptr_add_ref(InternOverlay* overlay);
+void intrusive_ptr_release(InternOverlay* overlay);
+
+// Table of interned strings. Names interned until the initial symbols
+// of the first parser are set up form a shared base which is not
+// changed afterwards. Later names are kept in the overlay of the
+// current parser (see InternScope) and released with the parser and
+// the last token using them, so equal strings get equal ids only
+// within one parser. Names interned outside of parsers go to a
+// process-wide overlay. Ids of one-character strings are the
+// character codes themselves.
+class Intern
+{
+public:
+    enum { EMPTY = 256 };
+
+    static unsigned id(char c) { return (unsigned char) c; }
+    static unsigned id(const string& str) {
+        return str.size() == 1 ? id(str[0]) : lookup(str);
+    }
+
+    static const string& str(unsigned id) {
+        return isShared(id) ? *table()[id] : overlayStr(id);
+    }
+
+    // Ids of the shared base are not reference counted
+    static bool isShared(unsigned id) { return id < OVERLAY_FIRST_ID; }
+    static void ref(unsigned id) { intrusive_ptr_add_ref(overlay(id)); }
+    static void unref(unsigned id) { intrusive_ptr_release(overlay(id)); }
+
+    // Returns the overlay keeping the name of a non-shared id
+    static InternOverlay* overlay(unsigned id) {
+        return slots()[(id - OVERLAY_FIRST_ID) >> SLOT_BITS].first;
+    }
+
+    // Later names are interned into overlays
+    static void freeze();
+
+protected:
+    enum { OVERLAY_FIRST_ID = 0x01000000, SLOT_BITS = 16,
+           SLOTS_NUMBER = (0x80000000u - OVERLAY_FIRST_ID) >> SLOT_BITS };
+
+    typedef unordered_map<string, unsigned> InternMap;
+    typedef vector< pair<InternOverlay*, unsigned> > SlotTable;
+
+    static unsigned lookup(const string& str);
+    static const string& overlayStr(unsigned id);
+    static vector<const string*>& table();
+
+    // Slots are ranges of ids given to overlays, each one keeps
+    // the overlay and the number of the chunk of its names
+    static SlotTable& slots();
+    static unsigned allocSlot(InternOverlay* overlay, unsigned chunk);
+    static void releaseSlot(unsigned slot);
+
+    static bool s_frozen;
+    static InternOverlay* s_current;
+
+    friend class InternOverlay;
+    friend class InternScope;
+};
+
+// Names interned by one parser or format image on top of the shared
+// base. Names of the parent overlays are looked up first, the most
+// recently added parent first, and they are not copied
+class InternOverlay
+{
+public:
+    typedef boost::intrusive_ptr<InternOverlay> ptr;
+
+    static InternOverlay::ptr create();
+    ~InternOverlay();
+
+    void addParent(InternOverlay::ptr parent) { m_parents.push_back(parent); }
+
+    unsigned id(const string& str);
+
+    // Returns true if the id is shared or kept in this overlay
+    // or its parents
+    bool contains(unsigned id) const {
+        return Intern::isShared(id) || containsOverlay(id);
+    }
+
+    // Ids of the overlay start with firstId(), the ids of the first
+    // names are contiguous
+    unsigned firstId() const { return m_firstId; }
+    static unsigned chunkSize() { return 1u << Intern::SLOT_BITS; }
+
+protected:
+    InternOverlay(): m_refCount(0), m_firstId(0) {}
+
+    bool find(const string& str, unsigned& id) const;
+    bool containsOverlay(unsigned id) const;
+
+    unsigned                    m_refCount;
+    unsigned                    m_firstId;
+    vector<InternOverlay::ptr>  m_parents;
+    Intern::InternMap           m_map;
+    vector<const string*>       m_strings;
+    vector<unsigned>            m_chunks;
+
+    friend class Intern;
+    friend void intrusive_ptr_add_ref(InternOverlay* overlay);
+    friend void intrusive_ptr_release(InternOverlay* overlay);
+};
+
+// Names are interned into the overlay while the scope exists
+class InternScope
+{
+public:
+    InternScope(InternOverlay* overlay): m_previous(Intern::s_current) {
+        Intern::s_current = overlay;
+    }
+    ~InternScope() { Intern::s_current = m_previous; }
+
+protected:
+    InternOverlay* m_previous;
+};
+
+inline void intrusive_ptr_add_ref(InternOverlay* overlay)
+{
+    ++overlay->m_refCount;
+}
+
+inline void intrusive_ptr_release(InternOverlay* overlay)
+{
+    if(--overlay->m_refCount == 0)
+        delete overlay;
+}
+
+} // namespace texpp
+
+#endif
+
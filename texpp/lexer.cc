@@ -24,34 +24,58 @@ namespace texpp {
 
 Lexer::Lexer(const string& fileName, std::istream* file,
                 bool interactive, bool saveLines)
-    : m_fileShared(), m_file(file),
-      m_fileName(new string(fileName)),
+    : m_fileName(new string(fileName)),
       m_linePos(0), m_lineNo(0), m_charPos(0), m_charEnd(0),
       m_state(ST_NEW_LINE), m_char(-1), m_catCode(Token::CC_NONE),
       m_interactive(interactive), m_saveLines(saveLines)
 {
-    if(!m_file) { m_file = &std::cin; }
+    if(!file) { file = &std::cin; }
+    m_source = InputSource::ptr(new StreamInputSource(file,
+                    interactive && file == &std::cin));
     init();
 }
 
 Lexer::Lexer(const string& fileName, shared_ptr<std::istream> file,
                     bool interactive, bool saveLines)
-    : m_fileShared(file), m_file(file.get()),
-      m_fileName(new string(fileName)),
+    : m_fileName(new string(fileName)),
       m_linePos(0), m_lineNo(0), m_charPos(0), m_charEnd(0),
       m_state(ST_NEW_LINE), m_char(-1), m_catCode(Token::CC_NONE),
       m_interactive(interactive), m_saveLines(saveLines)
 {
-    if(!m_file) { m_file = &std::cin; }
+    if(file) {
+        m_source = InputSource::ptr(new StreamInputSource(file,
+                        interactive && file.get() == &std::cin));
+    } else {
+        m_source = InputSource::ptr(
+                        new StreamInputSource(&std::cin, interactive));
+    }
+    init();
+}
+
+Lexer::Lexer(const string& fileName, InputSource::ptr source,
+                    bool interactive, bool saveLines)
+    : m_source(source), m_fileName(new string(fileName)),
+      m_linePos(0), m_lineNo(0), m_charPos(0), m_charEnd(0),
+      m_state(ST_NEW_LINE), m_char(-1), m_catCode(Token::CC_NONE),
+      m_interactive(interactive), m_saveLines(saveLines)
+{
+    if(!m_source) {
+        m_source = InputSource::ptr(
+                        new StreamInputSource(&std::cin, interactive));
+    }
     init();
 }
 
 Lexer::~Lexer()
 {
+    SourceFile::unref(m_file);
 }
 
 void Lexer::init()
 {
+    m_file = SourceFile::create(m_fileName, m_source);
+    SourceFile::ref(m_file);
+
     m_endlinechar = '\r';
     for(int i=0; i<256; ++i)
         m_catcode[i] = Token::CC_OTHER;
@@ -82,11 +106,15 @@ string Lexer::jobName() const
     return jobname;
 }
 
-const string& Lexer::line(size_t n) const
+string Lexer::line(size_t n) const
 {
-    static string EMPTY_LINE;
-    if(n-1 < m_lines.size()) return m_lines[n-1];
-    else return EMPTY_LINE;
+    if(n-1 < m_lines.size()) {
+        size_t end = n < m_lines.size() ? m_lines[n] :
+                            m_linePos + m_lineOrig.size();
+        return m_source->text(m_lines[n-1], end - m_lines[n-1]);
+    } else {
+        return string();
+    }
 }
 
 bool Lexer::nextLine()
@@ -100,34 +128,21 @@ bool Lexer::nextLine()
     m_linePos += m_lineOrig.size();
     m_lineOrig.clear();
 
-    if(m_interactive && m_file == &std::cin) {
+    if(m_interactive && m_source->interactive()) {
         std::cout << "*";
     }
 
-    // Scan line until '\n' or '\r' or '\r\n'
-    while(true) {
-        char c = m_file->get();
-        if(!m_file->good()) // TODO: handle errors
-            break;
-
-        m_lineOrig.push_back(c);
-        if(c == '\n') {
-            break;
-        } else if(c == '\r') {
-            if(m_file->peek() == '\n')
-                m_lineOrig.push_back(char(m_file->get()));
-            break;
-        }
-    }
-
-    // Check EOF
-    if(m_lineOrig.empty()) {
+    const char* line;
+    size_t size;
+    if(!m_source->nextLine(&line, &size)) {
         m_lineTex.clear();
         return false;
     }
 
+    m_lineOrig.assign(line, size);
+
     if(m_saveLines)
-        m_lines.push_back(m_lineOrig);
+        m_lines.push_back(m_linePos);
 
     // Discard spaces at the end
     size_t end = m_lineOrig.find_last_not_of(" \r\n");
@@ -188,17 +203,18 @@ bool Lexer::nextChar()
 inline Token::ptr Lexer::newToken(Token::Type type,
                                 const string& value)
 {
-    return Token::create(
+    Token::ptr token = Token::create(
         type, m_catCode, 
         value.empty() && m_char >= 0 ? string(1, m_char) : value,
-        m_lineOrig.substr(std::min(m_charPos, m_lineOrig.size()),
-                    m_charEnd - m_charPos),
+                string(),
                 m_linePos,
                 m_lineNo,
                 std::min(m_charPos, m_lineOrig.size()),
                 std::min(m_charEnd, m_lineOrig.size()),
-                m_charEnd >= m_lineTex.size(),
-                m_fileName);
+                m_charEnd >= m_lineTex.size());
+    // The source is a span of the line in the retained input
+    token->setFile(m_file);
+    return token;
 }
 
 Token::ptr Lexer::nextToken()
@@ -260,9 +276,6 @@ Token::ptr Lexer::nextToken()
                 while(nextChar() && m_catCode == Token::CC_SPACE) {}
                 m_charEnd = m_charPos;
                 token->setCharEnd(std::min(m_charEnd, m_lineOrig.size()));
-                token->setSource(m_lineOrig.substr(
-                    std::min(token->charPos(), m_lineOrig.size()),
-                    token->charEnd() - token->charPos()));
                 return token;
             }
         }
@@ -291,9 +304,6 @@ Token::ptr Lexer::nextToken()
 
                     token->setValue(value);
                     token->setCharEnd(std::min(m_charEnd, m_lineOrig.size()));
-                    token->setSource(m_lineOrig.substr(
-                        std::min(token->charPos(), m_lineOrig.size()),
-                        token->charEnd() - token->charPos()));
                 }
 
                 return token;
@@ -21,8 +21,10 @@
 
 #include <texpp/common.h>
 #include <texpp/token.h>
+#include <texpp/inputsource.h>
 
 #include <istream>
+#include <algorithm>
 
 namespace texpp {
 
@@ -36,6 +38,8 @@ public:
                 bool interactive = false, bool saveLines = false);
     Lexer(const string& fileName, shared_ptr<std::istream> file,
                 bool interactive = false, bool saveLines = false);
+    Lexer(const string& fileName, InputSource::ptr source,
+                bool interactive = false, bool saveLines = false);
     ~Lexer();
 
     Token::ptr nextToken();
@@ -49,7 +53,7 @@ public:
     size_t linePos() const { return m_linePos; }
     size_t lineNo() const { return m_lineNo; }
     const string& line() const { return m_lineOrig; }
-    const string& line(size_t n) const;
+    string line(size_t n) const;
 
     int endlinechar() const { return m_endlinechar; }
     void setEndlinechar(int endlinechar) { m_endlinechar = endlinechar; }
@@ -57,6 +61,12 @@ public:
     int catcode(int ch) const { return m_catcode[ch]; }
     void setCatcode(int ch, int code) { m_catcode[ch] = code; }
 
+    // Copies catcodes and endlinechar from another lexer
+    void copyCodes(const Lexer& lexer) {
+        std::copy(lexer.m_catcode, lexer.m_catcode + 256, m_catcode);
+        m_endlinechar = lexer.m_endlinechar;
+    }
+
 protected:
     void init();
 
@@ -75,10 +85,9 @@ protected:
         ST_MIDDLE = 4
     };
 
-    shared_ptr<std::istream> m_fileShared;
-
-    std::istream*   m_file;
+    InputSource::ptr m_source;
     shared_ptr<string> m_fileName;
+    unsigned m_file;
 
     string  m_lineOrig;
     string  m_lineTex;
@@ -99,7 +108,7 @@ protected:
     bool    m_interactive;
     bool    m_saveLines;
 
-    vector<string> m_lines;
+    vector<size_t> m_lines;
 };
 
 } // namespace
@@ -56,7 +56,7 @@ string Logger::tokenLines(Parser& parser, Token::ptr token) const
     else r << "l." << token->lineNo() << " ";
 
     if(token->fileName() == parser.lexer()->fileName()) {
-        const string& line = parser.lexer()->line(token->lineNo());
+        string line = parser.lexer()->line(token->lineNo());
         if(!line.empty()) {
             string line1 = line.substr(0, token->charEnd());
             if(!line1.empty() && line1[line1.size()-1] == '\n')
@@ -87,7 +87,7 @@ bool ConsoleLogger::log(Level level, const string& message,
                             Parser& parser, Token::ptr token)
 {
     /*
-    if(level <= TRACING && parser.symbol("tracingonline", int(0)) <= 0)
+    if(level <= TRACING && parser.tracingonline() <= 0)
         return true;
     */
 
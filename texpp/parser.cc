@@ -30,18 +30,25 @@
 #include <texpp/base/box.h>
 #include <texpp/base/misc.h>
 #include <texpp/base/files.h>
+#include <texpp/base/format.h>
 
 #include <iostream>
-#include <fstream>
 #include <sstream>
+#include <fstream>
 #include <iomanip>
 #include <climits>
+#include <cctype>
+#include <cstdlib>
+#include <cstdio>
 #include <cassert>
 #include <iterator>
+#include <algorithm>
 #include <unistd.h>
 #include <ctime>
 
 #include <boost/foreach.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/pool/pool_alloc.hpp>
 #include <boost/algorithm/string.hpp>
 
 namespace {
@@ -64,11 +71,40 @@ string Parser::BANNER = "This is TeXpp, Version 0.0";
 
 using base::Dimen;
 
+Node::~Node()
+{
+    if(m_children.empty())
+        return;
+
+    // Subtrees are released iteratively, destroying them recursively
+    // could exhaust the stack for deeply nested documents
+    ChildrenList children;
+    children.swap(m_children);
+    vector<Node::ptr> pending;
+    while(true) {
+        BOOST_FOREACH(ChildrenList::value_type& c, children) {
+            if(c.second.unique()) {
+                pending.push_back(Node::ptr());
+                pending.back().swap(c.second);
+            }
+        }
+        children.clear();
+
+        if(pending.empty())
+            break;
+
+        Node::ptr node;
+        node.swap(pending.back());
+        pending.pop_back();
+        children.swap(node->m_children);
+    }
+}
+
 const string& Node::valueString() const
 {
     static const string empty;
-    if(m_value.type() != typeid(string)) return empty;
-    else return *unsafe_any_cast<string>(&m_value);
+    const string* v = any_cast<string>(&m_value);
+    return v ? *v : empty;
 }
 
 Node::ptr Node::child(const string& name)
@@ -122,18 +158,30 @@ string Node::treeRepr(size_t indent) const
     return str;
 }
 
+Node::ptr Node::create(const string& type)
+{
+    return boost::allocate_shared<Node>(boost::fast_pool_allocator<Node,
+                boost::default_user_allocator_new_delete,
+                boost::details::pool::default_mutex, 1024, 65536>(), type);
+}
+
 string Node::source(const string& fileName) const
 {
     string str;
-    BOOST_FOREACH(Token::ptr token, m_tokens) {
+    appendSource(str, fileName);
+    return str;
+}
+
+void Node::appendSource(string& str, const string& fileName) const
+{
+    BOOST_FOREACH(const Token::ptr& token, m_tokens) {
         if(fileName.empty() || token->fileName() == fileName)
             str += token->source();
     }
     typedef pair<string, Node::ptr> C;
-    BOOST_FOREACH(C c, m_children) {
-        str += c.second->source(fileName);
+    BOOST_FOREACH(const C& c, m_children) {
+        c.second->appendSource(str, fileName);
     }
-    return str;
 }
 
 unordered_map<shared_ptr<string>,string> Node::sources() const
@@ -229,11 +277,16 @@ Parser::Parser(const string& fileName, std::istream* file,
         const string& workdir, bool interactive, bool ignoreEmergency,
         shared_ptr<Logger> logger)
     : m_workdir(workdir), m_ignoreEmergency(ignoreEmergency),
-      m_logger(logger), m_groupLevel(0),
+      m_expansionMode(EXPANSION_FULL),
+      m_logger(logger), m_category(Token::CC_NONE), m_groupLevel(0),
       m_end(false), m_endinput(false), m_endinputNow(false),
       m_lineNo(1), m_mode(NULLMODE), m_prevMode(NULLMODE),
-      m_hasOutput(false), m_currentGroupType(GROUP_DOCUMENT),
+      m_hasOutput(false), m_spacefactor(0),
+      m_tracingcommands(0), m_tracingmacros(0),
+      m_tracingrestores(0), m_tracingonline(0),
+      m_currentGroupType(GROUP_DOCUMENT),
       m_customGroupBegin(false), m_customGroupEnd(false),
+      m_expansionDepth(0), m_maxExpansionDepth(MAX_EXPANSION_DEPTH),
       m_interaction(ERRORSTOPMODE)
 {
     m_lexer = shared_ptr<Lexer>(new Lexer(fileName, file, interactive, true));
@@ -244,17 +297,42 @@ Parser::Parser(const string& fileName, shared_ptr<std::istream> file,
         const string& workdir, bool interactive, bool ignoreEmergency,
         shared_ptr<Logger> logger)
     : m_workdir(workdir), m_ignoreEmergency(ignoreEmergency),
-      m_logger(logger), m_groupLevel(0),
+      m_expansionMode(EXPANSION_FULL),
+      m_logger(logger), m_category(Token::CC_NONE), m_groupLevel(0),
       m_end(false), m_endinput(false), m_endinputNow(false),
       m_lineNo(1), m_mode(NULLMODE), m_prevMode(NULLMODE),
-      m_hasOutput(false), m_currentGroupType(GROUP_DOCUMENT),
+      m_hasOutput(false), m_spacefactor(0),
+      m_tracingcommands(0), m_tracingmacros(0),
+      m_tracingrestores(0), m_tracingonline(0),
+      m_currentGroupType(GROUP_DOCUMENT),
       m_customGroupBegin(false), m_customGroupEnd(false),
+      m_expansionDepth(0), m_maxExpansionDepth(MAX_EXPANSION_DEPTH),
       m_interaction(ERRORSTOPMODE)
 {
     m_lexer = shared_ptr<Lexer>(new Lexer(fileName, file, interactive, true));
     init();
 }
 
+Parser::Parser(const string& fileName, InputSource::ptr source,
+        const string& workdir, bool interactive, bool ignoreEmergency,
+        shared_ptr<Logger> logger)
+    : m_workdir(workdir), m_ignoreEmergency(ignoreEmergency),
+      m_expansionMode(EXPANSION_FULL),
+      m_logger(logger), m_category(Token::CC_NONE), m_groupLevel(0),
+      m_end(false), m_endinput(false), m_endinputNow(false),
+      m_lineNo(1), m_mode(NULLMODE), m_prevMode(NULLMODE),
+      m_hasOutput(false), m_spacefactor(0),
+      m_tracingcommands(0), m_tracingmacros(0),
+      m_tracingrestores(0), m_tracingonline(0),
+      m_currentGroupType(GROUP_DOCUMENT),
+      m_customGroupBegin(false), m_customGroupEnd(false),
+      m_expansionDepth(0), m_maxExpansionDepth(MAX_EXPANSION_DEPTH),
+      m_interaction(ERRORSTOPMODE)
+{
+    m_lexer = shared_ptr<Lexer>(new Lexer(fileName, source, interactive, true));
+    init();
+}
+
 void Parser::init()
 {
     if(!m_logger)
@@ -262,8 +340,53 @@ void Parser::init()
                         shared_ptr<Logger>(new ConsoleLogger) :
                         shared_ptr<Logger>(new NullLogger);
 
-    base::initSymbols(*this);
-    
+    m_names = InternOverlay::create();
+    m_formatFirstId = 0;
+
+    InitialSymbols& initial = initialSymbols();
+    if(!initial.ready) {
+        base::initSymbols(*this);
+
+        unsigned size = 0;
+        BOOST_FOREACH(const SymbolMap::value_type& item, m_extraSymbols)
+            size = std::max(size, item.first + 1);
+        growSymbols(m_symbols, 0, size);
+
+        initial.symbols = m_symbols;
+        for(int t = 0; t < REGISTER_TYPES_NUMBER; ++t) {
+            initial.registers[t] = m_registers[t];
+            initial.registerDefaults[t] = m_registerDefaults[t];
+        }
+        for(unsigned id = m_symbols.size(); id-- > 0;) {
+            const Command::ptr* cmd =
+                        any_cast<Command::ptr>(&m_symbols[id].second);
+            if(cmd && *cmd) initial.primitives[cmd->get()] = id;
+        }
+        initial.ready = true;
+
+        // Names of later parsers are kept in their own overlays. Names
+        // used by the parser itself should stay in the shared base
+        Intern::id("activemag");
+        Intern::freeze();
+
+    } else {
+        m_symbols = initial.symbols;
+        for(int t = 0; t < REGISTER_TYPES_NUMBER; ++t) {
+            m_registers[t] = initial.registers[t];
+            m_registerDefaults[t] = initial.registerDefaults[t];
+        }
+
+        // Catcodes and endlinechar are mirrored in the lexer
+        for(int n = 0; n < 256; ++n) {
+            unsigned id = registerId(REGISTER_CATCODE, n);
+            setSpecialSymbol(id, symbolAny(id));
+        }
+        unsigned id = symbolId("endlinechar");
+        setSpecialSymbol(id, symbolAny(id));
+    }
+
+    base::initDateTime(*this);
+
     string banner = BANNER;
     if(!lexer()->interactive()) {
         char t[256];
@@ -285,53 +408,212 @@ const string& Parser::modeName() const
 
 any Parser::EMPTY_ANY;
 
-const any& Parser::symbolAny(const string& name) const
+Parser::InitialSymbols& Parser::initialSymbols()
 {
-    SymbolTable::const_iterator it = m_symbols.find(name);
-    if(it != m_symbols.end())
-        return it->second.second;
-    return EMPTY_ANY;
+    static InitialSymbols initial;
+    return initial;
 }
 
-void Parser::setSymbol(const string& name, const any& value, bool global)
+Command::ptr Parser::primitive(const string& name)
 {
-    SymbolTable::iterator it = m_symbols.insert(
-        std::make_pair(name, std::make_pair(0, any()))).first;
+    const InitialSymbols& initial = initialSymbols();
+    unsigned id = symbolId(name);
+    if(!isRegisterId(id) && id < initial.symbols.size()) {
+        const Command::ptr* cmd =
+                    any_cast<Command::ptr>(&initial.symbols[id].second);
+        if(cmd) return *cmd;
+    }
+    return Command::ptr();
+}
 
-    if(!global && it->second.first != m_groupLevel) {
-        m_symbolsStack.push_back(std::make_pair(name, it->second));
-        it->second.first = m_groupLevel;
-    } else if(global && it->second.first >= 0) {
-        it->second.first = -1;
-    }
-    it->second.second = value;
-    setSpecialSymbol(name, value);
+string Parser::primitiveName(const Command::ptr& command)
+{
+    const InitialSymbols& initial = initialSymbols();
+    unordered_map<const Command*, unsigned>::const_iterator it =
+                                initial.primitives.find(command.get());
+    return it != initial.primitives.end() ? symbolName(it->second) : string();
 }
 
-void Parser::setSymbolDefault(const string& name, const any& defaultValue)
+namespace {
+const char* registerNames[Parser::REGISTER_TYPES_NUMBER] = {
+    "count", "dimen", "skip", "muskip", "toks", "box", "wd", "ht", "dp",
+    "catcode", "lccode", "uccode", "sfcode", "mathcode", "delcode"
+};
+} // namespace
+
+unsigned Parser::symbolId(const string& name)
 {
-    pair<SymbolTable::iterator, bool> p = m_symbols.insert(
-        std::make_pair(name, std::make_pair(0, any())));
+    // Register names ("count12") are mapped to their banks
+    size_t n = name.size();
+    while(n > 0 && std::isdigit((unsigned char) name[n-1])) --n;
+    if(n > 0 && n < name.size() && name.size() - n <= 5 &&
+            (name[n] != '0' || n + 1 == name.size())) {
+        int num = std::atoi(name.c_str() + n);
+        for(int t = 0; t < REGISTER_TYPES_NUMBER; ++t) {
+            if(num < REGISTERS_NUMBER &&
+                    name.compare(0, n, registerNames[t]) == 0)
+                return registerId(RegisterType(t), num);
+        }
+    }
+    return Intern::id(name);
+}
 
-    if(p.second) // new item
-        p.first->second = std::make_pair(0, defaultValue);
+string Parser::symbolName(unsigned id)
+{
+    if(isRegisterId(id))
+        return registerNames[registerType(id)] +
+            boost::lexical_cast<string>(registerNumber(id));
+    return Intern::str(id);
 }
 
-void Parser::setSpecialSymbol(const string& name, const any& value)
+void Parser::setRegisterDefault(RegisterType type, const any& value)
 {
-    if(value.type() == typeid(int)) {
-        if(name == "endlinechar") {
-            m_lexer->setEndlinechar(*unsafe_any_cast<int>(&value));
-        } else if(name.substr(0, 7) == "catcode") {
-            std::istringstream s(name.substr(7));
-            int n = 0; s >> n;
-            if(!s.fail() && n >= 0 && n <= 255) {
-                m_lexer->setCatcode(n, *unsafe_any_cast<int>(&value));
-            }
+    m_registerDefaults[type] = value;
+    SymbolTable& bank = m_registers[type];
+    for(SymbolTable::iterator it = bank.begin(); it != bank.end(); ++it)
+        if(it->first == SYMBOL_UNDEFINED) it->second = value;
+}
+
+const any& Parser::symbolAny(unsigned id) const
+{
+    if(isRegisterId(id)) {
+        const SymbolTable& bank = m_registers[registerType(id)];
+        unsigned n = registerNumber(id);
+        if(n < bank.size())
+            return bank[n].second;
+        return m_registerDefaults[registerType(id)];
+    }
+    const SymbolTable::value_type* entry = findSymbol(id);
+    if(!entry)
+        return EMPTY_ANY;
+    return entry->first != SYMBOL_FORMAT ? entry->second
+                                         : formatValue(entry->second);
+}
+
+const Parser::SymbolTable::value_type* Parser::findSymbol(unsigned id) const
+{
+    if(id < m_symbols.size())
+        return &m_symbols[id];
+    if(id - m_formatFirstId < m_formatSymbols.size())
+        return &m_formatSymbols[id - m_formatFirstId];
+    SymbolMap::const_iterator it = m_extraSymbols.find(id);
+    return it != m_extraSymbols.end() ? &it->second : NULL;
+}
+
+void Parser::growSymbols(SymbolTable& table, unsigned firstId, unsigned size)
+{
+    // Moves the symbols with ids from firstId to firstId + size
+    // to the dense table
+    if(size <= table.size())
+        return;
+    table.resize(size, std::make_pair(int(SYMBOL_UNDEFINED), EMPTY_ANY));
+    for(SymbolMap::iterator it = m_extraSymbols.begin();
+                            it != m_extraSymbols.end();) {
+        if(it->first - firstId < size) {
+            table[it->first - firstId] = it->second;
+            m_extraSymbols.erase(it++);
+        } else {
+            ++it;
         }
     }
 }
 
+Parser::SymbolTable::reference Parser::symbolEntry(unsigned id)
+{
+    SymbolTable::pointer ptr;
+    if(isRegisterId(id)) {
+        SymbolTable& bank = m_registers[registerType(id)];
+        unsigned n = registerNumber(id);
+        if(n >= bank.size())
+            bank.resize(std::max(n + 1, unsigned(bank.size() * 2)),
+                std::make_pair(int(SYMBOL_UNDEFINED),
+                               m_registerDefaults[registerType(id)]));
+        ptr = &bank[n];
+    } else if(id < m_symbols.size()) {
+        ptr = &m_symbols[id];
+    } else if(id - m_formatFirstId < m_formatSymbols.size()) {
+        ptr = &m_formatSymbols[id - m_formatFirstId];
+    } else {
+        ptr = &m_extraSymbols.insert(std::make_pair(id,
+            std::make_pair(int(SYMBOL_UNDEFINED), EMPTY_ANY))).first->second;
+    }
+
+    SymbolTable::reference entry = *ptr;
+    if(entry.first == SYMBOL_UNDEFINED) {
+        entry.first = 0;
+    } else if(entry.first == SYMBOL_FORMAT) {
+        // Values of the format are copied when they are changed
+        entry.second = formatValue(entry.second);
+        entry.first = 0;
+    }
+    return entry;
+}
+
+void Parser::setSymbol(unsigned id, const any& value, bool global)
+{
+    SymbolTable::reference entry = symbolEntry(id);
+
+    if(!global && entry.first != m_groupLevel) {
+        m_symbolsStack.push_back(std::make_pair(id, entry));
+        entry.first = m_groupLevel;
+    } else if(global && entry.first >= 0) {
+        entry.first = -1;
+    }
+    entry.second = value;
+    setSpecialSymbol(id, value);
+    m_categoryToken.reset();
+}
+
+void Parser::setSymbolDefault(unsigned id, const any& defaultValue)
+{
+    const SymbolTable::value_type* entry;
+    if(isRegisterId(id)) {
+        const SymbolTable& bank = m_registers[registerType(id)];
+        unsigned n = registerNumber(id);
+        entry = n < bank.size() ? &bank[n] : NULL;
+    } else {
+        entry = findSymbol(id);
+    }
+    if(!entry || entry->first == SYMBOL_UNDEFINED) // new item
+        symbolEntry(id).second = defaultValue;
+}
+
+void Parser::setSpecialSymbol(unsigned id, const any& value)
+{
+    // Catcodes and endlinechar are mirrored in the active lexer,
+    // tracing parameters are mirrored in the parser fields
+    static const unsigned endlinecharId = Intern::id("endlinechar");
+    static const unsigned tracingcommandsId = Intern::id("tracingcommands");
+    static const unsigned tracingmacrosId = Intern::id("tracingmacros");
+    static const unsigned tracingrestoresId = Intern::id("tracingrestores");
+    static const unsigned tracingonlineId = Intern::id("tracingonline");
+
+    const int* v = any_cast<int>(&value);
+
+    if(isRegisterId(id)) {
+        if(v && registerType(id) == REGISTER_CATCODE &&
+                registerNumber(id) <= 255)
+            m_lexer->setCatcode(registerNumber(id), *v);
+    } else if(id == endlinecharId) {
+        if(v) m_lexer->setEndlinechar(*v);
+    } else if(id == tracingcommandsId) {
+        m_tracingcommands = v ? *v : 0;
+    } else if(id == tracingmacrosId) {
+        m_tracingmacros = v ? *v : 0;
+    } else if(id == tracingrestoresId) {
+        m_tracingrestores = v ? *v : 0;
+    } else if(id == tracingonlineId) {
+        m_tracingonline = v ? *v : 0;
+    }
+}
+
+string Parser::escapestr() const
+{
+    static const unsigned escapecharId = Intern::id("escapechar");
+    int e = symbol(escapecharId, int(0));
+    return e >= 0 && e <= 255 ? string(1, e) : string();
+}
+
 void Parser::beginGroup()
 {
     m_symbolsStackLevels.push_back(m_symbolsStack.size());
@@ -352,16 +634,17 @@ void Parser::endGroup()
                                 m_symbolsStackLevels.back();
     while(m_symbolsStack.size() > symbolsStackLevels) {
         SymbolStack::reference item = m_symbolsStack.back();
-        SymbolTable::iterator it = m_symbols.find(item.first);
+        SymbolTable::reference entry = symbolEntry(item.first);
 
-        int l = it->second.first;
+        int l = entry.first;
 
         if(l >= 0) {
-            it->second = item.second;
-            setSpecialSymbol(it->first, it->second.second);
+            entry = item.second;
+            setSpecialSymbol(item.first, entry.second);
+            m_categoryToken.reset();
         }
 
-        if(symbol("tracingrestores", int(0)) > 0) {
+        if(m_tracingrestores > 0) {
             string str;
             any value;
 
@@ -370,40 +653,40 @@ void Parser::endGroup()
                 value = item.second.second;
             } else {
                 str = "retaining ";
-                value = it->second.second;
+                value = entry.second;
             }
 
             string escape = escapestr();
-            if(item.first == "font")
+            string name = symbolName(item.first);
+            if(name == "font")
                 str += "current font";
-            else if(item.first.size() > 0 && item.first[0] == '\\')
-                str += escape + item.first.substr(1);
-            else if(item.first.size() > 0 && item.first[0] == '`')
-                str += item.first.substr(1);
+            else if(name.size() > 0 && name[0] == '\\')
+                str += escape + name.substr(1);
+            else if(name.size() > 0 && name[0] == '`')
+                str += name.substr(1);
             else
-                str += escape + item.first;
+                str += escape + name;
 
             str += "=";
 
             if(value.empty()) {
                 str += "undefined";
-            } else if(value.type() == typeid(Command::ptr)) {
+            } else if(value.is<Command::ptr>()) {
                 Command::ptr cmd = *unsafe_any_cast<Command::ptr>(&value);
-                shared_ptr<base::UserMacro> m =
-                    dynamic_pointer_cast<base::UserMacro >(cmd);
-                if(m) {
-                    str += m->texRepr(this, false, 38);
+                if(cmd && cmd->hasFlags(Command::USER_MACRO)) {
+                    str += static_cast<base::UserMacro*>(cmd.get())
+                                ->texRepr(this, false, 38);
                             //60 > str.length() ? 60-str.length() : 1);
                 } else {
                     str += (cmd ? cmd->texRepr(this) : "undefined");
                 }
                 //std::remove_copy(r.begin(), r.end(),
                 //        std::back_inserter(str), '\n');
-            } else if(value.type() == typeid(base::ParshapeInfo)) {
+            } else if(value.is<base::ParshapeInfo>()) {
                 str += boost::lexical_cast<string>(
                     unsafe_any_cast<base::ParshapeInfo>(&value)
                                         ->parshape.size());
-            } else if(value.type() == typeid(shared_ptr<base::FontInfo>)) {
+            } else if(value.is<shared_ptr<base::FontInfo> >()) {
                 shared_ptr<base::FontInfo> f =
                     *unsafe_any_cast<shared_ptr<base::FontInfo> >(&value);
                 string fname = f ? f->selector : "";
@@ -413,7 +696,7 @@ void Parser::endGroup()
                     fname = escape + "FONT" + str;
                 }
                 str += fname;
-            } else if(value.type() == typeid(base::Box)) {
+            } else if(value.is<base::Box>()) {
                 base::Box box = *unsafe_any_cast<base::Box>(&value);
                 if(box.value) {
                     string w = base::InternalDimen::dimenToString(box.width);
@@ -429,7 +712,7 @@ void Parser::endGroup()
                 } else {
                     str += "void";
                 }
-            } else if(value.type() == typeid(Token::list)) {
+            } else if(value.is<Token::list>()) {
                 str += Token::texReprList(
                         *unsafe_any_cast<Token::list>(&value), this, false, 34);
                         //false, 70 > str.length() ? 70-str.length() : 1);
@@ -448,56 +731,284 @@ void Parser::endGroup()
         m_symbolsStack.pop_back();
     }
 
-    pushBack(&m_aftergroupTokensStack.back());
+    pushBack(NULL);
+    if(!m_aftergroupTokensStack.back().empty()) {
+        Token::list_ptr tokens(new Token::list());
+        tokens->swap(m_aftergroupTokensStack.back());
+        pushBack(tokens, 0);
+    }
 
     m_aftergroupTokensStack.pop_back();
     m_symbolsStackLevels.pop_back();
     --m_groupLevel;
 }
 
-Node::ptr Parser::rawExpandToken(Token::ptr token)
+bool Parser::dumpFormat(std::ostream& out)
 {
-    if(m_lockToken) {
-        if(token->type() == m_lockToken->type() &&
-                token->catCode() == m_lockToken->catCode() &&
-                token->value() == m_lockToken->value())
-            return Node::ptr();
+    if(m_groupLevel > 0) {
+        m_logger->log(Logger::ERROR, "You can't dump inside a group",
+                                                *this, lastToken());
+        return false;
+    }
+
+    const InitialSymbols& initial = initialSymbols();
+    base::FormatWriter writer(out);
+    bool result = true;
+
+    // Named symbols first, then the registers
+    vector<unsigned> ids;
+    for(unsigned n = 0; n < m_symbols.size(); ++n)
+        if(m_symbols[n].first != SYMBOL_UNDEFINED) ids.push_back(n);
+    size_t extra = ids.size();
+    for(unsigned n = 0; n < m_formatSymbols.size(); ++n)
+        if(m_formatSymbols[n].first != SYMBOL_UNDEFINED)
+            ids.push_back(m_formatFirstId + n);
+    BOOST_FOREACH(const SymbolMap::value_type& item, m_extraSymbols)
+        if(item.second.first != SYMBOL_UNDEFINED) ids.push_back(item.first);
+    std::sort(ids.begin() + extra, ids.end());
+    for(int t = 0; t < REGISTER_TYPES_NUMBER; ++t) {
+        for(unsigned n = 0; n < m_registers[t].size(); ++n)
+            if(m_registers[t][n].first != SYMBOL_UNDEFINED)
+                ids.push_back(registerId(RegisterType(t), n));
+    }
+
+    // Values describing the job are set again for every parser
+    static const unsigned jobSymbols[] = {
+        symbolId("inputlineno"), symbolId("year"), symbolId("month"),
+        symbolId("day"), symbolId("time")
+    };
+    const unsigned* jobSymbolsEnd = jobSymbols +
+                        sizeof(jobSymbols) / sizeof(jobSymbols[0]);
+
+    BOOST_FOREACH(unsigned id, ids) {
+        if(std::find(jobSymbols, jobSymbolsEnd, id) != jobSymbolsEnd)
+            continue;
+
+        const SymbolTable& itable = isRegisterId(id) ?
+                initial.registers[registerType(id)] : initial.symbols;
+        unsigned n = isRegisterId(id) ? registerNumber(id) : id;
+
+        const any& value = symbolAny(id);
+        if(n < itable.size() && itable[n].first != SYMBOL_UNDEFINED &&
+                base::isSameValue(value, itable[n].second))
+            continue;
+
+        string name = symbolName(id);
+        if(!writer.addSymbol(name, value)) {
+            m_logger->log(Logger::ERROR, "Can't dump the value of `" +
+                    name + "'", *this, lastToken());
+            result = false;
+        }
     }
 
-    Command::ptr cmd = symbol(token, Command::ptr());
-    Macro::ptr macro = dynamic_pointer_cast<Macro>(cmd);
+    if(!writer.write(m_interaction)) {
+        m_logger->log(Logger::ERROR, "Can't write the format file",
+                                                *this, lastToken());
+        return false;
+    }
+    return result;
+}
 
-    if(cmd && !macro)
-        return Node::ptr();
+bool Parser::dumpFormat(const string& fileName)
+{
+    // The file is replaced at once, it may be mapped by other processes
+    string tmpName = fileName + ".tmp";
+    std::ofstream out(tmpName.c_str(), std::ios::out | std::ios::binary);
+    if(!out) {
+        m_logger->log(Logger::ERROR, "I can't write on file `" +
+                        fileName + "'", *this, lastToken());
+        return false;
+    }
+
+    bool result = dumpFormat(out);
+    out.close();
+    if(!out || std::rename(tmpName.c_str(), fileName.c_str()) != 0) {
+        std::remove(tmpName.c_str());
+        m_logger->log(Logger::ERROR, "I can't write on file `" +
+                        fileName + "'", *this, lastToken());
+        return false;
+    }
+    return result;
+}
 
-    Node::ptr node(new Node("macro"));
-    Node::ptr child(new Node("control_token"));
-    child->tokens().push_back(token);
-    child->setValue(token);
-    node->appendChild("control_sequence", child);
-    bool expanded = true;
-    
-    pushBack(NULL);
+bool Parser::loadFormat(std::istream& in)
+{
+    string data((std::istreambuf_iterator<char>(in)),
+                 std::istreambuf_iterator<char>());
+    return loadFormat(base::FormatImage::create(data));
+}
 
-    if(m_conditionals.empty() || m_conditionals.back().active)
-        traceCommand(token, true);
+bool Parser::loadFormat(const string& fileName)
+{
+    base::FormatImage::ptr image = base::FormatImage::open(fileName);
+    if(!image && !std::ifstream(fileName.c_str())) {
+        m_logger->log(Logger::ERROR, "Sorry, I can't find the format `" +
+                        fileName + "'", *this, lastToken());
+        return false;
+    }
+    return loadFormat(image);
+}
 
-    if(!cmd) {
-        logger()->log(Logger::ERROR,
-            "Undefined control sequence", *this, token);
-        /*token = Token::create(Token::TOK_SKIPPED,
-                    token->catCode(), token->value(), token->source(),
-                    token->listPos(), token->lineNo(),
-                    token->charPos(), token->charEnd(),
-                    token->isLastInLine(), token->fileNamePtr());*/
-        //token = token->lcopy();
-        //token->setType(Token::TOK_SKIPPED);
-        //node->setValue(Token::list(1, token));
-        node->setType("undefined_control_sequence");
-
-    } else if(dynamic_pointer_cast<ConditionalBegin>(macro)) {
-        ConditionalBegin::ptr condBegin =
-            static_pointer_cast<ConditionalBegin>(macro);
+bool Parser::loadFormat(const shared_ptr<base::FormatImage>& image)
+{
+    if(!image || m_groupLevel > 0) {
+        m_logger->log(Logger::ERROR, "Fatal format file error; I'm stymied",
+                                                *this, lastToken());
+        return false;
+    }
+
+    // Symbols still referring to a previous format are copied, the
+    // names of the previous format are still looked up
+    if(m_format) {
+        for(unsigned id = 0; id < m_symbols.size(); ++id)
+            if(m_symbols[id].first == SYMBOL_FORMAT) symbolEntry(id);
+        for(unsigned n = 0; n < m_formatSymbols.size(); ++n) {
+            SymbolTable::reference entry = m_formatSymbols[n];
+            if(entry.first == SYMBOL_FORMAT)
+                symbolEntry(m_formatFirstId + n);
+            if(entry.first != SYMBOL_UNDEFINED)
+                m_extraSymbols[m_formatFirstId + n] = entry;
+        }
+        BOOST_FOREACH(SymbolMap::value_type& item, m_extraSymbols)
+            if(item.second.first == SYMBOL_FORMAT) symbolEntry(item.first);
+        m_formatSymbols.clear();
+    }
+    m_format = image;
+    m_names->addParent(image->names());
+    m_formatFirstId = image->names()->firstId();
+
+    // The symbols named by the format are kept in the dense table
+    unsigned size = 0;
+    for(size_t n = 0; n < image->size(); ++n) {
+        unsigned id = image->symbolId(n);
+        if(!isRegisterId(id) && !image->isScalar(n) &&
+                id - m_formatFirstId < InternOverlay::chunkSize())
+            size = std::max(size, id - m_formatFirstId + 1);
+    }
+    growSymbols(m_formatSymbols, m_formatFirstId, size);
+
+    for(size_t n = 0; n < image->size(); ++n) {
+        unsigned id = image->symbolId(n);
+        if(isRegisterId(id) || image->isScalar(n)) {
+            setSymbol(id, image->value(n));
+            continue;
+        }
+
+        // Other values are looked up in the format until they change
+        symbolEntry(id) = std::make_pair(int(SYMBOL_FORMAT), any(int(n)));
+    }
+    m_categoryToken.reset();
+
+    int interaction = image->interaction();
+    if(interaction >= ERRORSTOPMODE && interaction <= BATCHMODE)
+        m_interaction = Interaction(interaction);
+
+    // The date and time are not taken from the format
+    base::initDateTime(*this);
+    return true;
+}
+
+const any& Parser::formatValue(const any& index) const
+{
+    return m_format->value(*unsafe_any_cast<int>(&index));
+}
+
+namespace {
+// Returns true if the source of the token is not empty
+bool hasSource(const Token& token)
+{
+    if(!token.file())
+        return false;
+    const SourceFile& file = SourceFile::get(token.file());
+    if(file.kind() == SourceFile::FILE)
+        return token.charEnd() > token.charPos();
+    return !file.text().empty();
+}
+
+// The first and the last tokens of a subtree with non-empty sources.
+// Only tokens without sources are skipped, so the cost does not depend
+// on the size of the arguments
+Token::ptr firstSourceToken(const Node& node)
+{
+    BOOST_FOREACH(const Token::ptr& token, node.tokens()) {
+        if(hasSource(*token)) return token;
+    }
+    typedef pair<string, Node::ptr> C;
+    BOOST_FOREACH(const C& c, node.children()) {
+        Token::ptr token = firstSourceToken(*c.second);
+        if(token) return token;
+    }
+    return Token::ptr();
+}
+
+Token::ptr lastSourceToken(const Node& node)
+{
+    typedef pair<string, Node::ptr> C;
+    BOOST_REVERSE_FOREACH(const C& c, node.children()) {
+        Token::ptr token = lastSourceToken(*c.second);
+        if(token) return token;
+    }
+    BOOST_REVERSE_FOREACH(const Token::ptr& token, node.tokens()) {
+        if(hasSource(*token)) return token;
+    }
+    return Token::ptr();
+}
+
+// Token referencing the input between two tokens of one file
+Token::ptr spanToken(Token::Type type, const Token::ptr& token,
+                    const Token::ptr& first, const Token::ptr& last)
+{
+    if(first->file() != last->file())
+        return Token::ptr();
+
+    size_t begin = first->linePos() + first->charPos();
+    size_t end = last->linePos() + last->charEnd();
+    if(end < begin)
+        return Token::ptr();
+
+    Token::ptr marker = Token::create(type,
+                token->catCode(), token->value(), "",
+                begin, 0, 0, end - begin);
+    marker->setFile(first->file());
+    return marker;
+}
+} // namespace
+
+Token::ptr Parser::expansionMarker(Token::ptr token, Node::ptr node,
+                                   bool expanded)
+{
+    // Unexpanded tokens are read again, markers are skipped
+    Token::Type type = expanded ? Token::TOK_SKIPPED : token->type();
+
+    // When the expansion was read from a file its source is
+    // referenced as the span of that file from its first token
+    // to its last one instead of being copied
+    Token::ptr first = firstSourceToken(*node);
+    Token::ptr last = first ? lastSourceToken(*node) : Token::ptr();
+    if(first && SourceFile::get(first->file()).kind() ==
+                                            SourceFile::FILE) {
+        Token::ptr marker = spanToken(type, token, first, last);
+        if(marker)
+            return marker;
+    }
+
+    // Other sources are copied by the full mode only
+    bool copy = !expanded || m_expansionMode == EXPANSION_FULL;
+    return Token::create(type,
+                token->catCode(), token->value(),
+                copy ? node->source() : "",
+                0, 0, 0, 0,
+                false, lexer()->fileNamePtr());
+}
+
+bool Parser::expandConditional(const Command::ptr& cmd,
+                        const Token::ptr& token, const Node::ptr& node)
+{
+    unsigned conditional = cmd->flags() & Command::CONDITIONAL;
+
+    if(conditional == Command::CONDITIONAL_BEGIN) {
+        ConditionalBegin* condBegin =
+                static_cast<ConditionalBegin*>(cmd.get());
 
         ConditionalInfo cinfo0;
         cinfo0.parsed = false;
@@ -510,7 +1021,7 @@ Node::ptr Parser::rawExpandToken(Token::ptr token)
         size_t level = m_conditionals.size();
 
         // At this point the rawNextToken may be called recursively
-        m_commandStack.push_back(condBegin);
+        m_commandStack.push_back(cmd);
         condBegin->evaluate(*this, node);
         m_commandStack.pop_back();
 
@@ -519,7 +1030,7 @@ Node::ptr Parser::rawExpandToken(Token::ptr token)
         assert(m_conditionals.size() >= level);
         ConditionalInfo& cinfo = m_conditionals[level-1];
 
-        cinfo.ifcase = node->valueAny().type() == typeid(int);
+        cinfo.ifcase = node->valueAny().is<int>();
         if(cinfo.ifcase) {
             cinfo.value = node->value(int(0));
             cinfo.active = cinfo.value == 0;
@@ -531,7 +1042,7 @@ Node::ptr Parser::rawExpandToken(Token::ptr token)
         cinfo.branch = 0;
         cinfo.parsed = true;
 
-        if(symbol("tracingcommands", int(0)) > 1/* && mode() != NULLMODE*/) {
+        if(m_tracingcommands > 1/* && mode() != NULLMODE*/) {
             string str;
             if(cinfo.ifcase) {
                 str = "case " +
@@ -550,7 +1061,7 @@ Node::ptr Parser::rawExpandToken(Token::ptr token)
             pushBack(NULL);
         }
 
-    } else if(dynamic_pointer_cast<ConditionalOr>(macro)) {
+    } else if(conditional == Command::CONDITIONAL_OR) {
         if(!m_conditionals.empty() && !m_conditionals.back().parsed) {
             node->setValue(Token::list_ptr(
                 new Token::list(1, Token::create(
@@ -558,12 +1069,12 @@ Node::ptr Parser::rawExpandToken(Token::ptr token)
                 "", token->linePos(), token->lineNo(),
                 token->charEnd(), token->charEnd(),
                 token->isLastInLine(), token->fileNamePtr()))));
-            expanded = false;
+            return false;
         } else if((m_conditionals.empty() ||
                 m_conditionals.back().branch < 0 ||
                 !m_conditionals.back().ifcase)) {
             logger()->log(Logger::ERROR,
-                "Extra " + macro->texRepr(this), *this, token);
+                "Extra " + cmd->texRepr(this), *this, token);
         } else {
             ConditionalInfo& cinfo = m_conditionals.back();
             ++cinfo.branch;
@@ -575,7 +1086,7 @@ Node::ptr Parser::rawExpandToken(Token::ptr token)
                 pushBack(NULL);
             }
         }
-    } else if(dynamic_pointer_cast<ConditionalElse>(macro)) {
+    } else if(conditional == Command::CONDITIONAL_ELSE) {
         if(!m_conditionals.empty() && !m_conditionals.back().parsed) {
             node->setValue(Token::list_ptr(
                 new Token::list(1, Token::create(
@@ -583,11 +1094,11 @@ Node::ptr Parser::rawExpandToken(Token::ptr token)
                 "", token->linePos(), token->lineNo(),
                 token->charEnd(), token->charEnd(),
                 token->isLastInLine(), token->fileNamePtr()))));
-            expanded = false;
+            return false;
         } else if((m_conditionals.empty() ||
                 m_conditionals.back().branch < 0)) {
             logger()->log(Logger::ERROR,
-                "Extra " + macro->texRepr(this), *this, token);
+                "Extra " + cmd->texRepr(this), *this, token);
         } else {
             ConditionalInfo& cinfo = m_conditionals.back();
             if(cinfo.ifcase) {
@@ -604,7 +1115,7 @@ Node::ptr Parser::rawExpandToken(Token::ptr token)
                 pushBack(NULL);
             }
         }
-    } else if(dynamic_pointer_cast<ConditionalEnd>(macro)) {
+    } else if(conditional == Command::CONDITIONAL_END) {
         if(!m_conditionals.empty() && !m_conditionals.back().parsed) {
             node->setValue(Token::list_ptr(
                 new Token::list(1, Token::create(
@@ -612,48 +1123,168 @@ Node::ptr Parser::rawExpandToken(Token::ptr token)
                 "", token->linePos(), token->lineNo(),
                 token->charEnd(), token->charEnd(),
                 token->isLastInLine(), token->fileNamePtr()))));
-            expanded = false;
+            return false;
         } else if(m_conditionals.empty()) {
             logger()->log(Logger::ERROR,
-                "Extra " + macro->texRepr(this), *this, token);
+                "Extra " + cmd->texRepr(this), *this, token);
         } else {
             m_conditionals.pop_back();
         }
+    }
 
-    } else {
-        // At this point the rawNextToken may be called recursively
-        m_commandStack.push_back(macro);
-        macro->expand(*this, node);
+    return true;
+}
+
+Token::ptr Parser::finishExpansion(const Token::ptr& token,
+                        const Node::ptr& node, bool expanded)
+{
+    // The list set by the command is not modified, commands may share
+    // one list between expansions (see UserMacro). The marker or the
+    // unexpanded token is returned to be read before that list
+    if(!node->value(Token::list_ptr()))
+        node->setValue(Token::list_ptr(new Token::list()));
+
+    if(!expanded || m_expansionMode != EXPANSION_NONE)
+        return expansionMarker(token, node, expanded);
+#warning XXX node can consists from tokens from several files!
+    return Token::ptr();
+}
+
+Node::ptr Parser::rawExpandToken(Token::ptr token, Token::ptr* first)
+{
+    // Links of \expandafter chains wait on m_expandafterStack while
+    // the token after them is expanded, so that long chains are
+    // expanded without recursion
+    size_t base = m_expandafterStack.size();
+    Node::ptr node;
+    Token::ptr marker;
+    bool expanded = true;
+
+    while(true) {
+        node.reset();
+
+        if(m_lockToken) {
+            if(token->type() == m_lockToken->type() &&
+                    token->catCode() == m_lockToken->catCode() &&
+                    token->valueId() == m_lockToken->valueId())
+                break;
+        }
+
+        Command::ptr cmd = symbol(token, Command::ptr());
+        if(cmd && !cmd->hasFlags(Command::EXPANDABLE))
+            break;
+
+        if(m_expansionDepth >= m_maxExpansionDepth) {
+            logger()->log(Logger::ERROR,
+                "TeX capacity exceeded, sorry [expansion depth=" +
+                boost::lexical_cast<string>(m_maxExpansionDepth) + "]",
+                *this, token);
+
+            // Like in TeX the overflow is fatal, otherwise the
+            // expansion that caused it would start again
+            if(!ignoreEmergency())
+                end();
+            break;
+        }
+        ++m_expansionDepth;
+
+        node = Node::create("macro");
+        Node::ptr child = Node::create("control_token");
+        child->tokens().push_back(token);
+        child->setValue(token);
+        node->appendChild("control_sequence", child);
+        expanded = true;
+
+        pushBack(NULL);
+
+        if(m_conditionals.empty() || m_conditionals.back().active)
+            traceCommand(token, true);
+
+        if(!cmd) {
+            logger()->log(Logger::ERROR,
+                "Undefined control sequence", *this, token);
+            node->setType("undefined_control_sequence");
+
+        } else if(cmd->hasFlags(Command::CONDITIONAL)) {
+            expanded = expandConditional(cmd, token, node);
+
+        } else {
+            // At this point the rawNextToken may be called recursively
+            m_commandStack.push_back(cmd);
+            static_cast<Macro*>(cmd.get())->expand(*this, node);
+
+            if(cmd->hasFlags(Command::EXPAND_AFTER)) {
+                // Expand the second token, the result is
+                // completed when the stack is unwound below
+                m_expandafterStack.push_back(node);
+                --m_expansionDepth;
+                token = node->child("token2")->value(Token::ptr());
+                if(token) {
+                    token = token->lcopy();
+                    continue;
+                }
+                node.reset();
+                break;
+            }
+
+            m_commandStack.pop_back();
+            pushBack(NULL);
+        }
+
+        marker = finishExpansion(token, node, expanded);
+        --m_expansionDepth;
+        break;
+    }
+
+    while(m_expandafterStack.size() > base) {
+        Node::ptr outer = m_expandafterStack.back();
+        m_expandafterStack.pop_back();
+
+        Token::list tokens;
+        Token::ptr token1 = outer->child("token1")->value(Token::ptr());
+        if(token1)
+            tokens.push_back(token1->lcopy());
+
+        if(node) {
+            Token::list_ptr newTokens = node->value(Token::list_ptr());
+            assert(newTokens);
+            if(marker)
+                tokens.push_back(marker);
+            tokens.insert(tokens.end(),
+                    newTokens->begin(), newTokens->end());
+        } else if(token) {
+            tokens.push_back(token);
+        }
+
+        pushBack(&tokens);
         m_commandStack.pop_back();
         pushBack(NULL);
 
+        node = outer;
+        token = node->child("control_sequence")->value(Token::ptr());
+        marker = finishExpansion(token, node, true);
     }
 
-    // TODO: the next lines is horible. Either Node::value should return
-    //       a reference or the value itself should be Token::list_ptr.
-    Token::list_ptr newTokens = node->value(Token::list_ptr());
-    if(!newTokens) newTokens = Token::list_ptr(new Token::list());
-    newTokens->insert(newTokens->begin(),
-                Token::create(
-                    expanded ? Token::TOK_SKIPPED : token->type(),
-                    token->catCode(), token->value(), node->source(),
-                    0, 0, 0, 0,
-                    false, lexer()->fileNamePtr())
-            );
-#warning XXX node can consists from tokens from several files!
-    node->setValue(newTokens);
+    if(first)
+        *first = node ? marker : Token::ptr();
 
     return node;
 }
 
-Token::ptr Parser::rawNextToken(bool expand)
+Token::ptr Parser::rawReadToken()
 {
     Token::ptr token;
 
     while(true) {
         if(!m_tokenQueue.empty()) {
-            token = m_tokenQueue.front();
-            m_tokenQueue.pop_front();
+            TokenSpan& span = m_tokenQueue.back();
+            if(span.pos >= span.tokens->size()) {
+                if(span.tokens.unique())
+                    m_spareTokens.swap(span.tokens);
+                m_tokenQueue.pop_back();
+                continue;
+            }
+            token = (*span.tokens)[span.pos++];
         } else {
             if(m_endinputNow) {
                 endinputNow();
@@ -676,22 +1307,36 @@ Token::ptr Parser::rawNextToken(bool expand)
         break;
     }
 
-    if(token && token->isControl() && expand &&
-                m_noexpandTokens.count(token) == 0) {
-        Node::ptr node = rawExpandToken(token);
-        if(node) {
-            Token::list_ptr newTokens = node->value(Token::list_ptr());
-            assert(newTokens && !newTokens->empty());
+    return token;
+}
 
-            Token::list::reverse_iterator rend = newTokens->rend();
-            Token::list::reverse_iterator it = newTokens->rbegin();
-            for(; it+1 != rend; ++it) {
-                assert((*it)->source().empty());
-                m_tokenQueue.push_front(*it);
-            }
-            if(it != rend)
-                token = *it;
-        }
+Token::ptr Parser::rawNextToken(bool expand)
+{
+    Token::ptr token;
+
+    while(true) {
+        token = rawReadToken();
+        if(!token || !token->isControl() || !expand ||
+                token->isNoexpand())
+            break;
+
+        Token::ptr first;
+        Node::ptr node = rawExpandToken(token, &first);
+        if(!node)
+            break;
+
+        // The result is read by reference, it may be shared
+        Token::list_ptr newTokens = node->value(Token::list_ptr());
+        assert(newTokens);
+        if(!newTokens->empty())
+            pushSpan(newTokens, 0);
+
+        // Unless the expansion is not recorded, the marker
+        // or the unexpanded token is read first
+        if(!first)
+            continue;
+        token = first;
+        break;
     }
 
     return token;
@@ -699,6 +1344,7 @@ Token::ptr Parser::rawNextToken(bool expand)
 
 Token::ptr Parser::nextToken(vector< Token::ptr >* tokens, bool expand)
 {
+    InternScope scope(m_names.get());
     if(m_tokenSource.empty())
         peekToken(expand);
 
@@ -709,8 +1355,9 @@ Token::ptr Parser::nextToken(vector< Token::ptr >* tokens, bool expand)
 
     Token::ptr token = m_token;
     if(!m_lexer->interactive() && m_lexer->lineNo() != m_lineNo) {
+        static const unsigned inputlinenoId = Intern::id("inputlineno");
         m_lineNo = m_lexer->lineNo();
-        setSymbol("inputlineno", int(m_lineNo), true);
+        setSymbol(inputlinenoId, int(m_lineNo), true);
     }
 
     m_tokenSource.clear();
@@ -791,13 +1438,17 @@ Token::ptr Parser::lastToken()
 
 Token::ptr Parser::peekToken(bool expand)
 {
+    InternScope scope(m_names.get());
     //int n = 1; // XXX
     if(m_end) {
         m_token.reset();
         if(!m_lexer->interactive()) {
-            // Return the rest of the document as skipped tokens
+            // Return the rest of the document as skipped tokens. Tokens
+            // that are not read from the input may be shared
             Token::ptr token;
             while(token = rawNextToken(false)) {
+                if(!token->lineNo() && !token->isSkipped())
+                    token = token->lcopy();
                 token->setType(Token::TOK_SKIPPED);
                 m_tokenSource.push_back(token);
             }
@@ -855,6 +1506,17 @@ Token::ptr Parser::peekToken(bool expand)
 
     pushBack(NULL); // peekToken may be called recursively
 
+    // The job may be stopped while the token is expanded, the token
+    // is then skipped with the rest of the input
+    if(m_end) {
+        if(mtoken) {
+            tokenSource.pop_back();
+            pushBackTokens(Token::list(1, mtoken));
+        }
+        m_tokenSource = tokenSource;
+        return peekToken(expand);
+    }
+
     m_token = mtoken;
     m_tokenSource = tokenSource;
 
@@ -891,27 +1553,79 @@ Token::ptr Parser::peekToken(bool expand)
     #endif
 }
 
+void Parser::pushBackTokens(const Token::list& tokens)
+{
+    if(tokens.empty())
+        return;
+
+    // Reuse already consumed slots of the top span when it is not shared
+    if(!m_tokenQueue.empty()) {
+        TokenSpan& span = m_tokenQueue.back();
+        if(span.pos >= tokens.size() && span.tokens.unique()) {
+            span.pos -= tokens.size();
+            std::copy(tokens.begin(), tokens.end(),
+                        span.tokens->begin() + span.pos);
+            return;
+        }
+    }
+
+    Token::list_ptr list;
+    list.swap(m_spareTokens);
+    if(list) list->assign(tokens.begin(), tokens.end());
+    else list.reset(new Token::list(tokens));
+    pushSpan(list, 0);
+}
+
+void Parser::pushSpan(const Token::list_ptr& tokens, size_t pos)
+{
+    // Exhausted spans are dropped first, as TeX does in back_input,
+    // so that a macro ending with another macro call (\loop, tail
+    // recursive macros) does not grow the queue on every iteration
+    while(!m_tokenQueue.empty() && m_tokenQueue.back().pos >=
+                                   m_tokenQueue.back().tokens->size()) {
+        if(m_tokenQueue.back().tokens.unique())
+            m_spareTokens.swap(m_tokenQueue.back().tokens);
+        m_tokenQueue.pop_back();
+    }
+    m_tokenQueue.push_back(TokenSpan(tokens, pos));
+}
+
 void Parser::pushBack(vector< Token::ptr >* tokens)
 {
-    std::copy(m_tokenSource.rbegin(), m_tokenSource.rend(),
-                std::front_inserter(m_tokenQueue));
+    pushBackTokens(m_tokenSource);
 
     m_tokenSource.clear();
     m_token.reset();
 
-    if(tokens) {
-        std::copy(tokens->rbegin(), tokens->rend(),
-                    std::front_inserter(m_tokenQueue));
-    }
+    if(tokens)
+        pushBackTokens(*tokens);
+
     // NOTE: lastToken is NOT changed
 }
 
+void Parser::pushBack(const Token::list_ptr& tokens, size_t pos)
+{
+    pushBack(NULL);
+    if(tokens && pos < tokens->size())
+        pushSpan(tokens, pos);
+}
+
+void Parser::resetNoexpand()
+{
+    if(!m_noexpandTokens.empty()) {
+        BOOST_FOREACH(const Token::ptr& token, m_noexpandTokens)
+            token->setNoexpand(false);
+        m_noexpandTokens.clear();
+    }
+    pushBack(NULL);
+}
+
 void Parser::input(const string& fileName, const string& fullName)
 {
     // TODO: stop scaning genericText on file boundary
     // (for example \def\x{...} can't be spread across several files
-    shared_ptr<std::istream> istream(new std::ifstream(fullName.c_str()));
-    if(istream->fail()) {
+    InputSource::ptr source = InputSource::open(fullName);
+    if(!source) {
         logger()->log(Logger::ERROR,
             "I can't find file `" + fileName + "'",
             *this, lastToken());
@@ -926,16 +1640,13 @@ void Parser::input(const string& fileName, const string& fullName)
         return;
     }
 
-    m_inputStack.push_back(std::make_pair(m_lexer, m_tokenQueue));
+    m_inputStack.push_back(std::make_pair(m_lexer, TokenQueue()));
+    m_inputStack.back().second.swap(m_tokenQueue);
 
-    shared_ptr<Lexer> lexer(new Lexer(fullName, istream, false, true));
-    lexer->setEndlinechar(m_lexer->endlinechar());
-    for(int n=0; n<256; ++n) {
-        lexer->setCatcode(n, m_lexer->catcode(n));
-    }
+    shared_ptr<Lexer> lexer(new Lexer(fullName, source, false, true));
+    lexer->copyCodes(*m_lexer);
 
     m_lexer = lexer;
-    m_tokenQueue.clear();
 
     logger()->log(Logger::MESSAGE, "(" + fullName, *this, lastToken());
 }
@@ -944,8 +1655,10 @@ void Parser::endinputNow()
 {
     if(m_inputStack.empty())
         return;
+    // catcodes and endlinechar are global state
+    m_inputStack.back().first->copyCodes(*m_lexer);
     m_lexer = m_inputStack.back().first;
-    m_tokenQueue = m_inputStack.back().second;
+    m_tokenQueue.swap(m_inputStack.back().second);
     m_inputStack.pop_back();
     m_endinput = false;
     m_endinputNow = false;
@@ -962,66 +1675,124 @@ void Parser::processTextCharacter(char ch, Token::ptr token)
 
     m_hasOutput = true;
 
-    int prevSpacefactor = symbol("spacefactor", true);
-    int spacefactor = symbol(
-        "sfcode" + boost::lexical_cast<string>(int(ch)), int(0));
+    int sfcode = symbol(
+        registerId(REGISTER_SFCODE, (unsigned char) ch), int(0));
 
-    if(spacefactor != 0) {
-        if(prevSpacefactor > 1000 && spacefactor < 1000)
-            spacefactor = 1000;
-        setSymbol("spacefactor", spacefactor, true);
+    if(sfcode == 1000) {
+        m_spacefactor = 1000;
+    } else if(sfcode < 1000) {
+        if(sfcode > 0) m_spacefactor = sfcode;
+    } else if(m_spacefactor < 1000) {
+        m_spacefactor = 1000;
+    } else {
+        m_spacefactor = sfcode;
     }
 }
 
 void Parser::resetParagraphIndent()
 {
-    if(symbol("parshape", base::ParshapeInfo()).parshape.size() != 0)
-        setSymbol("parshape", base::ParshapeInfo());
+    static const unsigned parshapeId = Intern::id("parshape");
+    static const unsigned hangindentId = Intern::id("hangindent");
+    static const unsigned hangafterId = Intern::id("hangafter");
+    static const unsigned loosenessId = Intern::id("looseness");
+
+    if(symbol(parshapeId, base::ParshapeInfo()).parshape.size() != 0)
+        setSymbol(parshapeId, base::ParshapeInfo());
 
-    if(symbol("hangindent", Dimen(0)).value != 0)
-        setSymbol("hangindent", Dimen(0));
+    if(symbol(hangindentId, Dimen(0)).value != 0)
+        setSymbol(hangindentId, Dimen(0));
 
-    if(symbol("hangafter", int(0)) != 1)
-        setSymbol("hangafter", int(1));
+    if(symbol(hangafterId, int(0)) != 1)
+        setSymbol(hangafterId, int(1));
 
-    if(symbol("looseness", int(0)) != 0)
-        setSymbol("looseness", int(0));
+    if(symbol(loosenessId, int(0)) != 0)
+        setSymbol(loosenessId, int(0));
 
-    if(symbol("spacefactor", int(0)) != 1000)
-        setSymbol("spacefactor", int(1000), true);
+    m_spacefactor = 1000;
 }
 
-bool Parser::helperIsImplicitCharacter(Token::CatCode catCode, bool expand)
+Token::CatCode Parser::peekCategory(bool expand)
 {
-    if(peekToken(expand)) {
-        if(peekToken(expand)->isCharacterCat(catCode)) {
-            return true;
-        } else if(peekToken(expand)->isControl()) {
-            shared_ptr<TokenCommand> c =
-                symbolCommand<TokenCommand>(peekToken(expand));
-            if(c && c->token()->isCharacterCat(catCode))
-                return true;
+    Token::ptr token = peekToken(expand);
+    if(!token)
+        return Token::CC_NONE;
+
+    if(token != m_categoryToken) {
+        m_categoryToken = token;
+        m_category = Token::CC_NONE;
+        if(token->isCharacter()) {
+            m_category = token->catCode();
+        } else if(token->isControl()) {
+            const Command::ptr* c =
+                    any_cast<Command::ptr>(&symbolAny(symbolId(token)));
+            if(c && *c && (*c)->hasFlags(Command::TOKEN_COMMAND)) {
+                const Token::ptr& t =
+                    static_cast<TokenCommand*>(c->get())->token();
+                if(t->isCharacter())
+                    m_category = t->catCode();
+            }
         }
     }
-    return false;
+    return m_category;
 }
 
 Node::ptr Parser::parseFalseConditional(size_t level, bool sElse, bool sOr)
 {
-    Node::ptr node(new Node("skipped_conditional"));
+    Node::ptr node = Node::create("skipped_conditional");
+    pushBack(NULL);
+
+    // Skipped tokens are read directly from the input. Unless the full
+    // expansion record is requested, contiguous tokens from a file are
+    // merged into a single token covering their span
+    bool spans = m_expansionMode != EXPANSION_FULL;
+    Token::ptr span;
 
     Token::ptr token;
-    while((token = peekToken(false)) && m_conditionals.size() >= level) {
-        Command::ptr cmd = symbol(token, Command::ptr());
-        nextToken(&node->tokens(), false);
+    while(!m_end && m_conditionals.size() >= level &&
+                (token = rawNextToken(false))) {
+        if(token->isSkipped() && token->catCode() == Token::CC_INVALID) {
+            m_logger->log(Logger::ERROR,
+                "Text line contains an invalid character", *this, token);
+        }
+
+        if(spans && token->lineNo() != 0 && token->file() &&
+                SourceFile::get(token->file()).kind() == SourceFile::FILE) {
+            size_t pos = token->linePos() + token->charPos();
+            if(span && span->file() == token->file() &&
+                    span->linePos() + span->charEnd() == pos) {
+                span->setCharEnd(token->linePos() + token->charEnd()
+                                    - span->linePos());
+            } else {
+                span = Token::create(Token::TOK_SKIPPED,
+                            token->catCode(), "", "",
+                            token->linePos(), token->lineNo(),
+                            token->charPos(), token->charEnd());
+                span->setFile(token->file());
+                node->tokens().push_back(span);
+            }
+        } else {
+            span.reset();
+            node->tokens().push_back(token);
+        }
+
+        if(!token->isControl())
+            continue;
+
+        const Command::ptr* cmd =
+                    any_cast<Command::ptr>(&symbolAny(symbolId(token)));
+        unsigned conditional = cmd && *cmd ?
+                    (*cmd)->flags() & Command::CONDITIONAL : 0;
         
-        if(dynamic_pointer_cast<ConditionalBegin>(cmd)) {
+        switch(conditional) {
+        case Command::CONDITIONAL_BEGIN: {
             ConditionalInfo cinfo;
             cinfo.parsed = false;
             cinfo.active = false;
             m_conditionals.push_back(cinfo);
+            break;
+        }
 
-        } else if(dynamic_pointer_cast<ConditionalOr>(cmd)) {
+        case Command::CONDITIONAL_OR:
             if(sOr && m_conditionals.size() == level) {
                 ConditionalInfo& cinfo = m_conditionals.back();
                 ++cinfo.branch;
@@ -1029,8 +1800,9 @@ Node::ptr Parser::parseFalseConditional(size_t level, bool sElse, bool sOr)
                 if(cinfo.active)
                     return node;
             }
+            break;
 
-        } else if(dynamic_pointer_cast<ConditionalElse>(cmd)) {
+        case Command::CONDITIONAL_ELSE:
             if(sElse && m_conditionals.size() == level) {
                 ConditionalInfo& cinfo = m_conditionals.back();
                 if(cinfo.ifcase) {
@@ -1044,13 +1816,15 @@ Node::ptr Parser::parseFalseConditional(size_t level, bool sElse, bool sOr)
                 if(cinfo.active)
                     return node;
             }
+            break;
 
-        } else if(dynamic_pointer_cast<ConditionalEnd>(cmd)) {
+        case Command::CONDITIONAL_END:
             if(m_conditionals.size() == level) {
                 m_conditionals.pop_back();
                 return node;
             }
             m_conditionals.pop_back();
+            break;
         }
     }
 
@@ -1060,9 +1834,9 @@ Node::ptr Parser::parseFalseConditional(size_t level, bool sElse, bool sOr)
 
 Node::ptr Parser::parseCommand(Command::ptr command)
 {
-    Node::ptr node(new Node("command"));
+    Node::ptr node = Node::create("command");
 
-    if(dynamic_pointer_cast<base::Prefix>(command)) {
+    if(command->hasFlags(Command::PREFIX)) {
         std::set<string> prefixes;
         Token::ptr token;
         while(peekToken()) {
@@ -1087,7 +1861,7 @@ Node::ptr Parser::parseCommand(Command::ptr command)
                 resetNoexpand();
 
                 if(m_afterassignmentToken &&
-                        dynamic_pointer_cast<base::Assignment>(command)) {
+                        command->hasFlags(Command::ASSIGNMENT)) {
                     Token::list tokens(1, m_afterassignmentToken);
                     pushBack(&tokens);
                     m_afterassignmentToken.reset();
@@ -1108,7 +1882,7 @@ Node::ptr Parser::parseCommand(Command::ptr command)
         m_commandStack.pop_back();
 
         if(m_afterassignmentToken &&
-                dynamic_pointer_cast<base::Assignment>(command)) {
+                command->hasFlags(Command::ASSIGNMENT)) {
             Token::list tokens(1, m_afterassignmentToken);
             pushBack(&tokens);
             m_afterassignmentToken.reset();
@@ -1121,7 +1895,7 @@ Node::ptr Parser::parseCommand(Command::ptr command)
 
 Node::ptr Parser::parseToken(bool expand)
 {
-    Node::ptr node(new Node("token"));
+    Node::ptr node = Node::create("token");
     Token::ptr token = peekToken(expand);
 
     if(token) {
@@ -1138,7 +1912,7 @@ Node::ptr Parser::parseToken(bool expand)
 
 Node::ptr Parser::parseDMathToken()
 {
-    Node::ptr node(new Node("mmath_token"));
+    Node::ptr node = Node::create("mmath_token");
     nextToken(&node->tokens());
 
     if(!helperIsImplicitCharacter(Token::CC_MATHSHIFT, false)) {
@@ -1154,7 +1928,7 @@ Node::ptr Parser::parseDMathToken()
 
 Node::ptr Parser::parseControlSequence(bool expand)
 {
-    Node::ptr node(new Node("control_sequence"));
+    Node::ptr node = Node::create("control_sequence");
     Token::ptr token = peekToken(expand);
 
     if(token && token->isControl()) {
@@ -1172,9 +1946,9 @@ Node::ptr Parser::parseControlSequence(bool expand)
 
 Node::ptr Parser::parseTextCharacter()
 {
-    Node::ptr node(new Node(peekToken() &&
+    Node::ptr node = Node::create(peekToken() &&
         peekToken()->isCharacterCat(Token::CC_SPACE) ?
-        "text_space" : "text_character" ));
+        "text_space" : "text_character" );
     if(peekToken() && peekToken()->isCharacter()) {
         if(mode() != MATH && mode() != DMATH)
             processTextCharacter(peekToken()->value()[0], peekToken());
@@ -1192,7 +1966,7 @@ Node::ptr Parser::parseTextCharacter()
 
 Node::ptr Parser::parseOptionalSpaces()
 {
-    Node::ptr node(new Node("optional_spaces"));
+    Node::ptr node = Node::create("optional_spaces");
     while(helperIsImplicitCharacter(Token::CC_SPACE))
         nextToken(&node->tokens());
     return node;
@@ -1200,7 +1974,7 @@ Node::ptr Parser::parseOptionalSpaces()
 
 Node::ptr Parser::parseKeyword(const vector<string>& keywords)
 {
-    Node::ptr node(new Node("keyword"));
+    Node::ptr node = Node::create("keyword");
 
     while(helperIsImplicitCharacter(Token::CC_SPACE))
         nextToken(&node->tokens());
@@ -1235,7 +2009,7 @@ Node::ptr Parser::parseOptionalKeyword(const vector<string>& keywords)
 {
     Node::ptr node = parseKeyword(keywords);
     if(!node) {
-        node = Node::ptr(new Node("keyword"));
+        node = Node::create("keyword");
         while(helperIsImplicitCharacter(Token::CC_SPACE))
             nextToken(&node->tokens());
         node->setValue(string());
@@ -1246,7 +2020,7 @@ Node::ptr Parser::parseOptionalKeyword(const vector<string>& keywords)
 
 Node::ptr Parser::parseOptionalEquals()
 {
-    Node::ptr node(new Node("optional_equals"));
+    Node::ptr node = Node::create("optional_equals");
     while(helperIsImplicitCharacter(Token::CC_SPACE))
         nextToken(&node->tokens());
 
@@ -1265,7 +2039,7 @@ Node::ptr Parser::parseOptionalEquals()
 
 Node::ptr Parser::parseOptionalSigns()
 {
-    Node::ptr node(new Node("optional_signs"));
+    Node::ptr node = Node::create("optional_signs");
     node->setValue(int(1));
 
     while(peekToken() && (
@@ -1284,7 +2058,7 @@ Node::ptr Parser::parseOptionalSigns()
 Node::ptr Parser::parseNormalInteger()
 {
 
-    Node::ptr node(new Node("normal_integer"));
+    Node::ptr node = Node::create("normal_integer");
     if(!peekToken()) {
         logger()->log(Logger::ERROR,
             "Missing number, treated as zero", *this, Token::ptr());
@@ -1409,7 +2183,7 @@ Node::ptr Parser::parseNormalInteger()
 
 Node::ptr Parser::parseNormalDimen(bool fil, bool mu)
 {
-    Node::ptr node(new Node("normal_dimen"));
+    Node::ptr node = Node::create("normal_dimen");
     if(!peekToken()) {
         logger()->log(Logger::ERROR,
             "Missing number, treated as zero", *this, Token::ptr());
@@ -1576,9 +2350,11 @@ Node::ptr Parser::parseNormalDimen(bool fil, bool mu)
         Node::ptr optional_true = parseKeyword(kw_optional_true);
         if(optional_true) {
             node->appendChild("optional_true", optional_true);
-            int mag = symbol("mag", int(0));
-            int activemag = symbol("activemag", mag);
-            setSymbol("activemag", activemag);
+            static const unsigned magId = Intern::id("mag");
+            static const unsigned activemagId = Intern::id("activemag");
+            int mag = symbol(magId, int(0));
+            int activemag = symbol(activemagId, mag);
+            setSymbol(activemagId, activemag);
             if(activemag != mag) {
                 logger()->log(Logger::ERROR,
                     "Incompatible magnification (" +
@@ -1713,7 +2489,7 @@ Node::ptr Parser::parseNormalDimen(bool fil, bool mu)
     node->setValue(Dimen(v));
 
     if(!units) {
-        units = Node::ptr(new Node("unit"));
+        units = Node::create("unit");
         node->appendChild("unit", units);
     }
     if(helperIsImplicitCharacter(Token::CC_SPACE))
@@ -1730,7 +2506,7 @@ Node::ptr Parser::parseDimenFactor()
              peekToken()->value()[0] == '.' ||
              peekToken()->value()[0] == ',')) {
 
-        Node::ptr node(new Node("decimal_constant"));
+        Node::ptr node = Node::create("decimal_constant");
 
         int result = 0;
         int frac = 0;
@@ -1795,7 +2571,7 @@ Node::ptr Parser::parseDimenFactor()
 
 Node::ptr Parser::parseNumber()
 {
-    Node::ptr node(new Node("number"));
+    Node::ptr node = Node::create("number");
     node->appendChild("sign", parseOptionalSigns());
 
     int unsigned_value = 0;
@@ -1840,7 +2616,7 @@ Node::ptr Parser::parseNumber()
 
 Node::ptr Parser::parseDimen(bool fil, bool mu)
 {
-    Node::ptr node(new Node(mu ? "mudimen" : "dimen"));
+    Node::ptr node = Node::create(mu ? "mudimen" : "dimen");
     node->appendChild("sign", parseOptionalSigns());
 
     bool intern = false;
@@ -1886,7 +2662,7 @@ Node::ptr Parser::parseDimen(bool fil, bool mu)
 
 Node::ptr Parser::parseGlue(bool mu)
 {
-    Node::ptr node(new Node(mu ? "muglue" : "glue"));
+    Node::ptr node = Node::create(mu ? "muglue" : "glue");
     node->appendChild("sign", parseOptionalSigns());
     int sign = node->child(0)->value(int(0));
 
@@ -1987,7 +2763,7 @@ Node::ptr Parser::parseGlue(bool mu)
 Node::ptr Parser::parseBalancedText(bool expand,
                     int paramCount, Token::ptr nameToken)
 {
-    Node::ptr node(new Node("balanced_text"));
+    Node::ptr node = Node::create("balanced_text");
     Token::list_ptr tokens(new Token::list);
 
     int level = 0;
@@ -2027,7 +2803,7 @@ Node::ptr Parser::parseBalancedText(bool expand,
 
 Node::ptr Parser::parseFiller(bool expand)
 {
-    Node::ptr filler(new Node("filler"));
+    Node::ptr filler = Node::create("filler");
     while(peekToken(expand)) {
         if(helperIsImplicitCharacter(Token::CC_SPACE, expand)) {
             nextToken(&filler->tokens(), expand);
@@ -2049,13 +2825,13 @@ Node::ptr Parser::parseFiller(bool expand)
 
 Node::ptr Parser::parseGeneralText(bool expand, bool implicitLbrace)
 {
-    Node::ptr node(new Node("general_text"));
+    Node::ptr node = Node::create("general_text");
 
     // parse filler (always expanded)
     node->appendChild("filler", parseFiller(true));
 
     // parse left_brace
-    Node::ptr left_brace(new Node("left_brace"));
+    Node::ptr left_brace = Node::create("left_brace");
     node->appendChild("left_brace", left_brace);
     if(peekToken(expand) && (
        (implicitLbrace &&
@@ -2073,7 +2849,7 @@ Node::ptr Parser::parseGeneralText(bool expand, bool implicitLbrace)
     node->appendChild("balanced_text", parseBalancedText(expand));
 
     // parse right_brace
-    Node::ptr right_brace(new Node("right_brace"));
+    Node::ptr right_brace = Node::create("right_brace");
     node->appendChild("right_brace", right_brace);
     if(peekToken(expand) &&
             peekToken(expand)->isCharacterCat(Token::CC_EGROUP)) {
@@ -2092,7 +2868,7 @@ Node::ptr Parser::parseFileName()
 {
     static bool parsing = false;
 
-    Node::ptr node(new Node("file_name"));
+    Node::ptr node = Node::create("file_name");
 
     if(parsing)
         return node;
@@ -2124,7 +2900,7 @@ Node::ptr Parser::parseFileName()
 Node::ptr Parser::parseTextWord()
 {
     string value;
-    Node::ptr node(new Node("text_word"));
+    Node::ptr node = Node::create("text_word");
     while(peekToken() && peekToken()->isCharacterCat(Token::CC_LETTER)) {
         if(mode() != MATH && mode() != DMATH)
             processTextCharacter(peekToken()->value()[0], peekToken());
@@ -2140,25 +2916,23 @@ Node::ptr Parser::parseTextWord()
 
 void Parser::traceCommand(Token::ptr token, bool expanding)
 {
-    int tracingcommands = symbol("tracingcommands", int(0));
+    int tracingcommands = m_tracingcommands;
     if(tracingcommands > 0) {
         string str;
         if(token->isControl()) {
             Command::ptr cmd = symbol(token, Command::ptr());
-            if(dynamic_pointer_cast<base::TheMacro>(cmd)) {
+            unsigned flags = cmd ? cmd->flags() : 0;
+            if(flags & Command::THE) {
                 Command::ptr c = currentCommand();
                 if(mode() == NULLMODE ||
-                        dynamic_pointer_cast<base::Write>(c) ||
-                        dynamic_pointer_cast<base::Message>(c) ||
-                        (dynamic_pointer_cast<base::Def>(c) &&
-                         static_pointer_cast<base::Def>(c)->expand())) {
+                        (c && c->hasFlags(Command::EXPANDS_TEXT))) {
                     return;
                 }
             }
-            if(dynamic_pointer_cast<Macro>(cmd)) {
+            if(flags & Command::EXPANDABLE) {
                 if(expanding) {
                     if(tracingcommands < 2) return;
-                    if(dynamic_pointer_cast<base::UserMacro>(cmd)) return;
+                    if(flags & Command::USER_MACRO) return;
                     str += cmd->texRepr(this);
                 } else {
                     str += escapestr();
@@ -2182,12 +2956,17 @@ void Parser::traceCommand(Token::ptr token, bool expanding)
     }
 }
 
-Node::ptr Parser::parseGroup(GroupType groupType)
+void Parser::pushGroupFrame(GroupType groupType)
 {
-    GroupType prevGroupType = m_currentGroupType;
-    m_currentGroupType = groupType;
+    GroupFrame frame;
+    frame.type = groupType;
+    frame.prevGroupType = m_currentGroupType;
+    frame.prevMode = mode();
+    frame.node = Node::create("group");
+    m_groupFrames.push_back(frame);
 
-    Node::ptr node(new Node("group"));
+    m_currentGroupType = groupType;
+    Node::ptr node = frame.node;
 
     if(groupType == GROUP_NORMAL) {
         if(helperIsImplicitCharacter(Token::CC_BGROUP)) {
@@ -2195,7 +2974,7 @@ Node::ptr Parser::parseGroup(GroupType groupType)
         } else {
             logger()->log(Logger::ERROR, "Missing { inserted",
                                     *this, lastToken());
-            Node::ptr left_brace(new Node("token"));
+            Node::ptr left_brace = Node::create("token");
             left_brace->setValue(Token::create(
                         Token::TOK_CHARACTER, Token::CC_BGROUP, "{"));
             node->appendChild("group_begin", left_brace);
@@ -2218,225 +2997,261 @@ Node::ptr Parser::parseGroup(GroupType groupType)
         assert(helperIsImplicitCharacter(Token::CC_MATHSHIFT));
         node->appendChild("group_begin", parseDMathToken());
     }
+}
 
-    while(true) {
-        if(!peekToken()) {
-            if(groupType == GROUP_MATH || groupType == GROUP_DMATH) {
-                Node::ptr group_end(new Node("group_end"));
-                Token::ptr t(Token::create(Token::TOK_CHARACTER,
-                            Token::CC_MATHSHIFT, "$"));
-                group_end->setValue(t);
-                traceCommand(t);
-
-                node->appendChild("group_end", group_end);
-                logger()->log(Logger::ERROR,
-                        "Missing $ inserted", *this, lastToken());
-
-                if(groupType == GROUP_DMATH)
-                    logger()->log(Logger::ERROR,
-                        "Display math should end with $$",
-                        *this, lastToken());
-            }
-            break;
-        }
-
-        traceCommand(peekToken());
+bool Parser::parseGroupItem()
+{
+    GroupType groupType = m_groupFrames.back().type;
+    Node::ptr node = m_groupFrames.back().node;
 
-        if(helperIsImplicitCharacter(Token::CC_EGROUP)) {
-            if(groupType == GROUP_NORMAL) {
-                node->appendChild("group_end", parseToken());
-                break;
-            } else {
-                string msg;
-                switch(groupType) {
-                    case GROUP_DOCUMENT:
-                        msg = "Too many }'s";
-                        break;
-                    case GROUP_MATH:
-                    case GROUP_DMATH:
-                        msg = "Extra }, or forgotten $";
-                        break;
-                    case GROUP_SUPER:
-                        msg = "Extra }, or forgotten " +
-                            Token(Token::TOK_CONTROL, Token::CC_ESCAPE,
-                                    "\\endgroup").texRepr(this);
-                        break;
-                    default:
-                        msg = "Extra }";
-                }
-                logger()->log(Logger::ERROR, msg, *this, lastToken());
-                node->appendChild("ignored_egroup", parseToken());
-            }
+    if(!peekToken()) {
+        if(groupType == GROUP_MATH || groupType == GROUP_DMATH) {
+            Node::ptr group_end = Node::create("group_end");
+            Token::ptr t(Token::create(Token::TOK_CHARACTER,
+                        Token::CC_MATHSHIFT, "$"));
+            group_end->setValue(t);
+            traceCommand(t);
+
+            node->appendChild("group_end", group_end);
+            logger()->log(Logger::ERROR,
+                    "Missing $ inserted", *this, lastToken());
 
-        } else if(helperIsImplicitCharacter(Token::CC_BGROUP)) {
-            beginGroup();
-            node->appendChild("group", parseGroup(GROUP_NORMAL));
-            //pushBack(&m_aftergroupTokens);
-            //m_aftergroupTokens.clear();
-            endGroup();
+            if(groupType == GROUP_DMATH)
+                logger()->log(Logger::ERROR,
+                    "Display math should end with $$",
+                    *this, lastToken());
+        }
+        return false;
+    }
 
-        } else if(helperIsImplicitCharacter(Token::CC_MATHSHIFT)) {
+    traceCommand(peekToken());
 
-            if(groupType == GROUP_MATH) {
-                node->appendChild("group_end", parseToken());
-                break;
-            } else if(groupType == GROUP_DMATH) {
-                Node::ptr dmathNode = parseDMathToken();
-                node->appendChild("group_end", dmathNode);
-                if(helperIsImplicitCharacter(Token::CC_SPACE, false)) {
-                    nextToken(&dmathNode->tokens());
-                }
-                break;
+    Token::CatCode category = peekCategory();
+    if(category == Token::CC_EGROUP) {
+        if(groupType == GROUP_NORMAL) {
+            node->appendChild("group_end", parseToken());
+            return false;
+        } else {
+            string msg;
+            switch(groupType) {
+                case GROUP_DOCUMENT:
+                    msg = "Too many }'s";
+                    break;
+                case GROUP_MATH:
+                case GROUP_DMATH:
+                    msg = "Extra }, or forgotten $";
+                    break;
+                case GROUP_SUPER:
+                    msg = "Extra }, or forgotten " +
+                        Token(Token::TOK_CONTROL, Token::CC_ESCAPE,
+                                "\\endgroup").texRepr(this);
+                    break;
+                default:
+                    msg = "Extra }";
             }
+            logger()->log(Logger::ERROR, msg, *this, lastToken());
+            node->appendChild("ignored_egroup", parseToken());
+        }
 
-            Node::ptr t1 = parseToken();
+    } else if(category == Token::CC_BGROUP) {
+        beginGroup();
+        pushGroupFrame(GROUP_NORMAL);
 
-            // XXX: is the following line correct ?
-            bool dmath = helperIsImplicitCharacter(Token::CC_MATHSHIFT,
-                                                                false);
-            pushBack(&t1->tokens());
+    } else if(category == Token::CC_MATHSHIFT) {
 
-            if(mode() != HORIZONTAL) {
-                setMode(HORIZONTAL);
-                traceCommand(t1->value(Token::ptr()));
+        if(groupType == GROUP_MATH) {
+            node->appendChild("group_end", parseToken());
+            return false;
+        } else if(groupType == GROUP_DMATH) {
+            Node::ptr dmathNode = parseDMathToken();
+            node->appendChild("group_end", dmathNode);
+            if(helperIsImplicitCharacter(Token::CC_SPACE, false)) {
+                nextToken(&dmathNode->tokens());
             }
+            return false;
+        }
 
-            beginGroup();
-            Mode prevMode = mode();
-            setMode(dmath ? DMATH : MATH);
-
-            setSymbol("fam", int(-1));
+        Node::ptr t1 = parseToken();
 
-            if(dmath) {
-                setSymbol("predisplaysize", Dimen(0));
-                setSymbol("displaywidth", Dimen(0));
-                setSymbol("displayindent", Dimen(0));
-            }
+        // XXX: is the following line correct ?
+        bool dmath = helperIsImplicitCharacter(Token::CC_MATHSHIFT,
+                                                            false);
+        pushBack(&t1->tokens());
 
-            node->appendChild("inline_math", parseGroup(
-                    dmath ? GROUP_DMATH : GROUP_MATH));
+        if(mode() != HORIZONTAL) {
+            setMode(HORIZONTAL);
+            traceCommand(t1->value(Token::ptr()));
+        }
 
-            setMode(prevMode);
+        beginGroup();
+        Mode prevMode = mode();
+        setMode(dmath ? DMATH : MATH);
 
-            endGroup();
+        setSymbol("fam", int(-1));
 
-        } else if(peekToken()->isCharacterCat(Token::CC_LETTER)) {
-            node->appendChild("text_word", parseTextWord());
+        if(dmath) {
+            setSymbol("predisplaysize", Dimen(0));
+            setSymbol("displaywidth", Dimen(0));
+            setSymbol("displayindent", Dimen(0));
+        }
 
-        } else if(peekToken()->isCharacterCat(Token::CC_SPACE)) {
-            if(mode() == HORIZONTAL || mode() == RHORIZONTAL) {
-                node->appendChild("text_space", parseTextCharacter());
-            } else {
-                node->appendChild("space", parseToken());
-            }
+        pushGroupFrame(dmath ? GROUP_DMATH : GROUP_MATH);
+        m_groupFrames.back().prevMode = prevMode;
 
-        } else if(peekToken()->isCharacterCat(Token::CC_OTHER)) {
-            node->appendChild("text_character", parseTextCharacter());
+    } else if(peekToken()->isCharacterCat(Token::CC_LETTER)) {
+        node->appendChild("text_word", parseTextWord());
 
-        } else if(peekToken()->isCharacterCat(Token::CC_PARAM)) {
-            m_logger->log(Logger::ERROR,
-                "You can't use `" + peekToken()->meaning(this) + "' in " +
-                modeName() + " mode", *this, lastToken());
-            node->appendChild("error_param", parseToken());
-
-        } else if(peekToken()->isControl()) {
-            Command::ptr cmd = symbol(peekToken(), Command::ptr());
-            Node::ptr cmdNode;
-            if(cmd) {
-                if(dynamic_pointer_cast<Begingroup>(cmd)) {
-                    beginGroup();
-                    node->appendChild("group", parseGroup(GROUP_SUPER));
-                    //pushBack(&m_aftergroupTokens);
-                    //m_aftergroupTokens.clear();
-                    endGroup();
-                } else if(dynamic_pointer_cast<Endgroup>(cmd)) {
-                    if(groupType == GROUP_SUPER) {
-                        node->appendChild("group_end", parseToken());
-                        break;
+    } else if(peekToken()->isCharacterCat(Token::CC_SPACE)) {
+        if(mode() == HORIZONTAL || mode() == RHORIZONTAL) {
+            node->appendChild("text_space", parseTextCharacter());
+        } else {
+            node->appendChild("space", parseToken());
+        }
+
+    } else if(peekToken()->isCharacterCat(Token::CC_OTHER)) {
+        node->appendChild("text_character", parseTextCharacter());
+
+    } else if(peekToken()->isCharacterCat(Token::CC_PARAM)) {
+        m_logger->log(Logger::ERROR,
+            "You can't use `" + peekToken()->meaning(this) + "' in " +
+            modeName() + " mode", *this, lastToken());
+        node->appendChild("error_param", parseToken());
+
+    } else if(peekToken()->isControl()) {
+        Command::ptr cmd = symbol(peekToken(), Command::ptr());
+        Node::ptr cmdNode;
+        if(cmd) {
+            if(cmd->hasFlags(Command::GROUP_BEGIN)) {
+                beginGroup();
+                pushGroupFrame(GROUP_SUPER);
+            } else if(cmd->hasFlags(Command::GROUP_END)) {
+                if(groupType == GROUP_SUPER) {
+                    node->appendChild("group_end", parseToken());
+                    return false;
+                } else {
+                    string msg;
+                    Token::ptr t;
+                    if(groupType == GROUP_NORMAL) {
+                        msg = "Missing } inserted";
+                        t = Token::create(Token::TOK_CHARACTER,
+                                    Token::CC_EGROUP, "}");
+                    } else if(groupType == GROUP_MATH) {
+                        msg = "Missing $ inserted";
+                        t = Token::create(Token::TOK_CHARACTER,
+                                    Token::CC_MATHSHIFT, "$");
+                    } else if(groupType == GROUP_DMATH) {
+                        logger()->log(Logger::ERROR, 
+                               "Missing $ inserted", *this, lastToken());
+                        msg = "Display math should end with $$";
+                        t = Token::create(Token::TOK_CHARACTER,
+                                    Token::CC_MATHSHIFT, "$");
                     } else {
-                        string msg;
-                        Token::ptr t;
-                        if(groupType == GROUP_NORMAL) {
-                            msg = "Missing } inserted";
-                            t = Token::create(Token::TOK_CHARACTER,
-                                        Token::CC_EGROUP, "}");
-                        } else if(groupType == GROUP_MATH) {
-                            msg = "Missing $ inserted";
-                            t = Token::create(Token::TOK_CHARACTER,
-                                        Token::CC_MATHSHIFT, "$");
-                        } else if(groupType == GROUP_DMATH) {
-                            logger()->log(Logger::ERROR, 
-                                   "Missing $ inserted", *this, lastToken());
-                            msg = "Display math should end with $$";
-                            t = Token::create(Token::TOK_CHARACTER,
-                                        Token::CC_MATHSHIFT, "$");
-                        } else {
-                            msg = "Extra " + Token(Token::TOK_CONTROL,
-                                Token::CC_ESCAPE, "\\endgroup").texRepr(this);
-                        }
-                        logger()->log(Logger::ERROR, msg, *this, lastToken());
-                        if(groupType != GROUP_DOCUMENT) {
-                            Node::ptr group_end(new Node("group_end"));
-                            if(t) {
-                                group_end->setValue(t);
-                                traceCommand(t);
-                            }
-
-                            node->appendChild("group_end", group_end);
-                            break;
-                        } else {
-                            node->appendChild("extra_endgroup", parseToken());
-                        }
+                        msg = "Extra " + Token(Token::TOK_CONTROL,
+                            Token::CC_ESCAPE, "\\endgroup").texRepr(this);
                     }
-                } else {
-                    Mode prevMode = mode();
-                    cmd->presetMode(*this);
-                    if(mode() != prevMode)
-                        traceCommand(peekToken());
-
-                    cmdNode = parseCommand(cmd);
-
-                    if(m_customGroupBegin) {
-                        m_customGroupBegin = false;
-                        string type = m_customGroupType;
-                        Node::ptr customGroup = parseGroup(GROUP_CUSTOM);
-                        customGroup->setType(type);
-                        customGroup->children().insert(
-                                customGroup->children().begin(),
-                                std::make_pair("control", cmdNode));
-                        node->appendChild("custom_group", customGroup);
-                    } else if(m_customGroupEnd) {
-                        m_customGroupEnd = false;
-                        if(groupType == GROUP_CUSTOM) {
-                            node->appendChild("control", cmdNode);
-                            break;
-                        } else {
-                            logger()->log(Logger::ERROR,
-                                "Extra " + cmd->texRepr(this), *this, lastToken());
+                    logger()->log(Logger::ERROR, msg, *this, lastToken());
+                    if(groupType != GROUP_DOCUMENT) {
+                        Node::ptr group_end = Node::create("group_end");
+                        if(t) {
+                            group_end->setValue(t);
+                            traceCommand(t);
                         }
+
+                        node->appendChild("group_end", group_end);
+                        return false;
                     } else {
-                        node->appendChild("control", cmdNode);
+                        node->appendChild("extra_endgroup", parseToken());
                     }
                 }
             } else {
-                /*m_logger->log(Logger::ERROR, "Undefined control sequence",
-                                                *this, lastToken());*/
-                cmdNode = parseToken();
-                node->appendChild("unexpanded_macro", cmdNode);
-                //node->appendChild("error_unknown_control",
-                //                                parseToken());
+                Mode prevMode = mode();
+                cmd->presetMode(*this);
+                if(mode() != prevMode)
+                    traceCommand(peekToken());
+
+                cmdNode = parseCommand(cmd);
+
+                if(m_customGroupBegin) {
+                    m_customGroupBegin = false;
+                    pushGroupFrame(GROUP_CUSTOM);
+                    m_groupFrames.back().customType = m_customGroupType;
+                    m_groupFrames.back().control = cmdNode;
+                } else if(m_customGroupEnd) {
+                    m_customGroupEnd = false;
+                    if(groupType == GROUP_CUSTOM) {
+                        node->appendChild("control", cmdNode);
+                        return false;
+                    } else {
+                        logger()->log(Logger::ERROR,
+                            "Extra " + cmd->texRepr(this), *this, lastToken());
+                    }
+                } else {
+                    node->appendChild("control", cmdNode);
+                }
             }
         } else {
-            node->appendChild("other_token", parseToken());
+            /*m_logger->log(Logger::ERROR, "Undefined control sequence",
+                                            *this, lastToken());*/
+            cmdNode = parseToken();
+            node->appendChild("unexpanded_macro", cmdNode);
+            //node->appendChild("error_unknown_control",
+            //                                parseToken());
         }
+    } else {
+        node->appendChild("other_token", parseToken());
     }
 
-    m_currentGroupType = prevGroupType;
-    return node;
+    return true;
+}
+
+Node::ptr Parser::parseGroup(GroupType groupType)
+{
+    // Nested groups are parsed by the same loop using m_groupFrames,
+    // so that the nesting depth of a document does not use native stack
+    size_t base = m_groupFrames.size();
+    pushGroupFrame(groupType);
+
+    while(true) {
+        if(parseGroupItem())
+            continue;
+
+        GroupFrame frame = m_groupFrames.back();
+        m_groupFrames.pop_back();
+        m_currentGroupType = frame.prevGroupType;
+
+        if(m_groupFrames.size() == base)
+            return frame.node;
+
+        Node::ptr parent = m_groupFrames.back().node;
+        if(frame.type == GROUP_CUSTOM) {
+            frame.node->setType(frame.customType);
+            frame.node->children().insert(
+                    frame.node->children().begin(),
+                    std::make_pair("control", frame.control));
+            parent->appendChild("custom_group", frame.node);
+        } else if(frame.type == GROUP_MATH || frame.type == GROUP_DMATH) {
+            parent->appendChild("inline_math", frame.node);
+            setMode(frame.prevMode);
+            endGroup();
+        } else {
+            parent->appendChild("group", frame.node);
+            endGroup();
+        }
+    }
+}
+
+Node::ptr Parser::parse(ExpansionMode expansionMode)
+{
+    ExpansionMode prevMode = m_expansionMode;
+    m_expansionMode = expansionMode;
+    Node::ptr document = parse();
+    m_expansionMode = prevMode;
+    return document;
 }
 
 Node::ptr Parser::parse()
 {
+    InternScope scope(m_names.get());
     if(!lexer()->fileName().empty()) {
         string fname = lexer()->fileName();
         logger()->log(Logger::MESSAGE,
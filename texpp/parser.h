@@ -24,26 +24,17 @@
 #include <texpp/command.h>
 #include <texpp/command.h>
 
-#include <deque>
 #include <set>
 #include <cassert>
 #include <climits>
 
-#include <boost/any.hpp>
-
 namespace texpp {
 
-using boost::any;
-using boost::any_cast;
-using boost::unsafe_any_cast;
-
 class Lexer;
 class Logger;
 class Parser;
 
-namespace base {
-    class ExpandafterMacro;
-} // namespace base
+namespace base { class FormatImage; }
 
 class Node
 {
@@ -52,6 +43,11 @@ public:
     typedef vector< pair< string, Node::ptr > > ChildrenList;
 
     Node(const string& type): m_type(type) {}
+    ~Node();
+
+    // Allocates the node together with its reference counter
+    // from a locked pool shared by all parsers
+    static Node::ptr create(const string& type);
 
     string source(const string& fileName = string()) const;
     unordered_map<shared_ptr<string>, string> sources() const;
@@ -68,14 +64,12 @@ public:
     void setValue(const any& value) { m_value = value; }
     const any& valueAny() const { return m_value; }
     template<typename T> T value(T def) const {
-        if(m_value.type() != typeid(T)) return def;
-        else return *unsafe_any_cast<T>(&m_value);
+        const T* v = any_cast<T>(&m_value);
+        return v ? *v : def;
     }
 
-    // XXX: The following is a horrible hack required to
-    // XXX: overcome problems with RTTI across shared objects
-    // XXX: It will never work good and should be removed !
-    // XXX: The only solution is to NOT use boost::any
+    // Strings are recognized by their value tag, so this also
+    // works across shared objects
     const string& valueString() const;
 
     const vector< Token::ptr >& tokens() const { return m_tokens; }
@@ -98,6 +92,8 @@ public:
     string treeRepr(size_t indent = 0) const;
 
 protected:
+    void appendSource(string& str, const string& fileName) const;
+
     string                  m_type;
     any                     m_value;
     vector< Token::ptr >    m_tokens;
@@ -105,6 +101,12 @@ protected:
     ChildrenList            m_children;
 };
 
+// Token and node pools are locked and every parser interns its own
+// names (see Intern), but the source file registry, format images and
+// the current intern overlay are shared by all parsers of the process
+// without locking, and tokens are reference counted without atomic
+// operations. Parsers, even unrelated ones, should only be used from
+// one thread; use processes to parse documents in parallel
 class Parser
 {
 public:
@@ -119,6 +121,14 @@ public:
                      GROUP_MATH, GROUP_DMATH,
                      GROUP_CUSTOM };
 
+    // How macro expansions are recorded in the document tree.
+    // EXPANSION_FULL inserts a skipped token carrying the source of the
+    // whole expansion; EXPANSION_SPANS inserts a skipped token that only
+    // references the input span of the expansion (tokens of skipped
+    // conditional branches are merged into spans as well), and
+    // EXPANSION_NONE does not record expansions at all
+    enum ExpansionMode { EXPANSION_FULL, EXPANSION_SPANS, EXPANSION_NONE };
+
     Parser(const string& fileName, std::istream* file,
             const string& workdir = string(),
             bool interactive = false, bool ignoreEmergency = false,
@@ -129,12 +139,30 @@ public:
             bool interactive = false, bool ignoreEmergency = false,
             shared_ptr<Logger> logger = shared_ptr<Logger>());
 
+    Parser(const string& fileName, InputSource::ptr source,
+            const string& workdir = string(),
+            bool interactive = false, bool ignoreEmergency = false,
+            shared_ptr<Logger> logger = shared_ptr<Logger>());
+
     Interaction interaction() const { return m_interaction; }
     void setInteraction(Interaction intr) { m_interaction = intr; }
 
     const string& workdir() const { return m_workdir; }
     void setWorkdir(const string& workdir) { m_workdir = workdir; }
 
+    ExpansionMode expansionMode() const { return m_expansionMode; }
+    void setExpansionMode(ExpansionMode mode) { m_expansionMode = mode; }
+
+    // Number of nested macro expansions currently in progress. Only
+    // links of \expandafter chains are expanded from an explicit stack,
+    // other nested expansions (macros, conditionals, \csname, \number)
+    // recurse on the native stack. Expanding deeper than
+    // maxExpansionDepth is a fatal error instead of a stack overflow
+    enum { MAX_EXPANSION_DEPTH = 2000 };
+    size_t expansionDepth() const { return m_expansionDepth; }
+    size_t maxExpansionDepth() const { return m_maxExpansionDepth; }
+    void setMaxExpansionDepth(size_t depth) { m_maxExpansionDepth = depth; }
+
     bool ignoreEmergency() const { return m_ignoreEmergency; }
     void setIgnoreEmergency(bool ignoreEmergency) {
         m_ignoreEmergency = ignoreEmergency;
@@ -142,6 +170,7 @@ public:
    
     ///////// Parse 
     Node::ptr parse();
+    Node::ptr parse(ExpansionMode expansionMode);
 
     const string& modeName() const;
     Mode mode() const { return m_mode; }
@@ -151,6 +180,12 @@ public:
 
     void traceCommand(Token::ptr token, bool expanding = false);
 
+    // Tracing parameters are mirrored in typed fields
+    int tracingcommands() const { return m_tracingcommands; }
+    int tracingmacros() const { return m_tracingmacros; }
+    int tracingrestores() const { return m_tracingrestores; }
+    int tracingonline() const { return m_tracingonline; }
+
     //////// Tokens
     Token::ptr lastToken();
     Token::ptr peekToken(bool expand = true);
@@ -158,10 +193,14 @@ public:
                          bool expand = true);
 
     void pushBack(vector< Token::ptr >* tokens);
+    void pushBack(const Token::list_ptr& tokens, size_t pos);
 
     //void setNoexpand(Token::ptr token) { m_noexpandToken = token; }
-    void addNoexpand(Token::ptr token) { m_noexpandTokens.insert(token); }
-    void resetNoexpand() { m_noexpandTokens.clear(); pushBack(NULL); }
+    void addNoexpand(Token::ptr token) {
+        token->setNoexpand(true);
+        m_noexpandTokens.push_back(token);
+    }
+    void resetNoexpand();
 
     void input(const string& fileName, const string& fullName);
     void end() { m_end = true; }
@@ -183,8 +222,16 @@ public:
     }
 
     //////// Parse helpers
+    // Returns the category code of the next token taking implicit
+    // characters (\let\bgroup={) into account, or CC_NONE if the
+    // token is not a character. The result is cached until the token
+    // is consumed or a symbol changes.
+    Token::CatCode peekCategory(bool expand = true);
+
     bool helperIsImplicitCharacter(Token::CatCode catCode,
-                                        bool expand = true);
+                                        bool expand = true) {
+        return peekCategory(expand) == catCode;
+    }
 
     Node::ptr parseGroup(GroupType groupType);
 
@@ -219,35 +266,82 @@ public:
     Node::ptr parseTextCharacter();
 
     void processTextCharacter(char ch, Token::ptr token);
+    int spacefactor() const { return m_spacefactor; }
+    void setSpacefactor(int spacefactor) { m_spacefactor = spacefactor; }
     void resetParagraphIndent();
 
     //////// Symbols
-    void setSymbol(const string& name, const any& value, bool global = false);
+    // Symbols are identified by interned names (see Intern), register
+    // symbols live in per-type banks and are identified by registerId()
+    enum RegisterType { REGISTER_COUNT, REGISTER_DIMEN, REGISTER_SKIP,
+                        REGISTER_MUSKIP, REGISTER_TOKS, REGISTER_BOX,
+                        REGISTER_WD, REGISTER_HT, REGISTER_DP,
+                        REGISTER_CATCODE, REGISTER_LCCODE, REGISTER_UCCODE,
+                        REGISTER_SFCODE, REGISTER_MATHCODE, REGISTER_DELCODE,
+                        REGISTER_TYPES_NUMBER };
+    enum { REGISTERS_NUMBER = 32768 };
+
+    static unsigned registerId(RegisterType type, int n) {
+        return REGISTER_ID_FLAG | (unsigned(type) << 15) | unsigned(n);
+    }
+    static bool isRegisterId(unsigned id) { return id & REGISTER_ID_FLAG; }
+
+    // Names are interned into the current overlay (see InternScope)
+    static unsigned symbolId(const string& name);
+    static string symbolName(unsigned id);
+
+    // Ids of names interned by this parser. Tokens made outside of
+    // the parser may keep their names elsewhere and are looked up
+    // by name
+    unsigned localSymbolId(const string& name) const {
+        InternScope scope(m_names.get());
+        return symbolId(name);
+    }
+    unsigned symbolId(const Token::ptr& token) const {
+        unsigned id = token->valueId();
+        return m_names->contains(id) ? id : localSymbolId(token->value());
+    }
+
+    void setRegisterDefault(RegisterType type, const any& value);
+
+    void setSymbol(unsigned id, const any& value, bool global = false);
+    void setSymbol(const string& name, const any& value, bool global = false) {
+        setSymbol(localSymbolId(name), value, global);
+    }
     void setSymbol(Token::ptr token, const any& value, bool global = false) {
         if(token && token->isControl())
-            setSymbol(token->value(), value, global);
+            setSymbol(symbolId(token), value, global);
     }
 
-    void setSymbolDefault(const string& name, const any& defaultValue);
+    void setSymbolDefault(unsigned id, const any& defaultValue);
+    void setSymbolDefault(const string& name, const any& defaultValue) {
+        setSymbolDefault(localSymbolId(name), defaultValue);
+    }
     
-    const any& symbolAny(const string& name) const;
+    const any& symbolAny(unsigned id) const;
+    const any& symbolAny(const string& name) const {
+        return symbolAny(localSymbolId(name));
+    }
     const any& symbolAny(Token::ptr token) const {
         if(!token || !token->isControl()) return EMPTY_ANY;
-        else return symbolAny(token->value());
+        else return symbolAny(symbolId(token));
     }
     
+    template<typename T>
+    T symbol(unsigned id, T def) const {
+        const T* v = any_cast<T>(&symbolAny(id));
+        return v ? *v : def;
+    }
+
     template<typename T>
     T symbol(const string& name, T def) const {
-        const any& v = symbolAny(name);
-        if(v.type() != typeid(T)) return def;
-        else return *unsafe_any_cast<T>(&v);
+        return symbol(localSymbolId(name), def);
     }
 
     template<typename T>
     T symbol(Token::ptr token, T def) const {
-        const any& v = symbolAny(token);
-        if(v.type() != typeid(T)) return def;
-        else return *unsafe_any_cast<T>(&v);
+        const T* v = any_cast<T>(&symbolAny(token));
+        return v ? *v : def;
     }
 
     template<typename T>
@@ -264,10 +358,27 @@ public:
         m_customGroupBegin = true; m_customGroupType = type; beginGroup(); }
     void endCustomGroup() { endGroup(); m_customGroupEnd = true; }
 
-    string escapestr() const {
-        int e = symbol("escapechar", int(0));
-        return e >= 0 && e <= 255 ? string(1, e) : string();
-    }
+    string escapestr() const;
+
+    //////// Formats
+    // A format file stores the symbols that differ from the state set
+    // by base::initSymbols (macros, registers, code tables, fonts) like
+    // the \dump of INITEX. The format should be loaded before parsing.
+    // Values that can not be stored (files, commands defined outside of
+    // texpp) are skipped with an error and false is returned.
+    // Format files are mapped and shared (see base::FormatImage), the
+    // parser looks up unchanged macros and token lists in the format
+    bool dumpFormat(std::ostream& out);
+    bool dumpFormat(const string& fileName);
+    bool loadFormat(std::istream& in);
+    bool loadFormat(const string& fileName);
+    bool loadFormat(const shared_ptr<base::FormatImage>& image);
+
+    // Primitive commands are created by the first parser and shared by
+    // all parsers. These return the primitive with the given name and
+    // the name under which a primitive was created (or empty values)
+    static Command::ptr primitive(const string& name);
+    static string primitiveName(const Command::ptr& command);
 
     //////// Others
     shared_ptr<Logger> logger() { return m_logger; }
@@ -277,20 +388,36 @@ public:
 
 protected:
     void endinputNow();
-    Node::ptr rawExpandToken(Token::ptr token);
+    Node::ptr rawExpandToken(Token::ptr token, Token::ptr* first = NULL);
+    bool expandConditional(const Command::ptr& cmd,
+                           const Token::ptr& token, const Node::ptr& node);
+    Token::ptr finishExpansion(const Token::ptr& token,
+                               const Node::ptr& node, bool expanded);
+    Token::ptr expansionMarker(Token::ptr token, Node::ptr node,
+                               bool expanded);
+    Token::ptr rawReadToken();
     Token::ptr rawNextToken(bool expand = true);
     Node::ptr parseFalseConditional(size_t level,
                           bool sElse = false, bool sOr = false);
-    void setSpecialSymbol(const string& name, const any& value);
+    void setSpecialSymbol(unsigned id, const any& value);
+    void pushBackTokens(const Token::list& tokens);
+    void pushSpan(const Token::list_ptr& tokens, size_t pos);
+    void pushGroupFrame(GroupType groupType);
+    bool parseGroupItem();
     void init();
 
-    typedef std::deque<
-        Token::ptr
-    > TokenQueue;
+    // A list of tokens to be read starting at pos. Pending input is kept
+    // as a stack of such spans, so that pushing back a whole token list
+    // does not copy it
+    struct TokenSpan {
+        TokenSpan(const Token::list_ptr& t, size_t p): tokens(t), pos(p) {}
+        Token::list_ptr tokens;
+        size_t          pos;
+    };
 
-    typedef std::set<
-        Token::ptr
-    > TokenSet;
+    typedef std::vector<
+        TokenSpan
+    > TokenQueue;
 
     typedef std::vector<
         Command::ptr
@@ -302,6 +429,7 @@ protected:
 
     string          m_workdir;
     bool            m_ignoreEmergency;
+    ExpansionMode   m_expansionMode;
 
     shared_ptr<Lexer>   m_lexer;
     shared_ptr<Logger>  m_logger;
@@ -310,8 +438,11 @@ protected:
     Token::list     m_tokenSource;
 
     Token::ptr      m_lastToken;
-    TokenSet        m_noexpandTokens;
+    Token::ptr      m_categoryToken;
+    Token::CatCode  m_category;
+    Token::list     m_noexpandTokens;
     TokenQueue      m_tokenQueue;
+    Token::list_ptr m_spareTokens;
 
     int             m_groupLevel;
     bool            m_end;
@@ -328,32 +459,98 @@ protected:
     vector< ConditionalInfo >
                     m_conditionals;
 
-    typedef unordered_map<
-        string, pair< int, any >
+    // Indexed by symbol id, the first item is the group level
+    // where the symbol was set (-1 for global symbols)
+    typedef vector<
+        pair< int, any >
     > SymbolTable;
 
+    // Symbols with ids past the dense table, i.e. names interned after
+    // the initial symbols and the format (such as \csname names of
+    // documents parsed earlier by the process)
+    typedef unordered_map<
+        unsigned, pair< int, any >
+    > SymbolMap;
+
     typedef vector<
-        pair<string, pair<int, any> >
+        pair<unsigned, pair<int, any> >
     > SymbolStack;
 
+    // Symbols at SYMBOL_FORMAT level hold the index of their value
+    // in the loaded format
+    enum { SYMBOL_UNDEFINED = TEXPP_INT_INV,
+           SYMBOL_FORMAT = TEXPP_INT_INV + 1 };
+    static const unsigned REGISTER_ID_FLAG = 0x80000000u;
+    static unsigned registerType(unsigned id) {
+        return (id & ~REGISTER_ID_FLAG) >> 15; }
+    static unsigned registerNumber(unsigned id) {
+        return id & (REGISTERS_NUMBER - 1); }
+    SymbolTable::reference symbolEntry(unsigned id);
+    const SymbolTable::value_type* findSymbol(unsigned id) const;
+    void growSymbols(SymbolTable& table, unsigned firstId, unsigned size);
+
+    // The symbols set by base::initSymbols, copied to every new parser
+    struct InitialSymbols {
+        InitialSymbols(): ready(false) {}
+        bool            ready;
+        SymbolTable     symbols;
+        SymbolTable     registers[REGISTER_TYPES_NUMBER];
+        any             registerDefaults[REGISTER_TYPES_NUMBER];
+        unordered_map<const Command*, unsigned> primitives;
+    };
+    static InitialSymbols& initialSymbols();
+
+    const any& formatValue(const any& index) const;
+
+    // Dense tables hold the symbols of the shared base and of the
+    // names of the format, other symbols are kept in the map
+    InternOverlay::ptr m_names;
     SymbolTable     m_symbols;
+    SymbolTable     m_formatSymbols;
+    unsigned        m_formatFirstId;
+    SymbolMap       m_extraSymbols;
+    SymbolTable     m_registers[REGISTER_TYPES_NUMBER];
+    any             m_registerDefaults[REGISTER_TYPES_NUMBER];
     SymbolStack     m_symbolsStack;
     vector<size_t>  m_symbolsStackLevels;
+    shared_ptr<base::FormatImage> m_format;
 
     size_t          m_lineNo;
     Mode            m_mode;
     Mode            m_prevMode;
 
     bool            m_hasOutput;
+    int             m_spacefactor;
+
+    int             m_tracingcommands;
+    int             m_tracingmacros;
+    int             m_tracingrestores;
+    int             m_tracingonline;
 
     GroupType       m_currentGroupType;
 
+    // A group being parsed by parseGroup. Nested groups are kept on a
+    // stack of frames instead of recursing
+    struct GroupFrame {
+        GroupType   type;
+        GroupType   prevGroupType;
+        Mode        prevMode;   // restored after GROUP_MATH/GROUP_DMATH
+        Node::ptr   node;
+        Node::ptr   control;    // opening command of GROUP_CUSTOM
+        string      customType;
+    };
+    vector<GroupFrame> m_groupFrames;
+
     string  m_customGroupType;
     bool    m_customGroupBegin;
     bool    m_customGroupEnd;
 
     CommandStack m_commandStack;
 
+    size_t          m_expansionDepth;
+    size_t          m_maxExpansionDepth;
+    vector<Node::ptr> m_expandafterStack;
+
     Interaction m_interaction;
     
     Token::ptr          m_lockToken;
@@ -364,8 +561,6 @@ protected:
 
     static any EMPTY_ANY;
     static string BANNER;
-
-    friend class base::ExpandafterMacro;
 };
 
 } // namespace texpp
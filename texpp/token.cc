@@ -75,6 +75,54 @@ namespace texpp {
 
 string Token::EMPTY_STRING;
 
+Token& Token::operator=(const Token& other)
+{
+    m_type = other.m_type;
+    m_catCode = other.m_catCode;
+    m_lastInLine = other.m_lastInLine;
+    setValueId(other.m_value);
+    setFile(other.m_file);
+    m_linePos = other.m_linePos;
+    m_lineNo = other.m_lineNo;
+    m_charPos = other.m_charPos;
+    m_charEnd = other.m_charEnd;
+    return *this;
+}
+
+void Token::setValueId(unsigned value)
+{
+    if(!Intern::isShared(value)) Intern::ref(value);
+    if(!Intern::isShared(m_value)) Intern::unref(m_value);
+    m_value = value;
+}
+
+void Token::setFile(unsigned file)
+{
+    if(file) SourceFile::ref(file);
+    if(m_file) SourceFile::unref(m_file);
+    m_file = file;
+}
+
+string Token::source() const
+{
+    if(!m_file)
+        return string();
+
+    const SourceFile& file = SourceFile::get(m_file);
+    if(file.kind() == SourceFile::FILE) {
+        if(m_charEnd <= m_charPos)
+            return string();
+        return file.input()->text(m_linePos + m_charPos,
+                                  m_charEnd - m_charPos);
+    }
+    return file.text();
+}
+
+void Token::setSource(const string& source)
+{
+    setFile(SourceFile::create(fileNamePtr(), source));
+}
+
 string Token::texReprControl(const string& name,
                         Parser* parser, bool space)
 {
@@ -91,8 +139,9 @@ string Token::texReprControl(const string& name,
                     if(str.size() > 2) {
                         str += ' ';
                     } else { // str.size() always equals 2 in this case
-                        int cc = parser->symbol("catcode" +
-                            boost::lexical_cast<string>(int(str[1])), int(0));
+                        int cc = parser->symbol(Parser::registerId(
+                            Parser::REGISTER_CATCODE, (unsigned char) str[1]),
+                            int(0));
                         if(cc == Token::CC_LETTER)
                             str += ' ';
                     }
@@ -128,9 +177,9 @@ string Token::texReprList(const Token::list& tokens,
 string Token::texRepr(Parser* parser) const
 {
     if(isControl()) {
-        return Token::texReprControl(m_value, parser);
+        return Token::texReprControl(value(), parser);
     } else if(isCharacter()) {
-        return m_value;
+        return value();
     } else {
         return string();
     }
@@ -139,7 +188,7 @@ string Token::texRepr(Parser* parser) const
 string Token::meaning(Parser* parser) const
 {
     if(isCharacter()) {
-        return catCodeLongNames[m_catCode] + " " + m_value;
+        return catCodeLongNames[m_catCode] + " " + value();
     } else if(isControl()) {
         return texRepr(parser);
     } else if(isSkipped()) {
@@ -153,8 +202,8 @@ string Token::repr() const
     std::ostringstream r;
     r << "Token(Token::" << (m_type < 3 ? typeNames[m_type] : "")
       << ", Token::" << (m_catCode < 16 ? catCodeNames[m_catCode] : "")
-      << ", " << reprString(m_value)
-      << ", " << reprString(m_source)
+      << ", " << reprString(value())
+      << ", " << reprString(source())
       << ", " << m_linePos << ", " << m_lineNo
       << ", " << m_charPos << ", " << m_charEnd << ")";
       //<< ", \"" << reprString(source()) << "\")";
@@ -20,17 +20,26 @@
 #define __TEXPP_TOKEN_H
 
 #include <texpp/common.h>
+#include <texpp/intern.h>
+#include <texpp/inputsource.h>
 #include <boost/pool/singleton_pool.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/cstdint.hpp>
+
+#include <new>
 
 namespace texpp {
 
 class Parser;
 class Token;
 
+void intrusive_ptr_add_ref(const Token* token);
+void intrusive_ptr_release(const Token* token);
+
 class Token
 {
 public:
-    typedef shared_ptr<Token> ptr;
+    typedef boost::intrusive_ptr<Token> ptr;
     typedef vector<Token::ptr> list;
     typedef shared_ptr<list> list_ptr;
 
@@ -68,10 +77,37 @@ public:
             size_t charPos = 0, size_t charEnd = 0,
             bool lastInLine = false,
             shared_ptr<string> fileName = shared_ptr<string>())
-        : m_type(type), m_catCode(catCode), m_value(value), m_source(source),
+        : m_refCount(0), m_type(type), m_catCode(catCode),
+          m_lastInLine(lastInLine), m_noexpand(false),
+          m_value(Intern::id(value)),
+          m_file(SourceFile::create(fileName, source)),
           m_linePos(linePos), m_lineNo(lineNo),
-          m_charPos(charPos), m_charEnd(charEnd),
-          m_lastInLine(lastInLine), m_fileName(fileName) {}
+          m_charPos(charPos), m_charEnd(charEnd) {
+        if(!Intern::isShared(m_value)) Intern::ref(m_value);
+        if(m_file) SourceFile::ref(m_file);
+    }
+
+    Token(const Token& other)
+        : m_refCount(0), m_type(other.m_type), m_catCode(other.m_catCode),
+          m_lastInLine(other.m_lastInLine), m_noexpand(false),
+          m_value(other.m_value),
+          m_file(other.m_file),
+          m_linePos(other.m_linePos), m_lineNo(other.m_lineNo),
+          m_charPos(other.m_charPos), m_charEnd(other.m_charEnd) {
+        if(!Intern::isShared(m_value)) Intern::ref(m_value);
+        if(m_file) SourceFile::ref(m_file);
+    }
+
+    ~Token() {
+        if(!Intern::isShared(m_value)) Intern::unref(m_value);
+        if(m_file) SourceFile::unref(m_file);
+    }
+
+    Token& operator=(const Token& other);
+
+    // Tokens are allocated from a locked pool shared by all parsers
+    static void* operator new(size_t size);
+    static void operator delete(void* p, size_t size);
 
     static Token::ptr create(Type type = TOK_SKIPPED,
             CatCode catCode = CC_INVALID,
@@ -85,18 +121,31 @@ public:
                 );
     }
 
-    Type type() const { return m_type; }
+    Type type() const { return Type(m_type); }
     void setType(Type type) { m_type = type; }
 
-    CatCode catCode() const { return m_catCode; }
+    CatCode catCode() const { return CatCode(m_catCode); }
     void setCatCode(CatCode catCode) { m_catCode = catCode; }
 
-    const string& value() const { return m_value; }
-    void setValue(const string& value) { m_value = value; }
+    const string& value() const { return Intern::str(m_value); }
+    void setValue(const string& value) { setValueId(Intern::id(value)); }
 
-    const string& source() const { return m_source; }
-    void setSource(const string& source) { m_source = source; }
+    // Interned id of the value
+    unsigned valueId() const { return m_value; }
+    void setValueId(unsigned value);
 
+    // The source is materialized on request from the SourceFile
+    string source() const;
+    void setSource(const string& source);
+
+    unsigned file() const { return m_file; }
+    void setFile(unsigned file);
+
+    // Tokens read from a file have the offset of their line in linePos
+    // and their position in that line in charPos and charEnd. Skipped
+    // tokens marking an expansion (see Parser::ExpansionMode) may instead
+    // reference a span of the file covering several lines: their lineNo
+    // is 0, linePos is the offset of the span and charEnd is its length
     size_t linePos() const { return m_linePos; }
     void setLinePos(size_t linePos) { m_linePos = linePos; }
 
@@ -114,33 +163,51 @@ public:
     bool isCharacter() const { return m_type == TOK_CHARACTER; }
 
     bool isCharacter(char c) const {
-        return m_type == TOK_CHARACTER && m_value[0] == c;
+        return m_type == TOK_CHARACTER && m_value == Intern::id(c);
     }
 
     bool isCharacter(char c, CatCode cat) const {
-        return m_type == TOK_CHARACTER && m_value[0] == c && m_catCode == cat;
+        return m_type == TOK_CHARACTER && m_value == Intern::id(c)
+                                       && m_catCode == cat;
     }
 
     bool isCharacterCat(CatCode cat) {
         return m_type == TOK_CHARACTER && m_catCode == cat;
     }
 
+    // Tokens with the same type, category and value are treated
+    // as equal when matching macro parameters
+    bool isSame(const Token& other) const {
+        return m_type == other.m_type && m_catCode == other.m_catCode &&
+               m_value == other.m_value;
+    }
+
     bool isLastInLine() const { return m_lastInLine; }
 
+    // Marks this token instance as not expandable (see \noexpand)
+    bool isNoexpand() const { return m_noexpand; }
+    void setNoexpand(bool noexpand) { m_noexpand = noexpand; }
+
     const string& fileName() const {
-        return m_fileName ? *m_fileName : EMPTY_STRING;
+        return m_file ? SourceFile::get(m_file).name() : EMPTY_STRING;
+    }
+    shared_ptr<string> fileNamePtr() const {
+        return m_file ? SourceFile::get(m_file).namePtr()
+                      : shared_ptr<string>();
     }
-    shared_ptr<string> fileNamePtr() const { return m_fileName; }
 
     string texRepr(Parser* parser = NULL) const;
     string meaning(Parser* parser = NULL) const;
     string repr() const;
 
     Token::ptr lcopy() const {
-        return Token::create(
-            m_type, m_catCode, m_value, "", 0, 0, 0, 0,
-            //m_lineNo, m_charEnd, m_charEnd,
-            m_lastInLine, m_fileName);
+        Token::ptr token(new Token(*this));
+        token->m_linePos = token->m_lineNo = 0;
+        token->m_charPos = token->m_charEnd = 0;
+        // Span of FILE or NAME source with zero positions is empty
+        if(m_file && SourceFile::get(m_file).kind() == SourceFile::TEXT)
+            token->setFile(SourceFile::named(fileNamePtr()));
+        return token;
     }
 
     static string texReprControl(const string& name,
@@ -149,23 +216,60 @@ public:
             Parser* parser = NULL, bool param = false, size_t limit = 0);
 
 protected:
-    Type        m_type;
-    CatCode     m_catCode;
-    string      m_value;
-    string      m_source;
+    // Not atomic, tokens are used from one thread (see Parser)
+    mutable boost::uint32_t m_refCount;
 
-    size_t      m_linePos;
-    size_t      m_lineNo;
-    size_t      m_charPos;
-    size_t      m_charEnd;
+    unsigned char   m_type;
+    unsigned char   m_catCode;
+    bool            m_lastInLine;
+    bool            m_noexpand;
 
-    bool        m_lastInLine;
+    boost::uint32_t m_value;
+    boost::uint32_t m_file;
 
-    shared_ptr<string> m_fileName;
+    boost::uint32_t m_linePos;
+    boost::uint32_t m_lineNo;
+    boost::uint32_t m_charPos;
+    boost::uint32_t m_charEnd;
 
     static string EMPTY_STRING;
+
+    friend void intrusive_ptr_add_ref(const Token* token);
+    friend void intrusive_ptr_release(const Token* token);
 };
 
+typedef boost::singleton_pool<Token, sizeof(Token),
+            boost::default_user_allocator_new_delete,
+            boost::details::pool::default_mutex, 1024, 65536> TokenPool;
+
+inline void* Token::operator new(size_t size)
+{
+    if(size != sizeof(Token))
+        return ::operator new(size);
+    void* p = TokenPool::malloc();
+    if(!p) throw std::bad_alloc();
+    return p;
+}
+
+inline void Token::operator delete(void* p, size_t size)
+{
+    if(size != sizeof(Token))
+        ::operator delete(p);
+    else
+        TokenPool::free(p);
+}
+
+inline void intrusive_ptr_add_ref(const Token* token)
+{
+    ++token->m_refCount;
+}
+
+inline void intrusive_ptr_release(const Token* token)
+{
+    if(--token->m_refCount == 0)
+        delete token;
+}
+
 } // namespace texpp
 
 #endif
@@ -17,8 +17,8 @@
 */
 
 #include <boost/python.hpp>
-#include <boost/any.hpp>
 
+#include <texpp/common.h>
 #include <texpp/command.h>
 
 #include <string>
@@ -27,25 +27,25 @@ namespace {
 
   struct boost_any_to_python_object
   {
-    static PyObject* convert(const boost::any& s)
+    static PyObject* convert(const texpp::any& s)
     {
       using namespace boost::python;
       using namespace texpp;
 
       if(s.empty())
           return incref(object().ptr());
-      else if(s.type() == typeid(int))
-          return incref(object(*boost::unsafe_any_cast<int>(&s)).ptr());
-      else if(s.type() == typeid(short))
-          return incref(object(*boost::unsafe_any_cast<short>(&s)).ptr());
-      else if(s.type() == typeid(long))
-          return incref(object(*boost::unsafe_any_cast<long>(&s)).ptr());
-      else if(s.type() == typeid(std::string))
-          return incref(object(*boost::unsafe_any_cast<std::string>(&s)).ptr());
-      else if(s.type() == typeid(object))
-          return incref(boost::unsafe_any_cast<object>(&s)->ptr());
-      else if(s.type() == typeid(Command::ptr))
-          return incref(object(boost::unsafe_any_cast<Command::ptr>(&s)).ptr());
+      else if(s.is<int>())
+          return incref(object(*unsafe_any_cast<int>(&s)).ptr());
+      else if(s.is<short>())
+          return incref(object(*unsafe_any_cast<short>(&s)).ptr());
+      else if(s.is<long>())
+          return incref(object(*unsafe_any_cast<long>(&s)).ptr());
+      else if(s.is<std::string>())
+          return incref(object(*unsafe_any_cast<std::string>(&s)).ptr());
+      else if(s.is<object>())
+          return incref(unsafe_any_cast<object>(&s)->ptr());
+      else if(s.is<Command::ptr>())
+          return incref(object(unsafe_any_cast<Command::ptr>(&s)).ptr());
       else
           return incref(object(reprAny(s)).ptr());
     }
@@ -59,7 +59,7 @@ namespace {
       converter::registry::push_back(
         &convertible,
         &construct,
-        type_id< boost::any >());
+        type_id< texpp::any >());
     }
 
     static void *convertible(PyObject *obj_ptr) {
@@ -74,18 +74,18 @@ namespace {
       using namespace texpp;
 
       typedef converter::rvalue_from_python_storage<
-                            boost::any > rvalue_t;
+                            texpp::any > rvalue_t;
       void *storage = ((rvalue_t *) data)->storage.bytes;
 
       if(obj_ptr == Py_None) {
           // Empty
-          new (storage) boost::any();
+          new (storage) texpp::any();
       } else if(PyInt_Check(obj_ptr)) {
           // Int
-          new (storage) boost::any(int(PyInt_AS_LONG(obj_ptr)));
+          new (storage) texpp::any(int(PyInt_AS_LONG(obj_ptr)));
       } else if(PyString_Check(obj_ptr)) {
           // String
-          new (storage) boost::any(std::string(
+          new (storage) texpp::any(std::string(
             PyString_AS_STRING(obj_ptr), PyString_GET_SIZE(obj_ptr) ));
       } else {
           // try extract Command
@@ -93,10 +93,10 @@ namespace {
 
           extract<Command::ptr> cmd(any_object);
           if(cmd.check()) {
-              new (storage) boost::any(Command::ptr(cmd));
+              new (storage) texpp::any(Command::ptr(cmd));
           } else {
               // fallback
-              new (storage) boost::any(any_object);
+              new (storage) texpp::any(any_object);
           }
       }
 
@@ -110,7 +110,7 @@ void export_boost_any()
     using namespace boost::python;
 
     to_python_converter<
-        boost::any,
+        texpp::any,
         boost_any_to_python_object>();
 
     python_object_to_boost_any::register_conversion();
@@ -94,6 +94,7 @@ void export_command()
         .def("__repr__", &Command::repr)
         .def("name", &Command::name,
             return_value_policy<copy_const_reference>())
+        .def("flags", &Command::flags)
         .def("texRepr", &Command::texRepr,
                     &CommandWrap<Command>::default_texRepr)
         .def("invoke", &Command::invoke,
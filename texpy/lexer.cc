@@ -44,8 +44,7 @@ void export_lexer()
                 return_value_policy<copy_const_reference>())
         .def("line", (const string& (Lexer::*)() const) &Lexer::line,
                 return_value_policy<copy_const_reference>())
-        .def("line", (const string& (Lexer::*)(size_t) const) &Lexer::line,
-                return_value_policy<copy_const_reference>())
+        .def("line", (string (Lexer::*)(size_t) const) &Lexer::line)
         .def("lineNo", &Lexer::lineNo)
         .def("endlinechar", &Lexer::endlinechar)
         .def("setEndlinechar", &Lexer::setEndlinechar)
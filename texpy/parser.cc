@@ -19,7 +19,6 @@
 #include <boost/python.hpp>
 #include <texpp/parser.h>
 
-#include <boost/any.hpp>
 #include <memory>
 
 #include <boost/python/suite/indexing/vector_indexing_suite.hpp>
@@ -138,7 +137,6 @@ void export_parser()
 {
     using namespace boost::python;
     using namespace texpp;
-    using boost::any;
 
     export_node();
 
@@ -150,7 +148,15 @@ void export_parser()
         .def(init<std::string, shared_ptr<std::istream>, std::string >())
         .def(init<std::string, shared_ptr<std::istream> >())
 
-        .def("parse", &Parser::parse)
+        .def("parse", (Node::ptr (Parser::*)())(&Parser::parse))
+        .def("parse", (Node::ptr (Parser::*)(Parser::ExpansionMode))(
+                        &Parser::parse))
+
+        .def("expansionMode", &Parser::expansionMode)
+        .def("setExpansionMode", &Parser::setExpansionMode)
+        .def("expansionDepth", &Parser::expansionDepth)
+        .def("maxExpansionDepth", &Parser::maxExpansionDepth)
+        .def("setMaxExpansionDepth", &Parser::setMaxExpansionDepth)
 
         .def("workdir", &Parser::workdir,
             return_value_policy<copy_const_reference>())
@@ -197,6 +203,12 @@ void export_parser()
 
         .def("input", &Parser::input)
 
+        // Formats
+        .def("dumpFormat", (bool (Parser::*)(const string&))(
+                        &Parser::dumpFormat))
+        .def("loadFormat", (bool (Parser::*)(const string&))(
+                        &Parser::loadFormat))
+
         .def("end", &Parser::end)
         ;
 
@@ -208,6 +220,12 @@ void export_parser()
         .value("MATH", Parser::MATH)
         ;
 
+    enum_<Parser::ExpansionMode>("ExpansionMode")
+        .value("EXPANSION_FULL", Parser::EXPANSION_FULL)
+        .value("EXPANSION_SPANS", Parser::EXPANSION_SPANS)
+        .value("EXPANSION_NONE", Parser::EXPANSION_NONE)
+        ;
+
     enum_<Parser::GroupType>("GroupType")
         .value("NORMAL", Parser::GROUP_NORMAL)
         .value("MATH", Parser::GROUP_MATH)